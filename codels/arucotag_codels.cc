@@ -52,6 +52,243 @@ set_length(float length, arucotag_detector_s **detect,
 }
 
 
+/* --- Attribute set_tracking ------------------------------------------ */
+
+/** Validation codel set_tracking of attribute set_tracking.
+ *
+ * Returns genom_ok.
+ * Throws arucotag_e_io.
+ */
+genom_event
+set_tracking(bool enable, float pad, uint16_t rescan,
+             arucotag_detector_s **detect, const genom_context self)
+{
+    if (pad < 0 || rescan < 1)
+    {
+        arucotag_e_io_detail d;
+        snprintf(d.what, sizeof(d.what), "%s", "padding must be positive and rescan at least 1");
+        warnx("io error: %s", d.what);
+        return arucotag_e_io(&d,self);
+    }
+
+    (*detect)->opt.track = enable;
+    (*detect)->opt.track_pad = pad;
+    (*detect)->opt.track_rescan = rescan;
+
+    return genom_ok;
+}
+
+
+/* --- Attribute set_decimation ---------------------------------------- */
+
+/** Validation codel set_decimation of attribute set_decimation.
+ *
+ * Returns genom_ok.
+ * Throws arucotag_e_io.
+ */
+genom_event
+set_decimation(uint16_t decimation, arucotag_detector_s **detect,
+               const genom_context self)
+{
+    if (decimation != 1 && decimation != 2 && decimation != 4 && decimation != 8)
+    {
+        arucotag_e_io_detail d;
+        snprintf(d.what, sizeof(d.what), "%s", "decimation must be 1, 2, 4 or 8");
+        warnx("io error: %s", d.what);
+        return arucotag_e_io(&d,self);
+    }
+
+    (*detect)->opt.decimation = decimation;
+
+    return genom_ok;
+}
+
+
+/* --- Attribute set_codec -------------------------------------------- */
+
+/** Validation codel set_codec of attribute set_codec.
+ *
+ * Returns genom_ok.
+ * Throws arucotag_e_io.
+ */
+genom_event
+set_codec(int16_t codec, arucotag_detector_s **detect,
+          const genom_context self)
+{
+    const char *what = NULL;
+    if (codec < 0 || codec > 1)
+        what = "codec must be 0 or 1";
+#ifndef HAVE_LIBJPEG
+    else if (codec == 1)
+        what = "jpeg codec not available, libjpeg was not found at build time";
+#endif
+    if (what)
+    {
+        arucotag_e_io_detail d;
+        snprintf(d.what, sizeof(d.what), "%s", what);
+        warnx("io error: %s", d.what);
+        return arucotag_e_io(&d,self);
+    }
+
+    (*detect)->opt.codec = codec;
+
+    return genom_ok;
+}
+
+
+/* --- Attribute set_gray16 ------------------------------------------- */
+
+/** Validation codel set_gray16 of attribute set_gray16.
+ *
+ * Returns genom_ok.
+ * Throws arucotag_e_io.
+ */
+genom_event
+set_gray16(int16_t mode, uint16_t shift, uint16_t low, uint16_t high,
+           arucotag_detector_s **detect, const genom_context self)
+{
+    const char *what = NULL;
+    if (mode < 0 || mode > 1)
+        what = "mode must be 0 or 1";
+    else if (shift > 8)
+        what = "shift must be at most 8";
+    else if (low >= high)
+        what = "window must have low < high";
+    if (what)
+    {
+        arucotag_e_io_detail d;
+        snprintf(d.what, sizeof(d.what), "%s", what);
+        warnx("io error: %s", d.what);
+        return arucotag_e_io(&d,self);
+    }
+
+    (*detect)->opt.gray16_mode = mode;
+    (*detect)->opt.gray16_shift = shift;
+    (*detect)->opt.gray16_low = low;
+    (*detect)->opt.gray16_high = high;
+
+    return genom_ok;
+}
+
+
+/* --- Attribute set_detector ------------------------------------------ */
+
+/** Validation codel set_detector of attribute set_detector.
+ *
+ * Returns genom_ok.
+ * Throws arucotag_e_io.
+ */
+genom_event
+set_detector(uint16_t win_min, uint16_t win_max, uint16_t win_step,
+             double min_perimeter, double max_perimeter,
+             double approx_accuracy, int16_t refinement,
+             arucotag_detector_s **detect, const genom_context self)
+{
+    const char *what = NULL;
+    if (win_min < 3 || win_max < win_min || win_step < 1)
+        what = "window sizes must be at least 3, with max >= min and step >= 1";
+    else if (min_perimeter <= 0 || max_perimeter <= min_perimeter)
+        what = "perimeters must be positive, with max > min";
+    else if (approx_accuracy <= 0)
+        what = "approximation accuracy must be positive";
+    else if (refinement < aruco::CORNER_REFINE_NONE || refinement > aruco::CORNER_REFINE_APRILTAG)
+        what = "refinement must be 0, 1, 2 or 3";
+    if (what)
+    {
+        arucotag_e_io_detail d;
+        snprintf(d.what, sizeof(d.what), "%s", what);
+        warnx("io error: %s", d.what);
+        return arucotag_e_io(&d,self);
+    }
+
+    // Build new parameters rather than modifying the current ones, which may
+    // be in use by the pipeline
+    Ptr<aruco::DetectorParameters> params = aruco::DetectorParameters::create();
+    *params = *(*detect)->opt.params;
+    params->adaptiveThreshWinSizeMin = win_min;
+    params->adaptiveThreshWinSizeMax = win_max;
+    params->adaptiveThreshWinSizeStep = win_step;
+    params->minMarkerPerimeterRate = min_perimeter;
+    params->maxMarkerPerimeterRate = max_perimeter;
+    params->polygonalApproxAccuracyRate = approx_accuracy;
+    params->cornerRefinementMethod = refinement;
+    (*detect)->opt.params = params;
+
+    return genom_ok;
+}
+
+
+/* --- Attribute set_filter ------------------------------------------- */
+
+/** Validation codel set_filter of attribute set_filter.
+ *
+ * Returns genom_ok.
+ */
+genom_event
+set_filter(bool filter, arucotag_detector_s **detect,
+           const genom_context self)
+{
+    (*detect)->filter = filter;
+    (*detect)->update_filter();
+
+    return genom_ok;
+}
+
+
+/* --- Attribute set_history ------------------------------------------ */
+
+/** Validation codel set_history of attribute set_history.
+ *
+ * Returns genom_ok.
+ * Throws arucotag_e_io.
+ */
+genom_event
+set_history(uint16_t size, uint16_t age, double age_time,
+            arucotag_detector_s **detect, const genom_context self)
+{
+    if (size < 1 || size > arucotag_hist_max || age_time < 0)
+    {
+        arucotag_e_io_detail d;
+        snprintf(d.what, sizeof(d.what), "history size must be in [1, %d] and age time positive",
+                 arucotag_hist_max);
+        warnx("io error: %s", d.what);
+        return arucotag_e_io(&d,self);
+    }
+
+    (*detect)->hist_size = size;
+    (*detect)->hist_age = age;
+    (*detect)->hist_age_time = age_time;
+
+    return genom_ok;
+}
+
+
+/* --- Attribute set_workers ------------------------------------------- */
+
+/** Validation codel set_workers of attribute set_workers.
+ *
+ * Returns genom_ok.
+ * Throws arucotag_e_io.
+ */
+genom_event
+set_workers(uint16_t workers, arucotag_detector_s **detect,
+            const genom_context self)
+{
+    unsigned int cores = thread::hardware_concurrency();
+    if (cores && workers > cores)
+    {
+        arucotag_e_io_detail d;
+        snprintf(d.what, sizeof(d.what), "%s", "more workers than available cores");
+        warnx("io error: %s", d.what);
+        return arucotag_e_io(&d,self);
+    }
+
+    (*detect)->pool.resize(workers);
+
+    return genom_ok;
+}
+
+
 /* --- Attribute output_frame ------------------------------------------- */
 
 /** Validation codel output_frame of attribute output_frame.
@@ -71,6 +308,149 @@ output_frame(int16_t out_frame, const genom_context self)
 }
 
 
+/* --- Attribute set_poll_mode ----------------------------------------- */
+
+/** Validation codel set_poll_mode of attribute set_poll_mode.
+ *
+ * Returns genom_ok.
+ * Throws arucotag_e_sys.
+ */
+genom_event
+set_poll_mode(int16_t poll_mode, const genom_context self)
+{
+    if (poll_mode < 0 || poll_mode > 1) {
+        warnx("wrong poll mode value (allowed: 0, 1)");
+        errno = EDOM;
+        return arucotag_e_sys_error("wrong value", self);
+    }
+    return genom_ok;
+}
+
+
+/* --- Attribute set_timing -------------------------------------------- */
+
+/** Validation codel set_timing of attribute set_timing.
+ *
+ * Returns genom_ok.
+ * Throws arucotag_e_io.
+ */
+genom_event
+set_timing(bool enable, double period, arucotag_timing_s **timing,
+           arucotag_detector_s **detect, const genom_context self)
+{
+    if (!(period > 0))
+    {
+        arucotag_e_io_detail d;
+        snprintf(d.what, sizeof(d.what), "%s", "publication period must be positive");
+        warnx("io error: %s", d.what);
+        return arucotag_e_io(&d,self);
+    }
+
+    (*timing)->enable = enable;
+    (*timing)->period = period;
+    (*detect)->opt.timing = enable;
+
+    return genom_ok;
+}
+
+
+/* --- Function poll_info ----------------------------------------------- */
+
+/** Codel poll_info of function poll_info.
+ *
+ * Returns genom_ok.
+ */
+genom_event
+poll_info(const arucotag_poll_s *poll, double *period, double *latency,
+          double *latency_max, double *reads, const genom_context self)
+{
+    *period = *latency = *latency_max = *reads = 0;
+    if (poll) {
+        *period = poll->period;
+        *latency = poll->latency;
+        *latency_max = poll->latency_max;
+        if (poll->frames)
+            *reads = (double)poll->reads / poll->frames;
+    }
+    return genom_ok;
+}
+
+
+/* --- Function ingest_info -------------------------------------------- */
+
+/** Codel ingest_info of function ingest_info.
+ *
+ * Returns genom_ok.
+ */
+genom_event
+ingest_info(const arucotag_detector_s *detect, uint32_t *copied,
+            double *copied_mean, uint32_t *frames, double *time,
+            double *time_max, const genom_context self)
+{
+    *copied = *frames = 0;
+    *copied_mean = *time = *time_max = 0;
+    if (detect) {
+        *copied = detect->ingest_info.copied;
+        *frames = detect->ingest_info.frames;
+        if (detect->ingest_info.frames)
+            *copied_mean = (double)detect->ingest_info.copied_total / detect->ingest_info.frames;
+        *time = detect->ingest_info.time;
+        *time_max = detect->ingest_info.time_max;
+    }
+    return genom_ok;
+}
+
+
+/* --- Function filter_info -------------------------------------------- */
+
+/** Codel filter_info of function filter_info.
+ *
+ * Returns genom_ok.
+ */
+genom_event
+filter_info(const arucotag_detector_s *detect, uint32_t *rejected,
+            double *rejected_mean, const genom_context self)
+{
+    *rejected = 0;
+    *rejected_mean = 0;
+    if (detect) {
+        *rejected = detect->rejected;
+        if (detect->ingest_info.frames)
+            *rejected_mean = (double)detect->rejected_total / detect->ingest_info.frames;
+    }
+    return genom_ok;
+}
+
+
+/* --- Function timing_info ------------------------------------------- */
+
+/** Codel timing_info of function timing_info.
+ *
+ * Returns genom_ok.
+ */
+genom_event
+timing_info(const arucotag_timing_s *timing,
+            arucotag_stage_latency_s *stages, const genom_context self)
+{
+    timing->fill(stages);
+    return genom_ok;
+}
+
+
+/* --- Function timing_reset ------------------------------------------- */
+
+/** Codel timing_reset of function timing_reset.
+ *
+ * Returns genom_ok.
+ */
+genom_event
+timing_reset(arucotag_timing_s **timing, const genom_context self)
+{
+    (*timing)->reset();
+    return genom_ok;
+}
+
+
 /* --- Function stop ---------------------------------------------------- */
 
 /** Codel stop of function stop.
@@ -107,30 +487,40 @@ resume(bool *stopped, const genom_context self)
  * Throws arucotag_e_sys.
  */
 genom_event
-log_start(const char path[64], uint32_t decimation,
-          arucotag_log_s **log, const genom_context self)
+log_start(const char path[64], uint32_t decimation, bool binary,
+          uint32_t capacity, uint32_t rotate, arucotag_log_s **log,
+          const genom_context self)
 {
     int fd;
 
-    fd = open(path, O_WRONLY|O_APPEND|O_CREAT|O_TRUNC, 0666);
+    (*log)->stop();
+    fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0666);
     if (fd < 0) return arucotag_e_sys_error(path, self);
 
-    if (write(fd, arucotag_log_header "\n", sizeof(arucotag_log_header)) < 0)
-        return arucotag_e_sys_error(path, self);
+    // Each file of the rotation starts with the same header
+    vector<char> header;
+    if (binary)
+    {
+        arucotag_log_file h = {};
+        memcpy(h.magic, arucotag_log_magic, sizeof(h.magic));
+        h.version = arucotag_log_version;
+        h.frame_size = sizeof(arucotag_log_frame);
+        h.tag_size = sizeof(arucotag_log_tag);
+        header.assign((const char *)&h, (const char *)&h + sizeof(h));
+    }
+    else
+        header.assign(arucotag_log_header "\n", arucotag_log_header "\n" + sizeof(arucotag_log_header));
 
-    if ((*log)->req.aio_fildes >= 0)
+    if (write(fd, header.data(), header.size()) < 0)
     {
-        close((*log)->req.aio_fildes);
-        if ((*log)->pending)
-            while (aio_error(&(*log)->req) == EINPROGRESS)
-              /* empty body */;
-    }
-    (*log)->req.aio_fildes = fd;
-    (*log)->pending = false;
-    (*log)->skipped = false;
+        genom_event e = arucotag_e_sys_error(path, self);
+        close(fd);
+        return e;
+    }
+
+    (*log)->binary = binary;
     (*log)->decimation = decimation < 1 ? 1 : decimation;
-    (*log)->missed = 0;
-    (*log)->total = 0;
+    (*log)->start(path, fd, header, capacity, rotate);
     warnx("logging started to %s", path);
     return genom_ok;
 }
@@ -145,9 +535,8 @@ log_start(const char path[64], uint32_t decimation,
 genom_event
 log_stop(arucotag_log_s **log, const genom_context self)
 {
-    if (*log && (*log)->req.aio_fildes >= 0)
-        close((*log)->req.aio_fildes);
-    (*log)->req.aio_fildes = -1;
+    if (*log)
+        (*log)->stop();
 
     warnx("logging terminated");
     return genom_ok;
@@ -162,12 +551,76 @@ log_stop(arucotag_log_s **log, const genom_context self)
  */
 genom_event
 log_info(const arucotag_log_s *log, uint32_t *miss, uint32_t *total,
-         const genom_context self)
+         uint32_t *capacity, uint32_t *high_water, double *throughput,
+         bool *uring, const genom_context self)
 {
-    *miss = *total = 0;
+    *miss = *total = *capacity = *high_water = 0;
+    *throughput = 0;
+    *uring = false;
     if (log) {
         *miss = log->missed;
         *total = log->total;
+        *capacity = log->ring ? log->ring->capacity() : 0;
+        *high_water = log->high_water;
+        if (log->running) {
+            *throughput = log->throughput();
+            *uring = log->uring;
+        }
+    }
+    return genom_ok;
+}
+
+
+/* --- Function record_info --------------------------------------------- */
+
+/** Codel record_info of function record_info.
+ *
+ * Returns genom_ok.
+ */
+genom_event
+record_info(const arucotag_record_s *record, uint32_t *frames,
+            uint64_t *bytes, double *wait_mean, double *wait_max,
+            const genom_context self)
+{
+    *frames = 0;
+    *bytes = 0;
+    *wait_mean = *wait_max = 0;
+    if (record) {
+        *frames = record->frames;
+        *bytes = record->bytes;
+        if (record->frames)
+            *wait_mean = record->wait_ns * 1e-9 / record->frames;
+        *wait_max = record->wait_max_ns * 1e-9;
+    }
+    return genom_ok;
+}
+
+
+/* --- Function camera_info --------------------------------------------- */
+
+/** Codel camera_info of function camera_info.
+ *
+ * Returns genom_ok.
+ * Throws arucotag_e_sys.
+ */
+genom_event
+camera_info(const arucotag_cameras_s *cameras,
+            sequence_arucotag_camera_info_s *list, const genom_context self)
+{
+    list->_length = 0;
+    if (!cameras)
+        return genom_ok;
+
+    if (genom_sequence_reserve(list, cameras->list.size()))
+        return arucotag_e_sys_error("camera_info", self);
+    for (auto &c : cameras->list)
+    {
+        arucotag_camera_info_s &info = list->_buffer[list->_length++];
+        snprintf(info.name, sizeof(info.name), "%s", c->name);
+        info.calibrated = c->calibrated;
+        info.frames = c->frames;
+        info.processed = c->processed;
+        info.dropped = c->pipe.dropped;
     }
     return genom_ok;
 }
@@ -31,38 +31,103 @@
 #include <cmath>
 
 /* --- Helper func ------------------------------------------------------ */
-void update_calib(const arucotag_intrinsics *intrinsics,
-                  const arucotag_extrinsics *extrinsics,
-                  arucotag_calib_s **calib, const genom_context self)
+
+/* Rotation of the given roll, pitch and yaw angles, R = Rz(y) Ry(p) Rx(r) */
+static Matrix3d
+rpy_matrix(double r, double p, double y)
+{
+    Matrix3d R;
+    R <<
+        cos(p)*cos(y), sin(r)*sin(p)*cos(y) - cos(r)*sin(y), cos(r)*sin(p)*cos(y) + sin(r)*sin(y),
+        cos(p)*sin(y), sin(r)*sin(p)*sin(y) + cos(r)*cos(y), cos(r)*sin(p)*sin(y) - sin(r)*cos(y),
+              -sin(p),                        sin(r)*cos(p),                        cos(r)*cos(p);
+    return R;
+}
+
+static void
+update_calib(const or_sensor_intrinsics *intrinsics,
+             const or_sensor_extrinsics *extrinsics, arucotag_calib_s *calib)
 {
     // Init intr
-    or_sensor_calibration* c = &(intrinsics->data(self)->calib);
-    (*calib)->K_cv = (Mat_<float>(3,3) <<
+    const or_sensor_calibration* c = &intrinsics->calib;
+    calib->K_cv = (Mat_<float>(3,3) <<
         c->fx, c->gamma, c->cx,
             0,    c->fy, c->cy,
             0,        0,     1
     );
-    cv2eigen((*calib)->K_cv, (*calib)->K);
-    (*calib)->D = (Mat_<float>(5,1) <<
-        intrinsics->data(self)->disto.k1,
-        intrinsics->data(self)->disto.k2,
-        intrinsics->data(self)->disto.k3,
-        intrinsics->data(self)->disto.p1,
-        intrinsics->data(self)->disto.p2
+    cv2eigen(calib->K_cv, calib->K);
+    calib->D = (Mat_<float>(5,1) <<
+        intrinsics->disto.k1,
+        intrinsics->disto.k2,
+        intrinsics->disto.k3,
+        intrinsics->disto.p1,
+        intrinsics->disto.p2
     );
+    calib->cam.fx = calib->K_cv.at<float>(0,0);
+    calib->cam.fy = calib->K_cv.at<float>(1,1);
+    calib->cam.cx = calib->K_cv.at<float>(0,2);
+    calib->cam.cy = calib->K_cv.at<float>(1,2);
+    for (int i = 0; i < 5; i++)
+        calib->cam.d[i] = calib->D.at<float>(i);
 
     // Init extr
-    (*calib)->B_p_C <<
-        extrinsics->data(self)->trans.tx,
-        extrinsics->data(self)->trans.ty,
-        extrinsics->data(self)->trans.tz;
-    float r = extrinsics->data(self)->rot.roll;
-    float p = extrinsics->data(self)->rot.pitch;
-    float y = extrinsics->data(self)->rot.yaw;
-    (*calib)->B_R_C <<
-        cos(p)*cos(y), sin(r)*sin(p)*cos(y) - cos(r)*sin(y), cos(r)*sin(p)*cos(y) + sin(r)*sin(y),
-        cos(p)*sin(y), sin(r)*sin(p)*sin(y) + cos(r)*cos(y), cos(r)*sin(p)*sin(y) - sin(r)*cos(y),
-              -sin(p),                        sin(r)*cos(p),                        cos(r)*cos(p);
+    calib->B_p_C <<
+        extrinsics->trans.tx,
+        extrinsics->trans.ty,
+        extrinsics->trans.tz;
+    float r = extrinsics->rot.roll;
+    float p = extrinsics->rot.pitch;
+    float y = extrinsics->rot.yaw;
+    calib->B_R_C = rpy_matrix(r, p, y);
+}
+
+
+/* Sleep until the given monotonic time, or until the pipeline of the frame
+ * port or of some other camera has results.
+ * Returns true if a pipeline has results.
+ */
+static bool
+poll_sleep(const arucotag_pipeline_s *pipe, const arucotag_cameras_s *cameras,
+           const timespec &until)
+{
+    if (!cameras->list.empty())
+        return cameras->wait(pipe, until);
+    if (pipe->running)
+        return pipe->wait(until);
+
+    sleep_until(until);
+    return false;
+}
+
+
+/* Read the frames of the other cameras and send the new ones to their
+ * pipelines. A camera is calibrated from its ports before its first frame.
+ */
+static void
+poll_cameras(arucotag_ports &io, arucotag_cameras_s *cameras,
+             const arucotag_detector_s *detect)
+{
+    for (auto &c : cameras->list)
+    {
+        if (!c->calibrated)
+        {
+            const or_sensor_intrinsics *intrinsics = io.read_camera_intrinsics(c->name);
+            const or_sensor_extrinsics *extrinsics =
+                intrinsics ? io.read_camera_extrinsics(c->name) : NULL;
+            if (!extrinsics) continue;
+            update_calib(intrinsics, extrinsics, &c->calib);
+            c->calibrated = true;
+        }
+
+        const or_sensor_frame *fdata = io.read_camera(c->name);
+        if (fdata && fdata->pixels._length &&
+            (fdata->ts.nsec != c->last_ts.nsec || fdata->ts.sec != c->last_ts.sec))
+        {
+            c->last_ts = fdata->ts;
+            c->frames++;
+            c->pipe.push(fdata, detect->opt);
+        }
+    }
 }
 
 
@@ -80,11 +145,42 @@ detect_start(arucotag_ids *ids, const genom_context self)
     // Init IDS fields
     ids->tag_info.length = 0;
     ids->tag_info.s_pix = 2;
+    ids->track.enable = false;
+    ids->track.pad = 0.5;
+    ids->track.rescan = 10;
+    ids->decimation = 1;
+    ids->codec = 0;
+    ids->filter = false;
+    ids->history.size = 10;
+    ids->history.age = 10;
+    ids->history.age_time = 0;
+    ids->gray16.mode = 0;
+    ids->gray16.shift = 8;
+    ids->gray16.low = 0;
+    ids->gray16.high = 65535;
+    ids->params.win_min = 3;
+    ids->params.win_max = 23;
+    ids->params.win_step = 10;
+    ids->params.min_perimeter = 0.03;
+    ids->params.max_perimeter = 4;
+    ids->params.approx_accuracy = 0.03;
+    ids->params.refinement = 0;
     ids->out_frame = 0;
     ids->stopped = false;
+    ids->poll_mode = 0;
+    ids->poll = new arucotag_poll_s();
+    ids->pipeline = false;
+    ids->pipe = new arucotag_pipeline_s();
+    ids->workers = 0;
     ids->calib = new arucotag_calib_s();
     ids->detect = new arucotag_detector_s();
     ids->log = new arucotag_log_s();
+    ids->timing_cfg.enable = false;
+    ids->timing_cfg.period = 1;
+    ids->timing = new arucotag_timing_s();
+    ids->record = new arucotag_record_s();
+    ids->replay = new arucotag_replay_s();
+    ids->cameras = new arucotag_cameras_s();
 
     return arucotag_wait;
 }
@@ -99,13 +195,22 @@ genom_event
 detect_wait(const arucotag_intrinsics *intrinsics,
             const arucotag_extrinsics *extrinsics, float length,
             arucotag_calib_s **calib, const genom_context self)
+{
+    arucotag_genom_ports io(NULL, NULL, intrinsics, extrinsics, NULL, NULL, NULL, self);
+    return detect_wait(io, length, calib, self);
+}
+
+genom_event
+detect_wait(arucotag_ports &io, float length, arucotag_calib_s **calib,
+            const genom_context self)
 {
     // Wait that length of markers and calibration has been set from services
+    const or_sensor_intrinsics *intrinsics;
+    const or_sensor_extrinsics *extrinsics;
     if (length > 0 &&
-        intrinsics->read(self) == genom_ok && intrinsics->data(self) &&
-        extrinsics->read(self) == genom_ok && extrinsics->data(self))
+        (intrinsics = io.read_intrinsics()) && (extrinsics = io.read_extrinsics()))
     {
-        update_calib(intrinsics, extrinsics, calib, self);
+        update_calib(intrinsics, extrinsics, *calib);
         return arucotag_poll;
     }
     else
@@ -123,32 +228,467 @@ detect_wait(const arucotag_intrinsics *intrinsics,
 genom_event
 detect_poll(bool stopped, const sequence_arucotag_portinfo *ports,
             const arucotag_frame *frame, or_time_ts *last_ts,
+            int16_t poll_mode, arucotag_poll_s **poll,
+            const arucotag_pipeline_s *pipe, arucotag_timing_s **timing,
+            arucotag_record_s **record, arucotag_replay_s **replay,
+            const arucotag_camera_frame *camera_frame,
+            const arucotag_camera_intrinsics *camera_intrinsics,
+            const arucotag_camera_extrinsics *camera_extrinsics,
+            arucotag_cameras_s **cameras, const arucotag_detector_s *detect,
+            const genom_context self)
+{
+    arucotag_genom_ports io(frame, NULL, NULL, NULL, NULL, NULL, NULL, self);
+    io.bind_cameras(camera_frame, camera_intrinsics, camera_extrinsics);
+    return detect_poll(io, stopped, ports, last_ts, poll_mode, poll, pipe,
+                       timing, record, replay, cameras, detect, self);
+}
+
+genom_event
+detect_poll(arucotag_ports &io, bool stopped,
+            const sequence_arucotag_portinfo *ports, or_time_ts *last_ts,
+            int16_t poll_mode, arucotag_poll_s **poll,
+            const arucotag_pipeline_s *pipe, arucotag_timing_s **timing,
+            arucotag_record_s **record, arucotag_replay_s **replay,
+            arucotag_cameras_s **cameras, const arucotag_detector_s *detect,
             const genom_context self)
 {
     if (stopped || !ports->_length)
+    {
+        (*poll)->armed = false;
+        (*poll)->empty = false;
         return arucotag_pause_poll;
+    }
+
+    timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (!(*cameras)->list.empty())
+        poll_cameras(io, *cameras, detect);
 
-    timeval start;
-    gettimeofday(&start, NULL);
-    if (frame->read(self) == genom_ok && frame->data(self) && frame->data(self)->pixels._length &&
-        (frame->data(self)->ts.nsec != last_ts->nsec || frame->data(self)->ts.sec != last_ts->sec))
+    // Feed recorded frames instead of the port. As fast as possible, wait
+    // for a free slot in pipeline mode rather than drop frames.
+    if ((*replay)->active)
     {
-        *last_ts = frame->data(self)->ts;
+        timespec due;
+        if ((*replay)->due(due) && ts_diff(due, start) > 0)
+            return poll_sleep(pipe, *cameras, due) ? arucotag_main : arucotag_poll;
+        if (pipe->running && pipe->idle.empty())
+            return poll_sleep(pipe, *cameras, ts_add(start, arucotag_pause_ms*1e-3)) ?
+                arucotag_main : arucotag_poll;
+        if (!(*replay)->advance())
+            return arucotag_poll;
+        *last_ts = (*replay)->frame.ts;
+        if ((*timing)->enable)
+            (*timing)->frame_start = start;
+        return arucotag_main;
+    }
+
+    // The port data must not change while the last frame is being recorded
+    if ((*record)->running)
+    {
+        if ((*record)->failed)
+            (*record)->stop();
+        else
+            (*record)->fence();
+    }
+
+    // In predictive mode, sleep until just before the next expected frame.
+    // Not with other cameras: their frames are not predicted, and a camera
+    // faster than the frame port would lose frames while sleeping.
+    if (poll_mode == 1 && (*poll)->armed && (*cameras)->list.empty() &&
+        ts_diff((*poll)->wake, start) > 0)
+    {
+        if (poll_sleep(pipe, *cameras, (*poll)->wake))
+            return arucotag_main;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+    }
+
+    (*poll)->reads++;
+    const or_sensor_frame *fdata = io.read_frame();
+    if (fdata && fdata->pixels._length &&
+        (fdata->ts.nsec != last_ts->nsec || fdata->ts.sec != last_ts->sec))
+    {
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        (*poll)->update_latency(now);
+        if ((*timing)->enable)
+        {
+            (*timing)->add(timing_poll, ts_diff(now, start));
+            (*timing)->frame_start = start;
+        }
+
+        if ((*record)->running)
+            (*record)->submit(fdata);
+
+        // Learn the camera period from frame timestamps
+        or_time_ts ts = fdata->ts;
+        if (last_ts->sec || last_ts->nsec)
+            (*poll)->update_period((ts.sec - last_ts->sec) + (ts.nsec - last_ts->nsec)*1e-9);
+        *last_ts = ts;
+
+        // Predict the arrival of the next frame
+        if ((*poll)->period > 0)
+        {
+            double guard = std::max(arucotag_poll_guard_us*1e-6, 4*(*poll)->jitter);
+            double window = std::max(arucotag_poll_window_us*1e-6, 4*(*poll)->jitter);
+            (*poll)->wake = ts_add(now, (*poll)->period - guard);
+            (*poll)->deadline = ts_add(now, (*poll)->period + window);
+            (*poll)->armed = true;
+        }
+        return arucotag_main;
+    }
+    else if (pipe->ready() || (*cameras)->ready())
+    {
+        if ((*timing)->enable)
+            (*timing)->frame_start = start;
         return arucotag_main;
     }
     else
     {
+        (*poll)->last_empty = start;
+        (*poll)->empty = true;
+
+        if (poll_mode == 1 && (*poll)->armed)
+        {
+            timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (ts_diff((*poll)->deadline, now) > 0)
+            {
+                // Tight polling around the predicted arrival
+                if (poll_sleep(pipe, *cameras, ts_add(start, arucotag_poll_tight_us*1e-6)))
+                    return arucotag_main;
+                return arucotag_poll;
+            }
+            // The frame did not arrive as predicted, poll at fixed rate until the next one
+            (*poll)->armed = false;
+        }
+
         // compensate for time spent in read() in order to poll at 1kHz
-        timeval stop;
-        gettimeofday(&stop, NULL);
-        uint32_t dt_us = stop.tv_sec*1e6 + stop.tv_usec - start.tv_sec*1e6 - start.tv_usec;
-        if (dt_us < arucotag_pause_ms*1e3)
-            usleep(arucotag_pause_ms*1e3 - dt_us);
+        if (poll_sleep(pipe, *cameras, ts_add(start, arucotag_pause_ms*1e-3)))
+            return arucotag_main;
         return arucotag_poll;
     }
 }
 
 
+/* Summary of the latency of each stage */
+static void
+latency_fill(const latency_histogram &h, arucotag_latency_s *l)
+{
+    l->count = h.count();
+    l->min = h.min();
+    l->mean = h.mean();
+    l->max = h.max();
+    l->p50 = h.percentile(0.5);
+    l->p90 = h.percentile(0.9);
+    l->p99 = h.percentile(0.99);
+}
+
+void
+arucotag_timing_s::fill(arucotag_stage_latency_s *stages) const
+{
+    stages->ts = ts;
+    latency_fill(stage[timing_poll], &stages->poll);
+    latency_fill(stage[timing_decode], &stages->decode);
+    latency_fill(stage[timing_detect], &stages->detect);
+    latency_fill(stage[timing_pnp], &stages->pnp);
+    latency_fill(stage[timing_covariance], &stages->covariance);
+    latency_fill(stage[timing_publish], &stages->publish);
+    latency_fill(stage[timing_log], &stages->log);
+    latency_fill(stage[timing_frame], &stages->frame);
+}
+
+
+/* Account for the end of a frame in the detect task and publish the stage
+ * latencies on the stats port once per period.
+ */
+static void
+timing_end_frame(arucotag_timing_s *timing, arucotag_detector_s *detect,
+                 const or_time_ts &ts, arucotag_ports &io)
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timing->add(timing_frame, ts_diff(now, timing->frame_start));
+
+    // Pose and covariance times are summed over tags and workers, frames
+    // without estimated tags add no sample
+    uint64_t pnp = detect->pnp_ns.exchange(0);
+    uint64_t covariance = detect->covariance_ns.exchange(0);
+    if (pnp || covariance)
+    {
+        timing->add(timing_pnp, pnp*1e-9);
+        timing->add(timing_covariance, covariance*1e-9);
+    }
+    timing->ts = ts;
+
+    if (ts_diff(now, timing->published) < timing->period)
+        return;
+    timing->published = now;
+    timing->fill(io.stats());
+    io.write_stats();
+}
+
+
+/* Publish an empty message for a tracked tag that is not detected */
+static void
+publish_absent(arucotag_ports &io, const char *tagid, const or_time_ts &ts)
+{
+    or_pose_estimator_state *p = io.pose(tagid);
+    p->ts = ts;
+    p->pos._present = false;
+    p->pos_cov._present = false;
+    p->att._present = false;
+    p->att_cov._present = false;
+    io.write_pose(tagid);
+
+    or_sensor_pixel *px = io.pixel_pose(tagid);
+    px->ts = ts;
+    px->pix._present = false;
+    io.write_pixel_pose(tagid);
+}
+
+/* Publish the pose of a tag and its pixel */
+static void
+publish_tag(arucotag_ports &io, const char *tagid, const or_time_ts &ts,
+            const tag_estimate &est)
+{
+    const Vector3d &position = est.position;
+    const Quaterniond &orientation = est.orientation;
+    const Matrix3d &cov_pos = est.cov_pos;
+    const Matrix4d &cov_q = est.cov_q;
+
+    or_pose_estimator_state *p = io.pose(tagid);
+    p->ts = ts;
+
+    p->pos._present = true;
+    p->pos._value.x = position(0);
+    p->pos._value.y = position(1);
+    p->pos._value.z = position(2);
+    p->att._present = true;
+    p->att._value.qw = orientation.w();
+    p->att._value.qx = orientation.x();
+    p->att._value.qy = orientation.y();
+    p->att._value.qz = orientation.z();
+    p->pos_cov._present = true;
+    p->pos_cov._value =
+    {
+        cov_pos(0,0),
+        cov_pos(1,0), cov_pos(1,1),
+        cov_pos(2,0), cov_pos(2,1), cov_pos(2,2)
+    };
+    p->att_cov._present = true;
+    p->att_cov._value =
+    {
+        cov_q(0,0),
+        cov_q(1,0), cov_q(1,1),
+        cov_q(2,0), cov_q(2,1), cov_q(2,2),
+        cov_q(3,0), cov_q(3,1), cov_q(3,2), cov_q(3,3)
+    };
+
+    io.write_pose(tagid);
+
+    // Publish
+    or_sensor_pixel *px = io.pixel_pose(tagid);
+    px->ts = ts;
+    px->pix._present = true;
+    px->pix._value.x = round(est.center.x);
+    px->pix._value.y = round(est.center.y);
+    io.write_pixel_pose(tagid);
+}
+
+/* Activate the entry of the tag id in previous detections for a frame taken
+ * at ts */
+static void
+activate_tag(tag_history &history, int id, const or_time_ts &ts)
+{
+    tag_detection &tag = history.tags[id];
+    if (!tag.active)
+    {
+        tag.active = true;
+        history.active.push_back(id);
+    }
+    tag.age = 0;
+    tag.seen = ts;
+}
+
+/* Estimate the pose of the tracked tags and bundles among the detections of
+ * the current frame, seen by the camera of the given history and calibration.
+ */
+static void
+estimate_frame(arucotag_detector_s *d, tag_history &history,
+               const arucotag_calib_s *calib, const body_state &body,
+               uint16_t s_pix, int16_t out_frame, const or_time_ts &ts)
+{
+    // Select detected tags that are among tracked markers, and activate
+    // their entry in previous detections. This is done beforehand so that
+    // each concurrent estimation only touches its own entry: only the first
+    // detection of an id is kept, as two tags with the same id would share
+    // it. The tags of a bundle are gathered and estimated together.
+    d->tracked.clear();
+    d->bundles_seen.clear();
+    for (tag_bundle &b : d->bundles)
+        b.dets.clear();
+    d->selected.assign(d->markers.size(), 0);
+    for (uint16_t i=0; i<d->ids.size(); i++)
+    {
+        const tracked_marker *m = d->marker(d->ids[i]);
+        if (!m || d->selected[d->ids[i]]) continue;
+        d->selected[d->ids[i]] = 1;
+
+        if (m->bundle >= 0)
+        {
+            tag_bundle &b = d->bundles[m->bundle];
+            if (b.dets.empty())
+            {
+                activate_tag(history, b.ids[0], ts);
+                d->bundles_seen.push_back(m->bundle);
+            }
+            b.dets.push_back(i);
+            continue;
+        }
+        activate_tag(history, d->ids[i], ts);
+        d->tracked.push_back(i);
+    }
+
+    // Estimate pose from corners, concurrently for each batch of tags and
+    // each bundle
+    d->estimates.resize(d->tracked.size());
+    d->bundle_estimates.resize(d->bundles_seen.size());
+    size_t n = d->tracked.size();
+    size_t batches = (n + arucotag_estimate_batch-1) / arucotag_estimate_batch;
+    d->pool.run(batches + d->bundles_seen.size(), [&](size_t b) {
+        if (b >= batches)
+        {
+            estimate_bundle(d, history, calib, body, s_pix, out_frame, b - batches);
+            return;
+        }
+        size_t first = b * arucotag_estimate_batch;
+        estimate_tags(d, history, calib, body, s_pix, out_frame,
+                      first, std::min<size_t>(arucotag_estimate_batch, n - first));
+    });
+}
+
+/* Estimate the tags of the current frame of a camera and add them to the
+ * estimates of the round. Each tracked tag is listed once in the round for
+ * the log.
+ */
+static void
+fuse_frame(arucotag_detector_s *d, tag_history &history,
+           const arucotag_calib_s *calib, const body_state &body,
+           uint16_t s_pix, int16_t out_frame, const or_time_ts &ts)
+{
+    d->age_history(history, ts);
+    for (size_t i = 0; i < d->ids.size(); i++)
+        if (const tracked_marker *m = d->marker(d->ids[i]))
+            if (!d->seen[m->port])
+            {
+                d->seen[m->port] = 1;
+                d->round_ids.push_back(d->ids[i]);
+                d->round_levels.push_back(d->levels[i]);
+            }
+    if (d->ids.empty())
+        return;
+
+    estimate_frame(d, history, calib, body, s_pix, out_frame, ts);
+    for (size_t k=0; k<d->tracked.size(); k++)
+        if (d->estimates[k].valid)
+            d->fused[d->markers[d->ids[d->tracked[k]]].port].add(d->estimates[k], ts);
+    for (size_t k=0; k<d->bundles_seen.size(); k++)
+        if (d->bundle_estimates[k].valid)
+        {
+            const tag_bundle &b = d->bundles[d->bundles_seen[k]];
+            d->fused[d->markers[b.ids[0]].port].add(d->bundle_estimates[k], ts);
+        }
+}
+
+
+/* The frame of the frame port, if ts is not NULL, and the oldest results of
+ * each other camera are processed together. A tag seen in several of them is
+ * published once: fused in body or world frame, and as seen by the camera
+ * with the smallest position covariance in camera frame.
+ */
+static genom_event
+main_cameras(arucotag_ports &io, arucotag_detector_s *d,
+             const arucotag_calib_s *calib, const body_state &body,
+             uint16_t s_pix, int16_t out_frame,
+             const sequence_arucotag_portinfo *ports, arucotag_timing_s *timing,
+             arucotag_cameras_s *cameras, const or_time_ts *ts)
+{
+    bool timed = timing->enable;
+    timespec t0;
+
+    or_time_ts latest = ts ? *ts : or_time_ts{0, 0};
+    bool fresh = ts;
+    d->fused.resize(ports->_length);
+    for (tag_fusion &f : d->fused)
+        f.reset();
+    d->seen.assign(ports->_length, 0);
+    d->round_ids.clear();
+    d->round_levels.clear();
+
+    if (ts)
+        fuse_frame(d, d->history, calib, body, s_pix, out_frame, *ts);
+    for (auto &c : cameras->list)
+    {
+        pipeline_slot *slot = c->pipe.pop();
+        if (!slot) continue;
+
+        or_time_ts cts = slot->data.ts;
+        d->ingest_info.add(slot->copied, slot->ingest.time);
+        if (timed)
+        {
+            timing->add(timing_decode, slot->ingest.time);
+            timing->add(timing_detect, slot->detect_time);
+        }
+        d->add_rejected(slot->rejected);
+        d->ids.swap(slot->ids);
+        d->corners.swap(slot->corners);
+        d->levels.swap(slot->levels);
+        c->pipe.release(slot);
+        c->processed++;
+        fresh = true;
+
+        if (cts.sec > latest.sec || (cts.sec == latest.sec && cts.nsec > latest.nsec))
+            latest = cts;
+        fuse_frame(d, c->history, &c->calib, body, s_pix, out_frame, cts);
+    }
+    if (!fresh)
+        return arucotag_poll;
+
+    // Publish, in port order
+    if (timed)
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+    tag_estimate est;
+    for (uint16_t i=0; i<ports->_length; i++)
+    {
+        const tag_fusion &f = d->fused[i];
+        if (!f.n)
+        {
+            // Seen tags without a pose are not published, as with one camera
+            if (!d->seen[i])
+                publish_absent(io, ports->_buffer[i], latest);
+            continue;
+        }
+        if (out_frame == 0)
+            est = f.best;
+        else
+            f.fuse(est);
+        publish_tag(io, ports->_buffer[i], f.ts, est);
+    }
+
+    // The log has the tags of all cameras
+    d->ids.swap(d->round_ids);
+    d->levels.swap(d->round_levels);
+
+    if (timed)
+    {
+        timing->add(timing_publish, ts_elapsed(t0));
+        timing_end_frame(timing, d, latest, io);
+    }
+    return d->ids.empty() ? arucotag_poll : arucotag_log;
+}
+
+
 /** Codel detect_main of task detect.
  *
  * Triggered by arucotag_main.
@@ -161,323 +701,319 @@ detect_main(const arucotag_frame *frame, uint16_t s_pix,
             const sequence_arucotag_portinfo *ports,
             const arucotag_pose *pose,
             const arucotag_pixel_pose *pixel_pose, int16_t out_frame,
+            bool pipeline, arucotag_pipeline_s **pipe,
+            arucotag_timing_s **timing, const arucotag_stats *stats,
+            const arucotag_replay_s *replay, arucotag_cameras_s **cameras,
             const genom_context self)
 {
+    arucotag_genom_ports io(frame, drone, NULL, NULL, pose, pixel_pose, stats, self);
+    return detect_main(io, s_pix, calib, detect, ports, out_frame, pipeline,
+                       pipe, timing, replay, cameras, self);
+}
+
+genom_event
+detect_main(arucotag_ports &io, uint16_t s_pix, const arucotag_calib_s *calib,
+            arucotag_detector_s **detect,
+            const sequence_arucotag_portinfo *ports, int16_t out_frame,
+            bool pipeline, arucotag_pipeline_s **pipe,
+            arucotag_timing_s **timing, const arucotag_replay_s *replay,
+            arucotag_cameras_s **cameras, const genom_context self)
+{
+    bool timed = (*timing)->enable;
+    timespec t0;
+
     // Get state feedback
-    Vector3d W_p_B;
-    Matrix3d W_R_B;
-    Quaterniond W_q_B;
-    Matrix3d S_W_p_B;
-    Matrix4d S_W_q_B;
-    if (!(drone->read(self) == genom_ok && drone->data(self)))
+    body_state body;
+    const or_pose_estimator_state *pom = io.read_drone();
+    if (!pom)
     {
         // Give default value if unable to read from port
-        W_p_B.setZero();
-        W_R_B.setIdentity();
-        W_q_B.setIdentity();
-        S_W_p_B.setZero();
-        S_W_q_B.setZero();
+        body.W_p_B.setZero();
+        body.W_R_B.setIdentity();
+        body.W_q_B.setIdentity();
+        body.S_W_p_B.setZero();
+        body.S_W_q_B.setZero();
     }
     else
     {
-        or_pose_estimator_state* pom = drone->data(self);
-        W_p_B << pom->pos._value.x, pom->pos._value.y, pom->pos._value.z;
-        W_q_B = Quaterniond(pom->att._value.qw, pom->att._value.qx, pom->att._value.qy, pom->att._value.qz);
-        W_R_B = W_q_B;
-        S_W_p_B <<
+        body.W_p_B << pom->pos._value.x, pom->pos._value.y, pom->pos._value.z;
+        body.W_q_B = Quaterniond(pom->att._value.qw, pom->att._value.qx, pom->att._value.qy, pom->att._value.qz);
+        body.W_R_B = body.W_q_B;
+        body.S_W_p_B <<
             pom->pos_cov._value.cov[0], pom->pos_cov._value.cov[1], pom->pos_cov._value.cov[3],
             pom->pos_cov._value.cov[1], pom->pos_cov._value.cov[2], pom->pos_cov._value.cov[4],
             pom->pos_cov._value.cov[3], pom->pos_cov._value.cov[4], pom->pos_cov._value.cov[5];
-        S_W_q_B <<
+        body.S_W_q_B <<
             pom->att_cov._value.cov[0], pom->att_cov._value.cov[1], pom->att_cov._value.cov[3], pom->att_cov._value.cov[6],
             pom->att_cov._value.cov[1], pom->att_cov._value.cov[2], pom->att_cov._value.cov[4], pom->att_cov._value.cov[7],
             pom->att_cov._value.cov[3], pom->att_cov._value.cov[4], pom->att_cov._value.cov[5], pom->att_cov._value.cov[8],
             pom->att_cov._value.cov[6], pom->att_cov._value.cov[7], pom->att_cov._value.cov[8], pom->att_cov._value.cov[9];
     }
 
-    or_sensor_frame* fdata = frame->data(self);
-
-    // Convert frame to cv::Mat
-    Mat cvframe;
-    if (fdata->compressed)
+    // Detections in a new frame of the frame port, if any. With other
+    // cameras, the task may run for their results only.
+    or_time_ts ts;
+    bool fresh = false;
+    if (pipeline)
     {
-        std::vector<uint8_t> buf;
-        buf.assign(fdata->pixels._buffer, fdata->pixels._buffer + fdata->pixels._length);
-        imdecode(buf, IMREAD_GRAYSCALE, &cvframe);
+        // Results of the frame port wake the task like those of the cameras
+        (*pipe)->notify = (*cameras)->list.empty() ? NULL : &(*cameras)->done;
+        if (!(*pipe)->running)
+            (*pipe)->start((*detect)->dict);
+
+        // Feed the new frame, if any, and process the oldest detection results
+        const or_sensor_frame *fdata = replay->active ? &replay->frame : io.frame();
+        if (fdata && fdata->pixels._length &&
+            (fdata->ts.nsec != (*pipe)->pushed.nsec || fdata->ts.sec != (*pipe)->pushed.sec))
+            (*pipe)->push(fdata, (*detect)->opt);
+
+        pipeline_slot *slot = (*pipe)->pop();
+        if (slot)
+        {
+            ts = slot->data.ts;
+            (*detect)->ingest_info.add(slot->copied, slot->ingest.time);
+            if (timed)
+            {
+                (*timing)->add(timing_decode, slot->ingest.time);
+                (*timing)->add(timing_detect, slot->detect_time);
+            }
+            (*detect)->add_rejected(slot->rejected);
+            (*detect)->ids.swap(slot->ids);
+            (*detect)->corners.swap(slot->corners);
+            (*detect)->levels.swap(slot->levels);
+            (*pipe)->release(slot);
+            fresh = true;
+        }
     }
     else
     {
-        int type;
-        if      (fdata->bpp == 1) type = CV_8UC1;
-        else if (fdata->bpp == 2) type = CV_16UC1;
-        else if (fdata->bpp == 3) type = CV_8UC3;
-        else if (fdata->bpp == 4) type = CV_8UC4;
-        else return arucotag_poll;
-
-        cvframe = Mat(
-            Size(fdata->width, fdata->height),
-            type,
-            fdata->pixels._buffer,
-            Mat::AUTO_STEP
-        );
+        if ((*pipe)->running)
+            (*pipe)->stop();
+
+        const or_sensor_frame *fdata = replay->active ? &replay->frame : io.frame();
+        if (fdata && fdata->pixels._length &&
+            (fdata->ts.nsec != (*detect)->decoded_ts.nsec || fdata->ts.sec != (*detect)->decoded_ts.sec))
+        {
+            ts = fdata->ts;
+            (*detect)->decoded_ts = ts;
+
+            // Convert frame to cv::Mat
+            bool decoded = (*detect)->ingest.decode(fdata, (*detect)->frame, (*detect)->opt);
+            (*detect)->ingest_info.add((*detect)->ingest.copied, (*detect)->ingest.time);
+            if (decoded)
+            {
+                if (timed)
+                {
+                    (*timing)->add(timing_decode, (*detect)->ingest.time);
+                    clock_gettime(CLOCK_MONOTONIC, &t0);
+                }
+
+                // Detect tags in frame
+                (*detect)->finder.find((*detect)->frame, (*detect)->dict, (*detect)->opt,
+                                       (*detect)->ingest.scale);
+                if (timed)
+                    (*timing)->add(timing_detect, ts_elapsed(t0));
+                (*detect)->ids = (*detect)->finder.ids;
+                (*detect)->corners = (*detect)->finder.corners;
+                (*detect)->levels = (*detect)->finder.levels;
+                (*detect)->add_rejected((*detect)->finder.rejected);
+                fresh = true;
+            }
+        }
     }
 
-    // Detect tags in frame
-    vector<vector<Point2f>> corners_image;
-    // aruco::detectMarkers(cvframe, (*detect)->dict, corners_image, (*detect)->ids, aruco::DetectorParameters::create(), noArray(), calib->K_cv, calib->D);
-    aruco::detectMarkers(cvframe, (*detect)->dict, corners_image, (*detect)->ids);
+    arucotag_detector_s *d = *detect;
+    if (!(*cameras)->list.empty())
+        return main_cameras(io, d, calib, body, s_pix, out_frame, ports,
+                            *timing, *cameras, fresh ? &ts : NULL);
+    if (!fresh)
+        return arucotag_poll;
 
     // Publish empty messages for tracked tags that are not detected
+    if (timed)
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+    d->seen.assign(ports->_length, 0);
+    for (int id : d->ids)
+        if (const tracked_marker *m = d->marker(id))
+            d->seen[m->port] = 1;
     for (uint16_t i=0; i<ports->_length; i++)
-        if (find((*detect)->ids.begin(), (*detect)->ids.end(), std::stoi(ports->_buffer[i])) == (*detect)->ids.end())
-        {
-            pose->data(ports->_buffer[i], self)->ts = fdata->ts;
-            pose->data(ports->_buffer[i], self)->pos._present = false;
-            pose->data(ports->_buffer[i], self)->pos_cov._present = false;
-            pose->data(ports->_buffer[i], self)->att._present = false;
-            pose->data(ports->_buffer[i], self)->att_cov._present = false;
-            pose->write(ports->_buffer[i], self);
-
-            pixel_pose->data(ports->_buffer[i], self)->ts = pose->data(ports->_buffer[i], self)->ts;
-            pixel_pose->data(ports->_buffer[i], self)->pix._present = false;
-            pixel_pose->write(ports->_buffer[i], self);
-        }
+        if (!d->seen[i])
+            publish_absent(io, ports->_buffer[i], ts);
 
-    // Sleep if no detection was made
-    if ((*detect)->ids.size() == 0)
-        return arucotag_poll;
+    // Forget the tags that were not seen for too long
+    d->age_history(d->history, ts);
 
-    // Process detected tags
-    for (uint16_t i=0; i<(*detect)->ids.size(); i++)
+    // Sleep if no detection was made
+    if (d->ids.size() == 0)
     {
-        // Check that detected tags are among tracked markers
-        uint16_t j = 0;
-        for (j=0; j<ports->_length; j++)
-            if (!strcmp(ports->_buffer[j], to_string((*detect)->ids[i]).c_str()))
-                break;
-        if (j == ports->_length) continue;
-
-        // Estimate pose from corners
-
-        // Solve PnP for the tag
-        vector<Vec3d> translations, rotations;
-        Mat1f reproj_error;  // declare as CV_32FC1 so that solvePnP won't complain, it'll take care of intanciating the size
-        solvePnPGeneric((*detect)->corners_marker_cv, corners_image[i], calib->K_cv, calib->D, rotations, translations, false, SOLVEPNP_IPPE_SQUARE, noArray(), noArray(), reproj_error);
-        // solvePnPGeneric((*detect)->corners_marker_cv, corners_image[i], calib->K_cv, calib->D, rotations, translations, false, SOLVEPNP_IPPE_SQUARE);
-
-        // Get the "correct" translation and rotation among the two retrieved solutions
-        // Check ambiguity is often done using the likelihood ratio of reproj. errors, 0.6 seems a decent ambiguity threshold, according to [Muñoz-Salinas 18]
-        // However, the reprojection error alone is often not enough to lift the ambiguity and causes flips in successive detection
-        // Rather, impose a basic temporal consistency in detections by selecting the pose that minimizes the angular distance between with previous poses
-        // I use the likelihood ratio wrt distance to last detection to discriminate to enfore temporal consistency
-        // For more robustness, a last detections are stored in a queue and we use a basic voting scheme according to this ratio
-        // In order to be more robust to misses detections among frames, we keep a detetion is memory for a given amount of frames even if it is undetected
-        Vector3d C_p_M;
-        Quaterniond C_q_M;
-
-        // Check for NaN
-        Quaterniond q_0 = cvaa2eigenquat(rotations[0]);
-        if (q_0.coeffs().hasNaN())
-            continue;
-
-        // Check if tag was among previously detected ones
-        j = 0;
-        for (j=0; j<(*detect)->last_detections.size(); j++)
-            if ((*detect)->last_detections[j].id == (*detect)->ids[i])
-                break;
-        if (j >= (*detect)->last_detections.size())
+        if (timed)
         {
-            // If the tag is newly detected, select the minimum error solution and store it as new detection
-            C_p_M << translations[0][0], translations[0][1], translations[0][2];
-            C_q_M = cvaa2eigenquat(rotations[0]);
-
-            // Fix w >= 0 as convention
-            if (C_q_M.w() < 0)
-                C_q_M.coeffs() = -C_q_M.coeffs();
-
-            tag_detection tag;
-            tag.id = (*detect)->ids[i];
-            // tag.age = 0;
-            tag.history.push(pose6D(C_p_M, C_q_M));
-            (*detect)->last_detections.push_back(tag);
+            (*timing)->add(timing_publish, ts_elapsed(t0));
+            timing_end_frame(*timing, d, ts, io);
         }
-        else
-        {
-            Quaterniond q_1 = cvaa2eigenquat(rotations[1]);
+        return arucotag_poll;
+    }
+    double publish = timed ? ts_elapsed(t0) : 0;
 
-            // The second solution from IPPE_QUARE might be NaN so it needs to be tested first
-            if (q_1.coeffs().hasNaN())
-            {
-                C_p_M << translations[0][0], translations[0][1], translations[0][2];
-                C_q_M = q_0;
-            }
-            else
-            {
-                uint16_t vote_0 = 0, vote_1 = 0;
-                queue<pose6D> qu = (*detect)->last_detections[j].history;
-                while (!qu.empty())
-                {
-                    Quaterniond qh = qu.front().q;
-                    qu.pop();
-                    double dq_0 = qh.angularDistance(q_0), dq_1 = qh.angularDistance(q_1);
-                    if (dq_0 < 0.8 * dq_1)
-                        vote_0++;
-                    else if (dq_1 < 0.8 * dq_0)
-                        vote_1++;
-                }
+    estimate_frame(d, d->history, calib, body, s_pix, out_frame, ts);
 
-                // Choose either solution if it has at least 2 more votes than the other one
-                if (vote_0 < vote_1)
-                {
-                    C_p_M << translations[1][0], translations[1][1], translations[1][2];
-                    C_q_M = q_1;
-                }
-                else if (vote_0 > vote_1)
-                {
-                    C_p_M << translations[0][0], translations[0][1], translations[0][2];
-                    C_q_M = q_0;
-                }
-                else
-                    continue;
-            }
+    // Publish, in detection order, then bundles
+    if (timed)
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (size_t k=0; k<d->tracked.size(); k++)
+        if (d->estimates[k].valid)
+            publish_tag(io, d->markers[d->ids[d->tracked[k]]].name, ts, d->estimates[k]);
+    for (size_t k=0; k<d->bundles_seen.size(); k++)
+        if (d->bundle_estimates[k].valid)
+            publish_tag(io, d->bundles[d->bundles_seen[k]].name, ts, d->bundle_estimates[k]);
 
-            // avoid flips between q and -q
-            if ((*detect)->last_detections[j].history.back().q.dot(C_q_M) < 0)
-                C_q_M.coeffs() = -C_q_M.coeffs();
+    if (timed)
+    {
+        (*timing)->add(timing_publish, publish + ts_elapsed(t0));
+        timing_end_frame(*timing, d, ts, io);
+    }
+    return arucotag_log;
+}
 
-            (*detect)->last_detections[j].history.push(pose6D(C_p_M, C_q_M));
-            if ((*detect)->last_detections[j].history.size() > arucotag_hist_size)
-                (*detect)->last_detections[j].history.pop();
-        }
 
-        // Compute covariance
-        // See Sec. VI.B in [Jacquet 2020] (10.1109/LRA.2020.3045654)
-        Matrix<double,8,6> J;   // Jacobian of f^-1
-        for (uint16_t i=0; i<4; i++)
-        {
-            Vector3d hi = calib->K * (C_q_M * (*detect)->corners_marker.col(i) + C_p_M);
-            // Jacobian of pixellization (homogeneous->pixel) operation wrt homogeneous coordinates
-            Matrix<double,2,3> J_pix; J_pix <<
-                1/hi(2), 0, -hi(0)/hi(2)/hi(2),
-                0, 1/hi(2), -hi(1)/hi(2)/hi(2);
-            // Jacobian of projection
-            Matrix<double,3,6> J_proj;
-            // Jacobian of projection wrt translation
-            J_proj.block<3,3>(0,0) = calib->K;
-            // Jacobian of projection wrt rotation
-            J_proj.block<3,3>(0,3) = -calib->K * C_q_M.matrix() * skew((*detect)->corners_marker.col(i));
-            // Stack the Jacobian of projection wrt euclidean coordinates (chain rule) in J
-            J.block<2,6>(i*2,0) = J_pix*J_proj;
-        }
+/* The tracked marker of the i-th detection of the current frame, or NULL if
+ * it is not tracked. Each port is logged once, for the first detection of its
+ * tags: a tag detected twice, or a bundle.
+ */
+static const tracked_marker *
+log_marker(const arucotag_detector_s *detect, uint16_t i)
+{
+    const tracked_marker *m = detect->marker(detect->ids[i]);
+    if (m)
+        for (uint16_t j=0; j<i; j++)
+            if (const tracked_marker *o = detect->marker(detect->ids[j]))
+                if (o->port == m->port)
+                    return NULL;
+    return m;
+}
 
-        // First order propagation
-        // Cross (pos/rot) covariance is neglected since I dunno how to transform it into pos/quat covariance
-        Matrix<double,6,6> cov = s_pix*s_pix * (J.transpose() * J).inverse();
-        Matrix3d cov_pos = cov.block<3,3>(0,0);
-        Matrix3d cov_rot = cov.block<3,3>(3,3);
+/* Format the tags of the current frame as text lines in log->buffer.
+ * Returns the number of bytes to write.
+ */
+static size_t
+log_text(const arucotag_detector_s *detect, arucotag_ports &io,
+         int16_t out_frame, arucotag_log_s *log)
+{
+    const size_t line = arucotag_log_line;
+    size_t n = 0;
+    for (uint16_t i=0; i<detect->ids.size(); i++)
+    {
+        // Check that detected tags are among tracked markers
+        const tracked_marker *m = log_marker(detect, i);
+        if (!m) continue;
+        const char* tagid = m->name;
+
+        const or_pose_estimator_state* posedata = io.pose(tagid);
+        const or_sensor_pixel* pixdata = io.pixel_pose(tagid);
+
+        // roll/pitch/yaw conversion
+        double qw = posedata->att._value.qw;
+        double qx = posedata->att._value.qx;
+        double qy = posedata->att._value.qy;
+        double qz = posedata->att._value.qz;
+        double roll = atan2(2 * (qw*qx + qy*qz), 1 - 2 * (qx*qx + qy*qy));
+        double pitch = asin(2 * (qw*qy - qz*qx));
+        double yaw = atan2(2 * (qw*qz + qx*qy), 1 - 2 * (qy*qy + qz*qz));
+
+        if (log->buffer.size() < n + line)
+            log->buffer.resize(n + line);
+        int l = snprintf(
+            &log->buffer[n], line,
+            "%s" arucotag_log_fmt "\n",
+            log->skipped && !n ? "\n" : "",
+            posedata->ts.sec, posedata->ts.nsec,
+            out_frame,                                      // frame
+            tagid,                                          // tag id
+            pixdata->pix._value.x,
+            pixdata->pix._value.y,                          // pixel
+            posedata->pos._value.x,                         // p
+            posedata->pos._value.y,
+            posedata->pos._value.z,
+            qw,                                             // att (quat)
+            qx,
+            qy,
+            qz,
+            roll,                                           // att (euler)
+            pitch,
+            yaw,
+            posedata->pos_cov._value.cov[0],                // Sigma_p
+            posedata->pos_cov._value.cov[1],
+            posedata->pos_cov._value.cov[2],
+            posedata->pos_cov._value.cov[3],
+            posedata->pos_cov._value.cov[4],
+            posedata->pos_cov._value.cov[5],
+            posedata->att_cov._value.cov[0],                // Sigma_q
+            posedata->att_cov._value.cov[1],
+            posedata->att_cov._value.cov[2],
+            posedata->att_cov._value.cov[3],
+            posedata->att_cov._value.cov[4],
+            posedata->att_cov._value.cov[5],
+            posedata->att_cov._value.cov[6],
+            posedata->att_cov._value.cov[7],
+            posedata->att_cov._value.cov[8],
+            posedata->att_cov._value.cov[9]
+        );
+        if (l > 0)
+            n += (size_t)l < line ? l : line - 1;
+    }
+    return n;
+}
 
-        // Transform to desired frame and propagate covariance
-        Vector3d position;
-        Quaterniond orientation;
-        switch (out_frame)
+/* Copy the tags of the current frame as binary records in log->buffer.
+ * Returns the number of bytes to write.
+ */
+static size_t
+log_binary(const arucotag_detector_s *detect, arucotag_ports &io,
+           int16_t out_frame, arucotag_log_s *log)
+{
+    arucotag_log_frame frame = {};
+    arucotag_log_tag tag = {};
+    size_t n = sizeof(frame);
+    for (uint16_t i=0; i<detect->ids.size(); i++)
+    {
+        const tracked_marker *m = log_marker(detect, i);
+        if (!m) continue;
+
+        const or_pose_estimator_state* posedata = io.pose(m->name);
+        const or_sensor_pixel* pixdata = io.pixel_pose(m->name);
+        static_assert(sizeof(tag.pos) == sizeof(posedata->pos._value) &&
+                      sizeof(tag.att) == sizeof(posedata->att._value) &&
+                      sizeof(tag.pos_cov) == sizeof(posedata->pos_cov._value) &&
+                      sizeof(tag.att_cov) == sizeof(posedata->att_cov._value),
+                      "arucotag_log_tag layout");
+        if (!frame.count)
         {
-            case 0:  // Camera frame
-                position = C_p_M;
-                orientation = C_q_M;
-                break;
-            case 1:  // Body frame
-                position = calib->B_R_C * C_p_M + calib->B_p_C;
-                orientation = calib->B_R_C * C_q_M;
-                cov_pos = calib->B_R_C * cov_pos * calib->B_R_C.transpose();
-                cov_rot = calib->B_R_C * cov_rot * calib->B_R_C.transpose();
-                break;
-            case 2:  // World frame
-                Vector3d B_p_M = calib->B_R_C * C_p_M + calib->B_p_C;
-                position = W_R_B * B_p_M + W_p_B;
-                orientation = W_R_B * calib->B_R_C * C_q_M;
-                // Propagate to body frame
-                cov_pos = calib->B_R_C * cov_pos * calib->B_R_C.transpose();
-                cov_rot = calib->B_R_C * cov_rot * calib->B_R_C.transpose();
-                // Propagate to world frame
-                // The jacobian of the transformation wrt the quaternion W_q_B is given by Eq. 174 from [Solà 2017], see Sec. 4.3.2 therein
-                // Available at: https://arxiv.org/abs/1711.02508
-                Matrix<double,3,4> J_R;
-                J_R.col(0) = 2* (W_q_B.w()*B_p_M + W_q_B.vec().cross(B_p_M));
-                J_R.block(0,1,3,3) = 2* ((W_q_B.vec().transpose() * B_p_M)(0) * Matrix3d::Identity() + W_q_B.vec() * B_p_M.transpose() - B_p_M * W_q_B.vec().transpose() - W_q_B.w() * skew(B_p_M));
-                cov_pos = W_R_B * cov_pos * W_R_B.transpose() + J_R * S_W_q_B * J_R.transpose() + S_W_p_B;
-                cov_rot = W_R_B * cov_rot * W_R_B.transpose() + J_R * S_W_q_B * J_R.transpose();
-                break;
+            frame.sec = posedata->ts.sec;
+            frame.nsec = posedata->ts.nsec;
         }
+        frame.count++;
+
+        memcpy(tag.id, m->name, sizeof(tag.id));
+        memcpy(tag.pos, &posedata->pos._value, sizeof(tag.pos));
+        memcpy(tag.att, &posedata->att._value, sizeof(tag.att));
+        memcpy(tag.pos_cov, &posedata->pos_cov._value, sizeof(tag.pos_cov));
+        memcpy(tag.att_cov, &posedata->att_cov._value, sizeof(tag.att_cov));
+        tag.px = pixdata->pix._value.x;
+        tag.py = pixdata->pix._value.y;
+        tag.level = detect->levels[i];
+
+        if (log->buffer.size() < n + sizeof(tag))
+            log->buffer.resize(n + sizeof(tag));
+        memcpy(&log->buffer[n], &tag, sizeof(tag));
+        n += sizeof(tag);
+    }
+    if (!frame.count)
+        return 0;
 
-        // Convert rotation covariance (i.e. element of tangent space R^(3)) to quaternion covariance (i.e. element of R^4)
-        Matrix<double,4,3> J_exp;
-        double theta = ((AngleAxisd) orientation).angle();
-        Vector3d u = ((AngleAxisd) orientation).axis();
-        if (theta < 1e-5)           // trivial continuous extension when theta->0
-            J_exp << 0,0,0, 0.5,0,0, 0,0.5,0, 0,0,0.5;
-        else if (theta < 0.5) {     // small angle approx.: if theta/2 < 0.25rad (~15°)
-            J_exp.row(0) = -theta/4 * u;
-            J_exp.block<3,3>(1,0) = 0.5*Matrix3d::Identity() - theta*theta/8 * u*u.transpose();
-        } else {
-            double c = cos(theta/2), s = sin(theta/2);
-            J_exp.row(0) = -0.5 * s * u;
-            J_exp.block<3,3>(1,0) = s/theta*Matrix3d::Identity() + (c/2 - s/theta) * u*u.transpose();
-        }
-        Matrix4d cov_q = J_exp * cov_rot * J_exp.transpose();
-
-        // Publish
-        const char* tagid = to_string((*detect)->ids[i]).c_str();
-
-        pose->data(tagid, self)->ts = fdata->ts;
-
-        pose->data(tagid, self)->pos._present = true;
-        pose->data(tagid, self)->pos._value.x = position(0);
-        pose->data(tagid, self)->pos._value.y = position(1);
-        pose->data(tagid, self)->pos._value.z = position(2);
-        pose->data(tagid, self)->att._present = true;
-        pose->data(tagid, self)->att._value.qw = orientation.w();
-        pose->data(tagid, self)->att._value.qx = orientation.x();
-        pose->data(tagid, self)->att._value.qy = orientation.y();
-        pose->data(tagid, self)->att._value.qz = orientation.z();
-        pose->data(tagid, self)->pos_cov._present = true;
-        pose->data(tagid, self)->pos_cov._value =
-        {
-            cov_pos(0,0),
-            cov_pos(1,0), cov_pos(1,1),
-            cov_pos(2,0), cov_pos(2,1), cov_pos(2,2)
-        };
-        pose->data(tagid, self)->att_cov._present = true;
-        pose->data(tagid, self)->att_cov._value =
-        {
-            cov_q(0,0),
-            cov_q(1,0), cov_q(1,1),
-            cov_q(2,0), cov_q(2,1), cov_q(2,2),
-            cov_q(3,0), cov_q(3,1), cov_q(3,2), cov_q(3,3)
-        };
-
-        pose->write(tagid, self);
-
-        // Compute centroid of tag in pixel coordinates
-        Point2f center(0, 0);
-        for(int p = 0; p < 4; p++)
-            center += corners_image[i][p];
-        center = center / 4.;
-
-        // Publish
-        pixel_pose->data(tagid, self)->ts = pose->data(tagid, self)->ts;
-        pixel_pose->data(tagid, self)->pix._present = true;
-        pixel_pose->data(tagid, self)->pix._value.x = round(center.x);
-        pixel_pose->data(tagid, self)->pix._value.y = round(center.y);
-        pixel_pose->write(tagid, self);
-    }
-
-    // // Check for tags in last detections that are not detected in current frame, and increase their age or remove them
-    // for (uint16_t i=0; i<(*detect)->last_detections.size(); i++)
-    //     if (find((*detect)->ids.begin(), (*detect)->ids.end(), (*detect)->last_detections[i].id) == (*detect)->ids.end())
-    //         if (++((*detect)->last_detections[i].age) > arucotag_age_max)
-    //             (*detect)->last_detections.erase((*detect)->last_detections.begin()+(i--));
-
-    return arucotag_log;
+    frame.frame = out_frame;
+    frame.skipped = log->skipped;
+    memcpy(&log->buffer[0], &frame, sizeof(frame));
+    return n;
 }
 
 
@@ -491,119 +1027,108 @@ detect_log(const arucotag_detector_s *detect,
            const sequence_arucotag_portinfo *ports,
            const arucotag_pose *pose,
            const arucotag_pixel_pose *pixel_pose, int16_t out_frame,
-           arucotag_log_s **log, const genom_context self)
+           arucotag_log_s **log, arucotag_timing_s **timing,
+           const genom_context self)
 {
-    if (*log)
+    arucotag_genom_ports io(NULL, NULL, NULL, NULL, pose, pixel_pose, NULL, self);
+    return detect_log(io, detect, out_frame, log, timing, self);
+}
+
+genom_event
+detect_log(arucotag_ports &io, const arucotag_detector_s *detect,
+           int16_t out_frame, arucotag_log_s **log, arucotag_timing_s **timing,
+           const genom_context self)
+{
+    if (!*log || !(*log)->running)
+        return arucotag_poll;
+
+    // The writer thread stopped on an error
+    if ((*log)->failed)
     {
-        if ((*log)->req.aio_fildes >= 0)
-        {
-            (*log)->total++;
-            if ((*log)->total % (*log)->decimation == 0)
-                if ((*log)->pending)
-                {
-                    if (aio_error(&(*log)->req) != EINPROGRESS)
-                    {
-                        (*log)->pending = false;
-                        if (aio_return(&(*log)->req) <= 0)
-                        {
-                            warn("log");
-                            close((*log)->req.aio_fildes);
-                            (*log)->req.aio_fildes = -1;
-                        }
-                    }
-                    else
-                    {
-                        (*log)->skipped = true;
-                        (*log)->missed++;
-                    }
-                }
-        }
-        if ((*log)->req.aio_fildes >= 0 && !(*log)->pending)
-        {
-            uint32_t n = snprintf((*log)->buffer, sizeof((*log)->buffer), "%s", "");
-            for (uint16_t i=0; i<detect->ids.size(); i++)
-            {
-                // Check that detected tags are among tracked markers
-                const char* tagid = to_string(detect->ids[i]).c_str();
-                uint16_t j = 0;
-                for (j=0; j<ports->_length; j++)
-                    if (!strcmp(ports->_buffer[j], tagid))
-                        break;
-                if (j == ports->_length) continue;
-
-                or_pose_estimator_state* posedata = pose->data(tagid, self);
-
-                // roll/pitch/yaw conversion
-                double qw = posedata->att._value.qw;
-                double qx = posedata->att._value.qx;
-                double qy = posedata->att._value.qy;
-                double qz = posedata->att._value.qz;
-                double roll = atan2(2 * (qw*qx + qy*qz), 1 - 2 * (qx*qx + qy*qy));
-                double pitch = asin(2 * (qw*qy - qz*qx));
-                double yaw = atan2(2 * (qw*qz + qx*qy), 1 - 2 * (qy*qy + qz*qz));
-
-                char buffer[1024];
-                n += snprintf(
-                    buffer, sizeof(buffer),
-                    "%s" arucotag_log_fmt "\n",
-                    (*log)->skipped ? "\n" : "",
-                    posedata->ts.sec, posedata->ts.nsec,
-                    out_frame,                                      // frame
-                    tagid,                                          // tag id
-                    pixel_pose->data(tagid, self)->pix._value.x,
-                    pixel_pose->data(tagid, self)->pix._value.y,    // pixel
-                    posedata->pos._value.x,                         // p
-                    posedata->pos._value.y,
-                    posedata->pos._value.z,
-                    qw,                                             // att (quat)
-                    qx,
-                    qy,
-                    qz,
-                    roll,                                           // att (euler)
-                    pitch,
-                    yaw,
-                    posedata->pos_cov._value.cov[0],                // Sigma_p
-                    posedata->pos_cov._value.cov[1],
-                    posedata->pos_cov._value.cov[2],
-                    posedata->pos_cov._value.cov[3],
-                    posedata->pos_cov._value.cov[4],
-                    posedata->pos_cov._value.cov[5],
-                    posedata->att_cov._value.cov[0],                // Sigma_q
-                    posedata->att_cov._value.cov[1],
-                    posedata->att_cov._value.cov[2],
-                    posedata->att_cov._value.cov[3],
-                    posedata->att_cov._value.cov[4],
-                    posedata->att_cov._value.cov[5],
-                    posedata->att_cov._value.cov[6],
-                    posedata->att_cov._value.cov[7],
-                    posedata->att_cov._value.cov[8],
-                    posedata->att_cov._value.cov[9]
-                );
-                strcat((*log)->buffer, buffer);
-                (*log)->req.aio_nbytes = n;
-            }
+        (*log)->stop();
+        return arucotag_poll;
+    }
 
-            if (!n)
-                return arucotag_poll;   // avoid log of empty to_string
+    if ((*log)->total++ % (*log)->decimation)
+        return arucotag_poll;
 
-            if (aio_write(&(*log)->req))
-            {
-                warn("log");
-                close((*log)->req.aio_fildes);
-                (*log)->req.aio_fildes = -1;
-            }
-            else
-                (*log)->pending = true;
-            (*log)->skipped = false;
-        }
+    timespec t0;
+    if ((*timing)->enable)
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    size_t n = (*log)->binary ?
+        log_binary(detect, io, out_frame, *log) :
+        log_text(detect, io, out_frame, *log);
+
+    if (!n)
+        return arucotag_poll;   // avoid log of empty to_string
+
+    if ((*log)->push((*log)->buffer.data(), n))
+        (*log)->skipped = false;
+    else
+    {
+        (*log)->skipped = true;
+        (*log)->missed++;
     }
 
+    if ((*timing)->enable)
+        (*timing)->add(timing_log, ts_elapsed(t0));
     return arucotag_poll;
 }
 
 
+/** Codel detect_stop of task detect.
+ *
+ * Triggered by arucotag_stop.
+ * Yields to arucotag_ether.
+ */
+genom_event
+detect_stop(arucotag_pipeline_s **pipe, arucotag_cameras_s **cameras,
+            const genom_context self)
+{
+    (*pipe)->stop();
+    for (auto &c : (*cameras)->list)
+        c->pipe.stop();
+    return arucotag_ether;
+}
+
+
 /* --- Activity add_marker ---------------------------------------------- */
 
+/* Publish an empty message on newly opened output ports */
+static void
+publish_empty(arucotag_ports &io, const char *name)
+{
+    timeval tv;
+    gettimeofday(&tv, NULL);
+
+    or_pose_estimator_state *p = io.pose(name);
+    p->ts.sec = tv.tv_sec;
+    p->ts.nsec = tv.tv_usec*1000;
+    p->intrinsic = false;
+    p->pos._present = false;
+    p->pos_cov._present = false;
+    p->att._present = false;
+    p->att_cov._present = false;
+    p->att_pos_cov._present = false;
+    p->vel._present = false;
+    p->vel_cov._present = false;
+    p->avel._present = false;
+    p->avel_cov._present = false;
+    p->acc._present = false;
+    p->acc_cov._present = false;
+    p->aacc._present = false;
+    p->aacc_cov._present = false;
+
+    io.write_pose(name);
+
+    or_sensor_pixel *px = io.pixel_pose(name);
+    px->ts = p->ts;
+    px->pix._present = false;
+    io.write_pixel_pose(name);
+}
+
+
 /** Codel add_marker of activity add_marker.
  *
  * Triggered by arucotag_start.
@@ -614,18 +1139,37 @@ genom_event
 add_marker(const char marker[16], sequence_arucotag_portinfo *ports,
            const arucotag_pose *pose,
            const arucotag_pixel_pose *pixel_pose,
+           arucotag_detector_s **detect, const genom_context self)
+{
+    arucotag_genom_ports io(NULL, NULL, NULL, NULL, pose, pixel_pose, NULL, self);
+    return add_marker(io, marker, ports, detect, self);
+}
+
+genom_event
+add_marker(arucotag_ports &io, const char marker[16],
+           sequence_arucotag_portinfo *ports, arucotag_detector_s **detect,
            const genom_context self)
 {
-    // Check if marker is already in port list
-    uint16_t i;
-    for(i=0; i<ports->_length; i++)
-        if (!strcmp(ports->_buffer[i], marker))
-        {
-            arucotag_e_io_detail d;
-            snprintf(d.what, sizeof(d.what), "%s", "marker already tracked");
-            warnx("io error: %s", d.what);
-            return arucotag_e_io(&d,self);
-        }
+    // Marker names are their id in the dictionary
+    char *end;
+    long id = strtol(marker, &end, 10);
+    if (end == marker || *end || id < 0 || id >= (long)(*detect)->markers.size())
+    {
+        arucotag_e_io_detail d;
+        snprintf(d.what, sizeof(d.what), "%s", "marker name must be an id of the dictionary");
+        warnx("io error: %s", d.what);
+        return arucotag_e_io(&d,self);
+    }
+
+    // Check if marker is already tracked
+    if ((*detect)->marker(id))
+    {
+        arucotag_e_io_detail d;
+        snprintf(d.what, sizeof(d.what), "%s", "marker already tracked");
+        warnx("io error: %s", d.what);
+        return arucotag_e_io(&d,self);
+    }
+    uint16_t i = ports->_length;
 
     // Add it
     if (i >= ports->_maximum)
@@ -633,37 +1177,13 @@ add_marker(const char marker[16], sequence_arucotag_portinfo *ports,
             return arucotag_e_sys_error("add", self);
     (ports->_length)++;
     strncpy(ports->_buffer[i], marker, 16);
+    (*detect)->markers[id].port = i;
+    strncpy((*detect)->markers[id].name, marker, 16);
+    (*detect)->update_filter();
 
     // Init new out ports
-    pixel_pose->open(marker, self);
-    pose->open(marker, self);
-
-    // Publish empty message
-    timeval tv;
-    gettimeofday(&tv, NULL);
-
-    pose->data(marker, self)->ts.sec = tv.tv_sec;
-    pose->data(marker, self)->ts.nsec = tv.tv_usec*1000;
-    pose->data(marker, self)->intrinsic = false;
-    pose->data(marker, self)->pos._present = false;
-    pose->data(marker, self)->pos_cov._present = false;
-    pose->data(marker, self)->att._present = false;
-    pose->data(marker, self)->att_cov._present = false;
-    pose->data(marker, self)->att_pos_cov._present = false;
-    pose->data(marker, self)->vel._present = false;
-    pose->data(marker, self)->vel_cov._present = false;
-    pose->data(marker, self)->avel._present = false;
-    pose->data(marker, self)->avel_cov._present = false;
-    pose->data(marker, self)->acc._present = false;
-    pose->data(marker, self)->acc_cov._present = false;
-    pose->data(marker, self)->aacc._present = false;
-    pose->data(marker, self)->aacc_cov._present = false;
-
-    pose->write(marker, self);
-
-    pixel_pose->data(marker, self)->ts = pose->data(marker, self)->ts;
-    pixel_pose->data(marker, self)->pix._present = false;
-    pixel_pose->write(marker, self);
+    io.open(marker);
+    publish_empty(io, marker);
 
     warnx("tracking new marker: %s", marker);
     return arucotag_ether;
@@ -672,6 +1192,37 @@ add_marker(const char marker[16], sequence_arucotag_portinfo *ports,
 
 /* --- Activity remove_marker ------------------------------------------- */
 
+/* Index of the bundle of the given name in the detector, or -1 */
+static int
+find_bundle(const arucotag_detector_s *detect, const char *name)
+{
+    for (size_t b = 0; b < detect->bundles.size(); b++)
+        if (!strcmp(detect->bundles[b].name, name))
+            return b;
+    return -1;
+}
+
+/* Remove the i-th output port and stop tracking its tags */
+static void
+remove_port(sequence_arucotag_portinfo *ports, arucotag_detector_s *detect,
+            uint16_t i)
+{
+    // Move all following ports one step back in the array
+    for (uint16_t j=i; j<ports->_length-1; j++)
+        strncpy(ports->_buffer[j], ports->_buffer[j+1], 16);
+    // Remove last element of list
+    (ports->_length)--;
+
+    // Update the marker table accordingly
+    for (tracked_marker &m : detect->markers)
+        if (m.port == i)
+            m.port = -1;
+        else if (m.port > i)
+            m.port--;
+    detect->update_filter();
+}
+
+
 /** Codel remove_marker of activity remove_marker.
  *
  * Triggered by arucotag_start.
@@ -682,6 +1233,15 @@ genom_event
 remove_marker(const char marker[16], sequence_arucotag_portinfo *ports,
               const arucotag_pose *pose,
               const arucotag_pixel_pose *pixel_pose,
+              arucotag_detector_s **detect, const genom_context self)
+{
+    arucotag_genom_ports io(NULL, NULL, NULL, NULL, pose, pixel_pose, NULL, self);
+    return remove_marker(io, marker, ports, detect, self);
+}
+
+genom_event
+remove_marker(arucotag_ports &io, const char marker[16],
+              sequence_arucotag_portinfo *ports, arucotag_detector_s **detect,
               const genom_context self)
 {
     // Look for marker in port list
@@ -691,28 +1251,184 @@ remove_marker(const char marker[16], sequence_arucotag_portinfo *ports,
             break;
 
     // If marker not found, throw exception
+    const char *error = NULL;
     if (i >= ports->_length)
+        error = "marker not tracked";
+    else if (find_bundle(*detect, marker) >= 0)
+        error = "marker is a bundle, see remove_bundle";
+    if (error)
     {
         arucotag_e_io_detail d;
-        snprintf(d.what, sizeof(d.what), "%s", "marker not tracked");
+        snprintf(d.what, sizeof(d.what), "%s", error);
         warnx("io error: %s", d.what);
         return arucotag_e_io(&d,self);
     }
-    // Otherwise, remove it:
-    else
+    // Otherwise, remove it
+    remove_port(ports, *detect, i);
+
+    // Closing will cause poster closed when other components will try to read on the port
+    io.close(marker);
+
+    warnx("stop tracking marker: %s", marker);
+    return arucotag_ether;
+}
+
+
+/* --- Activity add_bundle ---------------------------------------------- */
+
+/* Forget the previous poses of the tag id in all cameras, so that the pose of
+ * a bundle and of a single tag are never voted against each other */
+static void
+forget_tag(arucotag_detector_s *detect, arucotag_cameras_s *cameras, int id)
+{
+    detect->history.tags[id].history.clear();
+    for (auto &c : cameras->list)
+        c->history.tags[id].history.clear();
+}
+
+/** Codel add_bundle of activity add_bundle.
+ *
+ * Triggered by arucotag_start.
+ * Yields to arucotag_ether.
+ * Throws arucotag_e_io, arucotag_e_sys.
+ */
+genom_event
+add_bundle(const char bundle[16],
+           const sequence_arucotag_bundle_tag_s *tags,
+           sequence_arucotag_portinfo *ports, const arucotag_pose *pose,
+           const arucotag_pixel_pose *pixel_pose,
+           arucotag_detector_s **detect, arucotag_cameras_s **cameras,
+           const genom_context self)
+{
+    arucotag_genom_ports io(NULL, NULL, NULL, NULL, pose, pixel_pose, NULL, self);
+    return add_bundle(io, bundle, tags, ports, detect, cameras, self);
+}
+
+genom_event
+add_bundle(arucotag_ports &io, const char bundle[16],
+           const sequence_arucotag_bundle_tag_s *tags,
+           sequence_arucotag_portinfo *ports, arucotag_detector_s **detect,
+           arucotag_cameras_s **cameras, const genom_context self)
+{
+    arucotag_detector_s *d = *detect;
+    const char *error = NULL;
+    char *end;
+    strtol(bundle, &end, 10);
+    if (!bundle[0])
+        error = "bundle name must not be empty";
+    else if (!*end)
+        error = "bundle name must not be a marker id";
+    else if (!tags->_length)
+        error = "bundle must have tags";
+    else if (tags->_length > arucotag_bundle_max)
+        error = "too many tags in bundle";
+    for (uint16_t i=0; !error && i<ports->_length; i++)
+        if (!strcmp(ports->_buffer[i], bundle))
+            error = "bundle already tracked";
+    for (uint32_t k=0; !error && k<tags->_length; k++)
+    {
+        int id = tags->_buffer[k].id;
+        if ((size_t)id >= d->markers.size())
+            error = "tag id not in the dictionary";
+        else if (d->marker(id))
+            error = "tag already tracked";
+        for (uint32_t j=0; !error && j<k; j++)
+            if (tags->_buffer[j].id == id)
+                error = "tag twice in bundle";
+    }
+    if (error)
+    {
+        arucotag_e_io_detail e;
+        snprintf(e.what, sizeof(e.what), "%s", error);
+        warnx("io error: %s", e.what);
+        return arucotag_e_io(&e,self);
+    }
+
+    // Add a port for the bundle
+    uint16_t i = ports->_length;
+    if (i >= ports->_maximum)
+        if (genom_sequence_reserve(ports, i + 1))
+            return arucotag_e_sys_error("add", self);
+    (ports->_length)++;
+    strncpy(ports->_buffer[i], bundle, 16);
+
+    // Its tags are tracked under its name
+    int16_t b = d->bundles.size();
+    d->bundles.emplace_back();
+    tag_bundle &bd = d->bundles.back();
+    strncpy(bd.name, bundle, 16);
+    for (uint32_t k=0; k<tags->_length; k++)
+    {
+        const arucotag_bundle_tag_s &t = tags->_buffer[k];
+        bd.ids.push_back(t.id);
+        bd.O_R_M.push_back(rpy_matrix(t.roll, t.pitch, t.yaw));
+        bd.O_p_M.push_back(Vector3d(t.x, t.y, t.z));
+
+        tracked_marker &m = d->markers[t.id];
+        m.port = i;
+        strncpy(m.name, bundle, 16);
+        m.bundle = b;
+        m.member = k;
+    }
+    forget_tag(d, *cameras, bd.ids[0]);
+    d->update_filter();
+
+    // Init new out ports
+    io.open(bundle);
+    publish_empty(io, bundle);
+
+    warnx("tracking new bundle: %s (%u tags)", bundle, (unsigned)tags->_length);
+    return arucotag_ether;
+}
+
+
+/* --- Activity remove_bundle ------------------------------------------- */
+
+/** Codel remove_bundle of activity remove_bundle.
+ *
+ * Triggered by arucotag_start.
+ * Yields to arucotag_ether.
+ * Throws arucotag_e_io.
+ */
+genom_event
+remove_bundle(const char bundle[16], sequence_arucotag_portinfo *ports,
+              const arucotag_pose *pose,
+              const arucotag_pixel_pose *pixel_pose,
+              arucotag_detector_s **detect, arucotag_cameras_s **cameras,
+              const genom_context self)
+{
+    arucotag_genom_ports io(NULL, NULL, NULL, NULL, pose, pixel_pose, NULL, self);
+    return remove_bundle(io, bundle, ports, detect, cameras, self);
+}
+
+genom_event
+remove_bundle(arucotag_ports &io, const char bundle[16],
+              sequence_arucotag_portinfo *ports, arucotag_detector_s **detect,
+              arucotag_cameras_s **cameras, const genom_context self)
+{
+    arucotag_detector_s *d = *detect;
+    int b = find_bundle(d, bundle);
+    if (b < 0)
     {
-        // Move all following ports one step back in the array
-        for (uint16_t j=i; j<ports->_length; j++)
-            strncpy(ports->_buffer[j], ports->_buffer[j+1], 16);
-        // Remove last element of list
-        (ports->_length)--;
+        arucotag_e_io_detail e;
+        snprintf(e.what, sizeof(e.what), "%s", "bundle not tracked");
+        warnx("io error: %s", e.what);
+        return arucotag_e_io(&e,self);
     }
 
+    forget_tag(d, *cameras, d->bundles[b].ids[0]);
+    remove_port(ports, d, d->markers[d->bundles[b].ids[0]].port);
+    for (tracked_marker &m : d->markers)
+        if (m.bundle == b)
+            m.bundle = -1;
+        else if (m.bundle > b)
+            m.bundle--;
+    d->bundles.erase(d->bundles.begin() + b);
+
     // Closing will cause poster closed when other components will try to read on the port
-    pixel_pose->close(marker, self);
-    pose->close(marker, self);
+    io.close(bundle);
 
-    warnx("stop tracking marker: %s", marker);
+    warnx("stop tracking bundle: %s", bundle);
     return arucotag_ether;
 }
 
@@ -728,16 +1444,223 @@ remove_marker(const char marker[16], sequence_arucotag_portinfo *ports,
 genom_event
 set_calib(const arucotag_intrinsics *intrinsics,
           const arucotag_extrinsics *extrinsics,
-          arucotag_calib_s **calib, const genom_context self)
+          arucotag_calib_s **calib, arucotag_cameras_s **cameras,
+          const genom_context self)
+{
+    arucotag_genom_ports io(NULL, NULL, intrinsics, extrinsics, NULL, NULL, NULL, self);
+    return set_calib(io, calib, cameras, self);
+}
+
+genom_event
+set_calib(arucotag_ports &io, arucotag_calib_s **calib,
+          arucotag_cameras_s **cameras, const genom_context self)
 {
-    if (intrinsics->read(self) != genom_ok || !intrinsics->data(self) ||
-        extrinsics->read(self) != genom_ok || !extrinsics->data(self))
+    const or_sensor_intrinsics *intrinsics = io.read_intrinsics();
+    const or_sensor_extrinsics *extrinsics = intrinsics ? io.read_extrinsics() : NULL;
+    if (!intrinsics || !extrinsics)
     {
         arucotag_e_io_detail d;
         snprintf(d.what, sizeof(d.what), "%s", "cannot read calibration input ports");
         warnx("io error: %s", d.what);
         return arucotag_e_io(&d,self);
     }
-    update_calib(intrinsics, extrinsics, calib, self);
+    update_calib(intrinsics, extrinsics, *calib);
+
+    // Other cameras are read again before their next frame
+    for (auto &c : (*cameras)->list)
+        c->calibrated = false;
+    return arucotag_ether;
+}
+
+
+/* --- Activity add_camera ---------------------------------------------- */
+
+/** Codel add_camera of activity add_camera.
+ *
+ * Triggered by arucotag_start.
+ * Yields to arucotag_ether.
+ * Throws arucotag_e_io.
+ */
+genom_event
+add_camera(const char camera[16],
+           const arucotag_camera_frame *camera_frame,
+           const arucotag_camera_intrinsics *camera_intrinsics,
+           const arucotag_camera_extrinsics *camera_extrinsics,
+           arucotag_cameras_s **cameras, const arucotag_detector_s *detect,
+           const genom_context self)
+{
+    arucotag_genom_ports io(NULL, NULL, NULL, NULL, NULL, NULL, NULL, self);
+    io.bind_cameras(camera_frame, camera_intrinsics, camera_extrinsics);
+    return add_camera(io, camera, cameras, detect, self);
+}
+
+genom_event
+add_camera(arucotag_ports &io, const char camera[16],
+           arucotag_cameras_s **cameras, const arucotag_detector_s *detect,
+           const genom_context self)
+{
+    const char *error = NULL;
+    if (!camera[0])
+        error = "camera name must not be empty";
+    else if ((*cameras)->find(camera))
+        error = "camera already added";
+    else if ((*cameras)->list.size() >= arucotag_cameras_max)
+        error = "too many cameras";
+    if (error)
+    {
+        arucotag_e_io_detail d;
+        snprintf(d.what, sizeof(d.what), "%s", error);
+        warnx("io error: %s", d.what);
+        return arucotag_e_io(&d,self);
+    }
+
+    if (!io.open_camera(camera))
+    {
+        io.close_camera(camera);
+        arucotag_e_io_detail d;
+        snprintf(d.what, sizeof(d.what), "cannot open the ports of camera %s", camera);
+        warnx("io error: %s", d.what);
+        return arucotag_e_io(&d,self);
+    }
+
+    arucotag_camera *c = new arucotag_camera(camera, detect->markers.size());
+    c->pipe.notify = &(*cameras)->done;
+    c->pipe.start(detect->dict);
+    (*cameras)->list.emplace_back(c);
+
+    warnx("new camera: %s", camera);
+    return arucotag_ether;
+}
+
+
+/* --- Activity remove_camera ------------------------------------------- */
+
+/** Codel remove_camera of activity remove_camera.
+ *
+ * Triggered by arucotag_start.
+ * Yields to arucotag_ether.
+ * Throws arucotag_e_io.
+ */
+genom_event
+remove_camera(const char camera[16],
+              const arucotag_camera_frame *camera_frame,
+              const arucotag_camera_intrinsics *camera_intrinsics,
+              const arucotag_camera_extrinsics *camera_extrinsics,
+              arucotag_cameras_s **cameras, const genom_context self)
+{
+    arucotag_genom_ports io(NULL, NULL, NULL, NULL, NULL, NULL, NULL, self);
+    io.bind_cameras(camera_frame, camera_intrinsics, camera_extrinsics);
+    return remove_camera(io, camera, cameras, self);
+}
+
+genom_event
+remove_camera(arucotag_ports &io, const char camera[16],
+              arucotag_cameras_s **cameras, const genom_context self)
+{
+    auto &list = (*cameras)->list;
+    size_t i;
+    for (i = 0; i < list.size(); i++)
+        if (!strcmp(list[i]->name, camera))
+            break;
+    if (i >= list.size())
+    {
+        arucotag_e_io_detail d;
+        snprintf(d.what, sizeof(d.what), "%s", "unknown camera");
+        warnx("io error: %s", d.what);
+        return arucotag_e_io(&d,self);
+    }
+
+    // Frames in flight are dropped
+    list[i]->pipe.stop();
+    list.erase(list.begin() + i);
+    io.close_camera(camera);
+
+    warnx("removed camera: %s", camera);
+    return arucotag_ether;
+}
+
+
+/* --- Activity record -------------------------------------------------- */
+
+/** Codel record_start of activity record.
+ *
+ * Triggered by arucotag_start.
+ * Yields to arucotag_ether.
+ * Throws arucotag_e_sys.
+ */
+genom_event
+record_start(const char path[64], arucotag_record_s **record,
+             const genom_context self)
+{
+    if (!(*record)->stop())
+        warn("record %s", (*record)->path.c_str());
+
+    int fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    if (fd < 0 || !(*record)->start(path, fd))
+        return arucotag_e_sys_error(path, self);
+
+    return arucotag_ether;
+}
+
+
+/* --- Activity record_stop --------------------------------------------- */
+
+/** Codel record_stop of activity record_stop.
+ *
+ * Triggered by arucotag_start.
+ * Yields to arucotag_ether.
+ * Throws arucotag_e_sys.
+ */
+genom_event
+record_stop(arucotag_record_s **record, const genom_context self)
+{
+    if (!(*record)->stop())
+        return arucotag_e_sys_error((*record)->path.c_str(), self);
+
+    return arucotag_ether;
+}
+
+
+/* --- Activity replay -------------------------------------------------- */
+
+/** Codel replay_start of activity replay.
+ *
+ * Triggered by arucotag_start.
+ * Yields to arucotag_ether.
+ * Throws arucotag_e_sys, arucotag_e_io.
+ */
+genom_event
+replay_start(const char path[64], bool realtime, bool loop,
+             arucotag_replay_s **replay, const genom_context self)
+{
+    if (!(*replay)->open(path, realtime, loop))
+    {
+        if (errno != EINVAL && errno != ENODATA)
+            return arucotag_e_sys_error(path, self);
+
+        arucotag_e_io_detail d;
+        snprintf(d.what, sizeof(d.what), "%s: %s", path,
+                 errno == EINVAL ? "not a frame recording" : "empty recording");
+        warnx("io error: %s", d.what);
+        return arucotag_e_io(&d,self);
+    }
+
+    warnx("replaying %zu frames from %s", (*replay)->rec.size(), path);
+    return arucotag_ether;
+}
+
+
+/* --- Activity replay_stop --------------------------------------------- */
+
+/** Codel replay_stop of activity replay_stop.
+ *
+ * Triggered by arucotag_start.
+ * Yields to arucotag_ether.
+ */
+genom_event
+replay_stop(arucotag_replay_s **replay, const genom_context self)
+{
+    (*replay)->active = false;
+    (*replay)->rec.close();
     return arucotag_ether;
 }
@@ -0,0 +1,383 @@
+/*
+ * Copyright (c) 2020 LAAS/CNRS
+ * All rights reserved.
+ *
+ * Redistribution  and  use  in  source  and binary  forms,  with  or  without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * THE SOFTWARE  IS PROVIDED "AS IS"  AND THE AUTHOR  DISCLAIMS ALL WARRANTIES
+ * WITH  REGARD   TO  THIS  SOFTWARE  INCLUDING  ALL   IMPLIED  WARRANTIES  OF
+ * MERCHANTABILITY AND  FITNESS.  IN NO EVENT  SHALL THE AUTHOR  BE LIABLE FOR
+ * ANY  SPECIAL, DIRECT,  INDIRECT, OR  CONSEQUENTIAL DAMAGES  OR  ANY DAMAGES
+ * WHATSOEVER  RESULTING FROM  LOSS OF  USE, DATA  OR PROFITS,  WHETHER  IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR  OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *                                                  Martin Jacquet - June 2020
+ */
+#include "acarucotag.h"
+
+#include "arucotag_c_types.h"
+
+#include "codels.hpp"
+
+
+/* --- Frame decoding --------------------------------------------------- */
+
+/* Convert frame data to an 8 bits image for the tag finder, and measure
+ * the time spent.
+ * Returns false if the frame could not be decoded.
+ */
+bool
+frame_ingest::decode(const or_sensor_frame *fdata, Mat &frame,
+                     const find_options &opt)
+{
+    timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bool ok = convert(fdata, frame, opt);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    time = ts_diff(end, start);
+    return ok;
+}
+
+
+/* Convert frame data to cv::Mat. Compressed frames are decoded into the
+ * decoded buffer, which is reallocated only when the frame size changes.
+ *
+ * The frame format is given by opt.codec rather than guessed from the data.
+ * JPEG frames are decoded to grayscale and downscaled by the decoder when
+ * the detection runs on a decimated frame anyway, see tag_finder::find().
+ *
+ * Uncompressed colour and 16 bits frames are converted to 8 bits grayscale
+ * into the converted buffer, 8 bits grayscale frames are used in place.
+ * Returns false if the frame could not be decoded.
+ */
+bool
+frame_ingest::convert(const or_sensor_frame *fdata, Mat &frame,
+                      const find_options &opt)
+{
+    copied = 0;
+    scale = 1;
+    if (fdata->compressed && opt.codec == 1)
+    {
+        // Tracked regions need full resolution, but they are not known
+        // before the frame is decoded: downscale only without tracking
+        uint16_t s = opt.track ? 1 : std::min<uint16_t>(opt.decimation, 8);
+        if (!jpeg.decode(fdata->pixels._buffer, fdata->pixels._length, s, decoded))
+            return false;
+        frame = decoded;
+        scale = s;
+        return true;
+    }
+    if (fdata->compressed)
+    {
+        // Non-owning header on the frame data, imdecode() reads from it
+        // directly
+        Mat buf(1, fdata->pixels._length, CV_8UC1, fdata->pixels._buffer);
+        imdecode(buf, IMREAD_GRAYSCALE, &decoded);
+        frame = decoded;
+        return !frame.empty();
+    }
+
+    int type;
+    if      (fdata->bpp == 1) type = CV_8UC1;
+    else if (fdata->bpp == 2) type = CV_16UC1;
+    else if (fdata->bpp == 3) type = CV_8UC3;
+    else if (fdata->bpp == 4) type = CV_8UC4;
+    else return false;
+
+    Mat raw(Size(fdata->width, fdata->height), type, fdata->pixels._buffer, Mat::AUTO_STEP);
+
+    // The conversions below are vectorized by opencv
+    switch (type)
+    {
+        case CV_8UC1:
+            frame = raw;
+            return true;
+        case CV_8UC3:
+            cvtColor(raw, converted, COLOR_BGR2GRAY);
+            break;
+        case CV_8UC4:
+            cvtColor(raw, converted, COLOR_BGRA2GRAY);
+            break;
+        case CV_16UC1:
+            if (opt.gray16_mode == 0)
+                // Keep the 8 bits above the shift
+                raw.convertTo(converted, CV_8U, 1. / (1 << opt.gray16_shift));
+            else
+            {
+                // Map [low, high] linearly to [0, 255], values outside saturate
+                double a = 255. / (opt.gray16_high - opt.gray16_low);
+                raw.convertTo(converted, CV_8U, a, -a * opt.gray16_low);
+            }
+            break;
+    }
+    frame = converted;
+    return true;
+}
+
+
+/* --- Detection -------------------------------------------------------- */
+
+/* Find tags in frame and store their ids, corners and pyramid level.
+ *
+ * frame may have been downscaled by scale when decoded. The detection then
+ * runs on it as is, or further decimated to reach opt.decimation, and the
+ * results are expressed at full resolution.
+ */
+void
+tag_finder::find(const Mat &frame, const Ptr<aruco::Dictionary> &dict,
+                 const find_options &opt, uint16_t scale)
+{
+    rejected = 0;
+    if (scale <= 1)
+    {
+        search(frame, dict, opt, opt.decimation);
+        return;
+    }
+
+    // Work in the coordinates of the downscaled frame, including the
+    // previous detections used for tracking
+    const Point2f half(0.5f, 0.5f);
+    for (vector<Point2f> &c : corners)
+        for (Point2f &p : c)
+            p = (p + half) / (float)scale - half;
+
+    search(frame, dict, opt, std::max(1, opt.decimation / scale));
+
+    uint8_t level = 0;
+    for (uint16_t d = scale; d > 1; d >>= 1)
+        level++;
+    for (uint8_t &l : levels)
+        l += level;
+    for (vector<Point2f> &c : corners)
+        for (Point2f &p : c)
+            p = (p + half) * (float)scale - half;
+}
+
+
+/* Find tags in frame, at the frame resolution.
+ *
+ * When tracking is enabled, the detection only runs in regions of interest
+ * predicted around the tags found in the previous frame. The full frame is
+ * scanned every opt.track_rescan frames, or as soon as a tag is lost so that it
+ * is re-acquired in the same frame.
+ *
+ * Full frame scans run on the frame decimated by decimation, and the corners
+ * of the tags found there are refined at full resolution.
+ *
+ * When opt.tracked is set, tags with other ids are dropped as soon as they
+ * are decoded.
+ */
+void
+tag_finder::search(const Mat &frame, const Ptr<aruco::Dictionary> &dict,
+                   const find_options &opt, uint16_t decimation)
+{
+    Rect full(0, 0, frame.cols, frame.rows);
+
+    // With the tracked id filter, corners are refined here after the
+    // untracked candidates are rejected rather than by detectMarkers()
+    const Ptr<aruco::DetectorParameters> *params = &opt.params;
+    bool subpix = false;
+    TermCriteria criteria(TermCriteria::COUNT | TermCriteria::EPS,
+                          opt.params->cornerRefinementMaxIterations,
+                          opt.params->cornerRefinementMinAccuracy);
+    if (opt.tracked && opt.params->cornerRefinementMethod == aruco::CORNER_REFINE_SUBPIX)
+    {
+        *raw_params = *opt.params;
+        raw_params->cornerRefinementMethod = aruco::CORNER_REFINE_NONE;
+        params = &raw_params;
+        subpix = true;
+    }
+
+    rois.clear();
+    if (opt.track && !ids.empty() && since_scan + 1 < opt.track_rescan)
+    {
+        // Pad the bounding box of each previous detection
+        for (const vector<Point2f> &c : corners)
+        {
+            Rect r = boundingRect(c);
+            int p = opt.track_pad * std::max(r.width, r.height);
+            r.x -= p;
+            r.y -= p;
+            r.width += 2*p;
+            r.height += 2*p;
+            r &= full;
+            if (r.area() > 0)
+                rois.push_back(r);
+        }
+
+        // Merge overlapping regions so that each tag is searched once. A
+        // merged region may grow into any other one, so this runs until no
+        // two regions overlap.
+        for (bool merged = true; merged; )
+        {
+            merged = false;
+            for (size_t i = 0; i < rois.size(); i++)
+                for (size_t j = i+1; j < rois.size(); j++)
+                    if ((rois[i] & rois[j]).area() > 0)
+                    {
+                        rois[i] |= rois[j];
+                        rois.erase(rois.begin() + j);
+                        j = i;
+                        merged = true;
+                    }
+        }
+    }
+
+    // Rejections are only counted for the pass whose results are kept
+    uint32_t rejected_before = rejected;
+    if (!rois.empty())
+    {
+        prev_ids = ids;
+        ids.clear();
+        corners.clear();
+        for (const Rect &r : rois)
+        {
+            // Perimeter limits are relative to the image size, express them
+            // wrt the full frame
+            double scale = (double)std::max(frame.cols, frame.rows) / std::max(r.width, r.height);
+            *roi_params = **params;
+            roi_params->minMarkerPerimeterRate *= scale;
+            roi_params->maxMarkerPerimeterRate *= scale;
+
+            aruco::detectMarkers(frame(r), dict, roi_corners, roi_ids, roi_params);
+            for (size_t i = 0; i < roi_ids.size(); i++)
+            {
+                for (Point2f &p : roi_corners[i])
+                    p += Point2f(r.x, r.y);
+                ids.push_back(roi_ids[i]);
+                corners.push_back(roi_corners[i]);
+            }
+        }
+
+        // A tag across the border of two regions may still be decoded twice,
+        // keep its first detection
+        size_t n = 0;
+        for (size_t i = 0; i < ids.size(); i++)
+            if (std::find(ids.begin(), ids.begin() + n, ids[i]) == ids.begin() + n)
+            {
+                if (n != i)
+                {
+                    ids[n] = ids[i];
+                    corners[n].swap(corners[i]);
+                }
+                n++;
+            }
+        ids.resize(n);
+        corners.resize(n);
+        reject(opt);
+        if (subpix)
+            refine(frame, Size(opt.params->cornerRefinementWinSize, opt.params->cornerRefinementWinSize), criteria);
+        levels.assign(ids.size(), 0);
+        since_scan++;
+
+        // Done if no tag was lost since previous frame
+        bool lost = false;
+        for (int id : prev_ids)
+            if (std::find(ids.begin(), ids.end(), id) == ids.end())
+            {
+                lost = true;
+                break;
+            }
+        if (!lost)
+            return;
+    }
+
+    since_scan = 0;
+    rejected = rejected_before;
+    if (decimation <= 1)
+    {
+        aruco::detectMarkers(frame, dict, corners, ids, *params);
+        reject(opt);
+        if (subpix)
+            refine(frame, Size(opt.params->cornerRefinementWinSize, opt.params->cornerRefinementWinSize), criteria);
+        levels.assign(ids.size(), 0);
+        return;
+    }
+
+    // Find and decode candidates on the decimated frame
+    resize(frame, small, Size(frame.cols / decimation, frame.rows / decimation), 0, 0, INTER_AREA);
+    aruco::detectMarkers(small, dict, corners, ids, *params);
+    reject(opt);
+
+    uint8_t level = 0;
+    for (uint16_t d = decimation; d > 1; d >>= 1)
+        level++;
+    levels.assign(ids.size(), level);
+
+    // Back to full resolution, the center of pixel x of the decimated frame
+    // is at (x + 0.5) * decimation - 0.5 in the full frame
+    for (vector<Point2f> &c : corners)
+        for (Point2f &p : c)
+        {
+            p.x = (p.x + 0.5f) * decimation - 0.5f;
+            p.y = (p.y + 0.5f) * decimation - 0.5f;
+        }
+
+    // The search window must cover the localization error of the decimated frame
+    refine(frame, Size(decimation + 1, decimation + 1),
+           TermCriteria(TermCriteria::COUNT | TermCriteria::EPS, 20, 0.01));
+}
+
+
+/* Drop the detections of untracked tags, if opt.tracked is set.
+ */
+void
+tag_finder::reject(const find_options &opt)
+{
+    if (!opt.tracked) return;
+
+    const vector<uint8_t> &tracked = *opt.tracked;
+    size_t n = 0;
+    for (size_t i = 0; i < ids.size(); i++)
+        if (ids[i] >= 0 && (size_t)ids[i] < tracked.size() && tracked[ids[i]])
+        {
+            if (n != i)
+            {
+                ids[n] = ids[i];
+                corners[n].swap(corners[i]);
+            }
+            n++;
+        }
+    rejected += ids.size() - n;
+    ids.resize(n);
+    corners.resize(n);
+}
+
+
+/* Refine the corners of all detections at the frame resolution.
+ */
+void
+tag_finder::refine(const Mat &frame, Size win, TermCriteria criteria)
+{
+    if (ids.empty())
+        return;
+
+    // Sub-pixel refinement needs an 8 bits grayscale image
+    if (frame.type() == CV_8UC1)
+        gray = frame;
+    else if (frame.type() == CV_8UC3)
+        cvtColor(frame, gray, COLOR_BGR2GRAY);
+    else if (frame.type() == CV_8UC4)
+        cvtColor(frame, gray, COLOR_BGRA2GRAY);
+    else
+        return;
+
+    refined.clear();
+    for (const vector<Point2f> &c : corners)
+        refined.insert(refined.end(), c.begin(), c.end());
+
+    cornerSubPix(gray, refined, win, Size(-1, -1), criteria);
+
+    size_t k = 0;
+    for (vector<Point2f> &c : corners)
+        for (Point2f &p : c)
+            p = refined[k++];
+}
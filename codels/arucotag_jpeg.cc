@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2020 LAAS/CNRS
+ * All rights reserved.
+ *
+ * Redistribution  and  use  in  source  and binary  forms,  with  or  without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * THE SOFTWARE  IS PROVIDED "AS IS"  AND THE AUTHOR  DISCLAIMS ALL WARRANTIES
+ * WITH  REGARD   TO  THIS  SOFTWARE  INCLUDING  ALL   IMPLIED  WARRANTIES  OF
+ * MERCHANTABILITY AND  FITNESS.  IN NO EVENT  SHALL THE AUTHOR  BE LIABLE FOR
+ * ANY  SPECIAL, DIRECT,  INDIRECT, OR  CONSEQUENTIAL DAMAGES  OR  ANY DAMAGES
+ * WHATSOEVER  RESULTING FROM  LOSS OF  USE, DATA  OR PROFITS,  WHETHER  IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR  OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *                                                  Martin Jacquet - June 2020
+ */
+#include "acarucotag.h"
+
+#include "arucotag_c_types.h"
+
+#include "codels.hpp"
+
+#ifdef HAVE_LIBJPEG
+#include <stdio.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+#endif
+
+
+/* --- JPEG decoding ---------------------------------------------------- */
+
+#ifdef HAVE_LIBJPEG
+
+struct jpeg_gray::state {
+    jpeg_decompress_struct cinfo;
+    struct error_mgr {
+        jpeg_error_mgr pub;
+        jmp_buf env;
+    } err;
+
+    // libjpeg exits on errors by default, jump back to the decoder instead
+    static void error_exit(j_common_ptr cinfo) {
+        error_mgr *e = (error_mgr *)cinfo->err;
+        char msg[JMSG_LENGTH_MAX];
+        (*cinfo->err->format_message)(cinfo, msg);
+        warnx("jpeg: %s", msg);
+        longjmp(e->env, 1);
+    }
+    static void output_message(j_common_ptr) {}
+};
+
+jpeg_gray::jpeg_gray() : s(new state)
+{
+    s->cinfo.err = jpeg_std_error(&s->err.pub);
+    s->err.pub.error_exit = state::error_exit;
+    s->err.pub.output_message = state::output_message;
+    jpeg_create_decompress(&s->cinfo);
+}
+
+jpeg_gray::~jpeg_gray()
+{
+    jpeg_destroy_decompress(&s->cinfo);
+    delete s;
+}
+
+
+/* Decode the luma of a JPEG image into out, downscaled by scale (1, 2, 4 or
+ * 8). Chroma components are parsed but neither transformed nor upsampled.
+ * out is reallocated only when the image size changes.
+ * Returns false on errors.
+ */
+bool
+jpeg_gray::decode(const uint8_t *data, size_t size, uint16_t scale, Mat &out)
+{
+    jpeg_decompress_struct *cinfo = &s->cinfo;
+
+    // No object with a destructor may live in this scope, longjmp() skips it
+    if (setjmp(s->err.env))
+    {
+        jpeg_abort_decompress(cinfo);
+        return false;
+    }
+
+    jpeg_mem_src(cinfo, (unsigned char *)data, size);
+    jpeg_read_header(cinfo, TRUE);
+
+    cinfo->out_color_space = JCS_GRAYSCALE;
+    cinfo->scale_num = 1;
+    cinfo->scale_denom = scale;
+    cinfo->dct_method = JDCT_ISLOW;
+    cinfo->do_fancy_upsampling = FALSE;
+    cinfo->do_block_smoothing = FALSE;
+    jpeg_start_decompress(cinfo);
+
+    out.create(cinfo->output_height, cinfo->output_width, CV_8UC1);
+    while (cinfo->output_scanline < cinfo->output_height)
+    {
+        JSAMPROW row = out.ptr<uint8_t>(cinfo->output_scanline);
+        jpeg_read_scanlines(cinfo, &row, 1);
+    }
+
+    jpeg_finish_decompress(cinfo);
+    return true;
+}
+
+#else /* HAVE_LIBJPEG */
+
+struct jpeg_gray::state {};
+
+jpeg_gray::jpeg_gray() : s(NULL)
+{
+}
+
+jpeg_gray::~jpeg_gray()
+{
+}
+
+bool
+jpeg_gray::decode(const uint8_t *data, size_t size, uint16_t scale, Mat &out)
+{
+    return false;
+}
+
+#endif /* HAVE_LIBJPEG */
@@ -0,0 +1,537 @@
+/*
+ * Copyright (c) 2020 LAAS/CNRS
+ * All rights reserved.
+ *
+ * Redistribution  and  use  in  source  and binary  forms,  with  or  without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * THE SOFTWARE  IS PROVIDED "AS IS"  AND THE AUTHOR  DISCLAIMS ALL WARRANTIES
+ * WITH  REGARD   TO  THIS  SOFTWARE  INCLUDING  ALL   IMPLIED  WARRANTIES  OF
+ * MERCHANTABILITY AND  FITNESS.  IN NO EVENT  SHALL THE AUTHOR  BE LIABLE FOR
+ * ANY  SPECIAL, DIRECT,  INDIRECT, OR  CONSEQUENTIAL DAMAGES  OR  ANY DAMAGES
+ * WHATSOEVER  RESULTING FROM  LOSS OF  USE, DATA  OR PROFITS,  WHETHER  IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR  OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *                                                  Martin Jacquet - June 2020
+ */
+#include "acarucotag.h"
+
+#include "arucotag_c_types.h"
+
+#include "codels.hpp"
+
+#ifdef HAVE_LIBURING
+# include <liburing.h>
+#endif
+
+/* Largest io_uring write. test_log builds with a smaller one, so that each
+ * buffer takes several writes, as after short writes.
+ */
+#ifndef arucotag_log_uring_write_max
+# define arucotag_log_uring_write_max arucotag_log_uring_size
+#endif
+
+
+/* --- Log file --------------------------------------------------------- */
+
+/* Output side of the log, owned by the writer thread: the current file, its
+ * preallocation and its rotation, and the way bytes reach it. With io_uring,
+ * bytes are copied to registered buffers, written with up to
+ * arucotag_log_uring_depth writes in flight. Without io_uring, at build or
+ * at run time, they are written with pwrite().
+ *
+ * Methods return false on error, with errno set.
+ */
+class log_file {
+    arucotag_log_s *log;
+    int fd;
+    unsigned files;     // files opened so far
+    off_t offset;       // where the next byte goes in the file
+    off_t allocated;    // end of the space preallocated in the file
+    bool prealloc;      // the file system supports fallocate()
+    bool uring;         // io_uring is used
+
+#ifdef HAVE_LIBURING
+    io_uring ring;
+    char *buffers;
+    struct {
+        off_t off;
+        size_t len, done;
+        bool busy;
+    } io[arucotag_log_uring_depth];
+    int current;        // buffer being filled, -1 if none
+    size_t fill;        // bytes in the current buffer
+    int inflight;       // writes submitted and not completed
+
+    char *buf(int i) { return buffers + (size_t)i*arucotag_log_uring_size; }
+    void queue(int i);
+    bool reap(bool wait);
+#endif
+
+    void reserve(off_t end);
+
+public:
+    log_file(arucotag_log_s *log, int fd);
+    ~log_file();
+
+    bool write(const char *p, size_t n);
+    bool submit();
+    bool flush();
+    bool next();
+    void close();
+};
+
+
+log_file::log_file(arucotag_log_s *log, int fd) :
+    log(log), fd(fd), files(1), prealloc(true), uring(false)
+{
+    offset = lseek(fd, 0, SEEK_CUR);
+    if (offset < 0) offset = 0;
+    allocated = offset;
+
+#ifdef HAVE_LIBURING
+    current = -1;
+    fill = 0;
+    inflight = 0;
+    for (int i = 0; i < arucotag_log_uring_depth; i++)
+        io[i].busy = false;
+
+    void *b;
+    if (posix_memalign(&b, 4096, (size_t)arucotag_log_uring_depth*arucotag_log_uring_size))
+        b = NULL;
+    buffers = (char *)b;
+
+    int e = buffers ? io_uring_queue_init(2*arucotag_log_uring_depth, &ring, 0) : -ENOMEM;
+    if (!e)
+    {
+        iovec iov[arucotag_log_uring_depth];
+        for (int i = 0; i < arucotag_log_uring_depth; i++)
+        {
+            iov[i].iov_base = buf(i);
+            iov[i].iov_len = arucotag_log_uring_size;
+        }
+        e = io_uring_register_buffers(&ring, iov, arucotag_log_uring_depth);
+        if (e)
+            io_uring_queue_exit(&ring);
+    }
+    if (e)
+        warnx("log: io_uring not available (%s), using pwrite", strerror(-e));
+    else
+        uring = true;
+#endif
+    log->uring = uring;
+}
+
+log_file::~log_file()
+{
+    close();
+#ifdef HAVE_LIBURING
+    if (uring)
+        io_uring_queue_exit(&ring);
+    free(buffers);
+#endif
+}
+
+
+/* Preallocate file space up to at least end, so that writes do not wait for
+ * block allocation. The file size is not changed.
+ */
+void
+log_file::reserve(off_t end)
+{
+    if (!prealloc || end <= allocated) return;
+
+    off_t len = end - allocated;
+    if (len < arucotag_log_prealloc) len = arucotag_log_prealloc;
+    if (log->rotate && allocated + len > (off_t)log->rotate && end <= (off_t)log->rotate)
+        len = log->rotate - allocated;
+
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, allocated, len))
+    {
+        if (errno != EOPNOTSUPP && errno != ENOSYS)
+            warn("log: fallocate");
+        prealloc = false;
+        return;
+    }
+    allocated += len;
+}
+
+
+/* Append n bytes to the file. With io_uring, the bytes may stay in a buffer
+ * until it is full or until submit().
+ */
+bool
+log_file::write(const char *p, size_t n)
+{
+#ifdef HAVE_LIBURING
+    if (uring)
+    {
+        while (n)
+        {
+            if (current < 0)
+            {
+                for (int i = 0; i < arucotag_log_uring_depth && current < 0; i++)
+                    if (!io[i].busy) current = i;
+                if (current < 0)
+                {
+                    if (!reap(true)) return false;
+                    continue;
+                }
+                fill = 0;
+            }
+
+            size_t c = arucotag_log_uring_size - fill;
+            if (c > n) c = n;
+            memcpy(buf(current) + fill, p, c);
+            fill += c;
+            p += c;
+            n -= c;
+            if (fill == arucotag_log_uring_size && !submit())
+                return false;
+        }
+        return true;
+    }
+#endif
+
+    reserve(offset + n);
+    while (n)
+    {
+        ssize_t w = pwrite(fd, p, n, offset);
+        if (w < 0)
+        {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p += w;
+        n -= w;
+        offset += w;
+        log->written += w;
+    }
+    return true;
+}
+
+
+#ifdef HAVE_LIBURING
+/* Queue the remaining part of the write of buffer i, up to
+ * arucotag_log_uring_write_max bytes. There are always enough submission
+ * entries, since there are twice as many as buffers.
+ */
+void
+log_file::queue(int i)
+{
+    size_t n = io[i].len - io[i].done;
+    if (n > arucotag_log_uring_write_max) n = arucotag_log_uring_write_max;
+
+    io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+    io_uring_prep_write_fixed(sqe, fd, buf(i) + io[i].done, n,
+                              io[i].off + io[i].done, i);
+    io_uring_sqe_set_data(sqe, (void *)(uintptr_t)i);
+    io[i].busy = true;
+    inflight++;
+}
+
+
+/* Collect the completed writes, waiting for at least one if wait is true.
+ * Short writes are resubmitted.
+ */
+bool
+log_file::reap(bool wait)
+{
+    io_uring_cqe *cqe;
+    int e;
+
+    if (wait)
+        while ((e = io_uring_wait_cqe(&ring, &cqe)) == -EINTR)
+            /* empty body */;
+    else
+        e = io_uring_peek_cqe(&ring, &cqe);
+
+    bool resubmit = false;
+    for (; !e; e = io_uring_peek_cqe(&ring, &cqe))
+    {
+        int i = (int)(uintptr_t)io_uring_cqe_get_data(cqe);
+        int res = cqe->res;
+        io_uring_cqe_seen(&ring, cqe);
+        inflight--;
+
+        if (res <= 0)
+        {
+            errno = res ? -res : EIO;
+            return false;
+        }
+        log->written += res;
+        io[i].done += res;
+        if (io[i].done < io[i].len)
+        {
+            queue(i);
+            resubmit = true;
+        }
+        else
+            io[i].busy = false;
+    }
+    if (e != -EAGAIN)
+    {
+        errno = -e;
+        return false;
+    }
+
+    if (resubmit && (e = io_uring_submit(&ring)) < 0)
+    {
+        errno = -e;
+        return false;
+    }
+    return true;
+}
+#endif
+
+
+/* Start writing the bytes buffered so far.
+ */
+bool
+log_file::submit()
+{
+#ifdef HAVE_LIBURING
+    if (!uring || current < 0 || !fill) return true;
+
+    reserve(offset + fill);
+    io[current].off = offset;
+    io[current].len = fill;
+    io[current].done = 0;
+    offset += fill;
+    queue(current);
+    current = -1;
+
+    int e = io_uring_submit(&ring);
+    if (e < 0)
+    {
+        errno = -e;
+        return false;
+    }
+    return reap(false);
+#else
+    return true;
+#endif
+}
+
+
+/* Wait until all the bytes are written.
+ */
+bool
+log_file::flush()
+{
+    if (!submit()) return false;
+#ifdef HAVE_LIBURING
+    while (uring && inflight)
+        if (!reap(true)) return false;
+#endif
+    return true;
+}
+
+
+/* Switch to the next file of the rotation, named after the first one with a
+ * numbered suffix.
+ */
+bool
+log_file::next()
+{
+    if (!flush()) return false;
+    close();
+
+    string name = log->path + "." + to_string(files++);
+    fd = open(name.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    if (fd < 0) return false;
+    offset = allocated = 0;
+    prealloc = true;
+
+    return write(log->header.data(), log->header.size());
+}
+
+
+/* Close the current file once written, and release the space that was
+ * preallocated beyond its end.
+ */
+void
+log_file::close()
+{
+    if (fd < 0) return;
+
+    if (!flush())
+        warn("log");
+    if (allocated > offset && ftruncate(fd, offset))
+        warn("log: ftruncate");
+    ::close(fd);
+    fd = -1;
+}
+
+
+/* --- Log -------------------------------------------------------------- */
+
+arucotag_log_s::arucotag_log_s() :
+    skipped(false), binary(false), decimation(1),
+    missed(0), total(0), high_water(0), oversized(false), rotate(0), file_bytes(0),
+    running(false), failed(false), uring(false), written(0)
+{
+    started.tv_sec = started.tv_nsec = 0;
+    sem_init(&sem, 0, 0);
+}
+
+arucotag_log_s::~arucotag_log_s()
+{
+    stop();
+    sem_destroy(&sem);
+}
+
+
+/* Start logging to the open file fd, named path, that already contains
+ * header. The ring between the task and the writer thread has at least
+ * capacity bytes. If rotate is not 0, a new file is started before an entry
+ * would grow the current one beyond rotate bytes.
+ */
+void
+arucotag_log_s::start(const char *path, int fd, const vector<char> &header,
+                      size_t capacity, size_t rotate)
+{
+    stop();
+
+    if (capacity < arucotag_log_capacity_min)
+        capacity = arucotag_log_capacity_min;
+    if (!ring || ring->capacity() < capacity || ring->capacity() >= 2*capacity)
+        ring.reset(new spsc_ring(capacity));
+
+    this->path = path;
+    this->header = header;
+    this->rotate = rotate && rotate < arucotag_log_rotate_min ? arucotag_log_rotate_min : rotate;
+    file_bytes = header.size();
+    size_t r;
+    while (rotations.pop(r))
+        /* empty body */;
+
+    skipped = false;
+    missed = total = high_water = 0;
+    oversized = false;
+    written = 0;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    failed = false;
+    running = true;
+    writer = thread(&arucotag_log_s::write_loop, this, fd);
+}
+
+
+/* Stop the writer thread once the queued entries are written. The writer
+ * closes the file.
+ */
+void
+arucotag_log_s::stop()
+{
+    if (!running) return;
+
+    running.store(false, memory_order_release);
+    sem_post(&sem);
+    writer.join();
+
+    // Drop what was left by a failed writer
+    const char *p;
+    while (size_t n = ring->peek(&p))
+        ring->consume(n);
+}
+
+
+/* Queue an entry for the writer thread. Returns false if the ring is full.
+ */
+bool
+arucotag_log_s::push(const char *data, size_t n)
+{
+    // Such an entry can never be queued, say it once
+    if (n > ring->capacity())
+    {
+        if (!oversized)
+            warnx("log: %zu bytes entry larger than the %zu bytes buffer, dropped",
+                  n, ring->capacity());
+        oversized = true;
+        return false;
+    }
+
+    // Rotate before this entry. If too many rotations are pending, the
+    // current file grows beyond the limit instead.
+    if (rotate && file_bytes + n > rotate && file_bytes > header.size())
+        if (rotations.push(ring->produced()))
+            file_bytes = header.size();
+
+    if (!ring->write(data, n))
+        return false;
+    file_bytes += n;
+
+    size_t queued = ring->size();
+    if (queued > high_water) high_water = queued;
+    sem_post(&sem);
+    return true;
+}
+
+
+/* Average bytes written per second since logging started.
+ */
+double
+arucotag_log_s::throughput() const
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double dt = ts_diff(now, started);
+    return dt > 0 ? written / dt : 0;
+}
+
+
+/* Write the queued entries as they come. Whatever accumulated while the
+ * previous write was blocked goes in a single write.
+ */
+void
+arucotag_log_s::write_loop(int fd)
+{
+    log_file file(this, fd);
+    size_t next = SIZE_MAX;     // ring position of the next rotation
+
+    for(;;)
+    {
+        while (sem_wait(&sem) && errno == EINTR)
+            /* empty body */;
+        bool stopping = !running.load(memory_order_acquire);
+
+        for(;;)
+        {
+            // A rotation is queued before the entry it precedes, so peek
+            // first to see the rotations of all the bytes peeked
+            const char *p;
+            size_t n = ring->peek(&p);
+            if (next == SIZE_MAX && !rotations.pop(next))
+                next = SIZE_MAX;
+            if (next != SIZE_MAX)
+            {
+                size_t at = ring->consumed();
+                if (at == next)
+                {
+                    if (!file.next()) goto fail;
+                    next = SIZE_MAX;
+                    continue;
+                }
+                if (n > next - at) n = next - at;
+            }
+            if (!n) break;
+
+            if (!file.write(p, n)) goto fail;
+            ring->consume(n);
+        }
+        if (!file.submit()) goto fail;
+
+        if (stopping) return;
+    }
+
+fail:
+    warn("log");
+    failed = true;
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2020 LAAS/CNRS
+ * All rights reserved.
+ *
+ * Redistribution  and  use  in  source  and binary  forms,  with  or  without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * THE SOFTWARE  IS PROVIDED "AS IS"  AND THE AUTHOR  DISCLAIMS ALL WARRANTIES
+ * WITH  REGARD   TO  THIS  SOFTWARE  INCLUDING  ALL   IMPLIED  WARRANTIES  OF
+ * MERCHANTABILITY AND  FITNESS.  IN NO EVENT  SHALL THE AUTHOR  BE LIABLE FOR
+ * ANY  SPECIAL, DIRECT,  INDIRECT, OR  CONSEQUENTIAL DAMAGES  OR  ANY DAMAGES
+ * WHATSOEVER  RESULTING FROM  LOSS OF  USE, DATA  OR PROFITS,  WHETHER  IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR  OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *                                                  Martin Jacquet - June 2020
+ */
+
+/* Convert a binary log (see log.hpp) to the text format of the log service.
+ *
+ * Usage: arucotag-log2txt [binary log [text log]]
+ * Reads from stdin and writes to stdout by default.
+ */
+#include "log.hpp"
+
+#include <err.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+int
+main(int argc, char **argv)
+{
+    FILE *in = stdin, *out = stdout;
+
+    if (argc > 3 || (argc > 1 && !strcmp(argv[1], "-h"))) {
+        fprintf(stderr, "usage: %s [binary log [text log]]\n", argv[0]);
+        return 2;
+    }
+    if (argc > 1 && !(in = fopen(argv[1], "rb")))
+        err(1, "%s", argv[1]);
+    if (argc > 2 && !(out = fopen(argv[2], "w")))
+        err(1, "%s", argv[2]);
+
+    arucotag_log_file h;
+    if (fread(&h, sizeof(h), 1, in) != 1 ||
+        memcmp(h.magic, arucotag_log_magic, sizeof(h.magic)))
+        errx(1, "not an arucotag binary log");
+    if (h.version != arucotag_log_version ||
+        h.frame_size != sizeof(arucotag_log_frame) ||
+        h.tag_size != sizeof(arucotag_log_tag))
+        errx(1, "unsupported log version %d", h.version);
+
+    fprintf(out, "%s\n", arucotag_log_header);
+
+    arucotag_log_frame f;
+    arucotag_log_tag t;
+    unsigned long frames = 0;
+    while (fread(&f, sizeof(f), 1, in) == 1) {
+        if (f.skipped)
+            fputc('\n', out);
+
+        for (uint16_t i = 0; i < f.count; i++) {
+            if (fread(&t, sizeof(t), 1, in) != 1)
+                errx(1, "truncated record after %lu frames", frames);
+
+            char id[sizeof(t.id) + 1];
+            memcpy(id, t.id, sizeof(t.id));
+            id[sizeof(t.id)] = 0;
+
+            // roll/pitch/yaw conversion
+            double qw = t.att[0], qx = t.att[1], qy = t.att[2], qz = t.att[3];
+            double roll = atan2(2 * (qw*qx + qy*qz), 1 - 2 * (qx*qx + qy*qy));
+            double pitch = asin(2 * (qw*qy - qz*qx));
+            double yaw = atan2(2 * (qw*qz + qx*qy), 1 - 2 * (qy*qy + qz*qz));
+
+            fprintf(out, arucotag_log_fmt "\n",
+                    f.sec, f.nsec, f.frame, id, t.px, t.py,
+                    t.pos[0], t.pos[1], t.pos[2],
+                    qw, qx, qy, qz,
+                    roll, pitch, yaw,
+                    t.pos_cov[0], t.pos_cov[1], t.pos_cov[2],
+                    t.pos_cov[3], t.pos_cov[4], t.pos_cov[5],
+                    t.att_cov[0], t.att_cov[1], t.att_cov[2], t.att_cov[3],
+                    t.att_cov[4], t.att_cov[5], t.att_cov[6], t.att_cov[7],
+                    t.att_cov[8], t.att_cov[9]);
+        }
+        frames++;
+    }
+    if (ferror(in))
+        err(1, "read");
+
+    if (out != stdout && fclose(out))
+        err(1, "write");
+    return 0;
+}
@@ -0,0 +1,274 @@
+/*
+ * Copyright (c) 2020 LAAS/CNRS
+ * All rights reserved.
+ *
+ * Redistribution  and  use  in  source  and binary  forms,  with  or  without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * THE SOFTWARE  IS PROVIDED "AS IS"  AND THE AUTHOR  DISCLAIMS ALL WARRANTIES
+ * WITH  REGARD   TO  THIS  SOFTWARE  INCLUDING  ALL   IMPLIED  WARRANTIES  OF
+ * MERCHANTABILITY AND  FITNESS.  IN NO EVENT  SHALL THE AUTHOR  BE LIABLE FOR
+ * ANY  SPECIAL, DIRECT,  INDIRECT, OR  CONSEQUENTIAL DAMAGES  OR  ANY DAMAGES
+ * WHATSOEVER  RESULTING FROM  LOSS OF  USE, DATA  OR PROFITS,  WHETHER  IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR  OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *                                                  Martin Jacquet - June 2020
+ */
+#include "acarucotag.h"
+
+#include "arucotag_c_types.h"
+
+#include "codels.hpp"
+
+
+/* --- Pipeline --------------------------------------------------------- */
+
+arucotag_pipeline_s::arucotag_pipeline_s() : notify(NULL), running(false), dropped(0)
+{
+    pushed.sec = pushed.nsec = 0;
+    sem_init(&decode_sem, 0, 0);
+    sem_init(&detect_sem, 0, 0);
+    sem_init(&done_sem, 0, 0);
+}
+
+arucotag_pipeline_s::~arucotag_pipeline_s()
+{
+    stop();
+    sem_destroy(&decode_sem);
+    sem_destroy(&detect_sem);
+    sem_destroy(&done_sem);
+}
+
+
+/* Start the decoding and detection threads.
+ */
+void
+arucotag_pipeline_s::start(const Ptr<aruco::Dictionary> &d)
+{
+    if (running) return;
+
+    dict = d;
+    idle.clear();
+    for (uint16_t i=0; i<arucotag_pipeline_depth; i++)
+        idle.push_back(&slots[i]);
+    pushed.sec = pushed.nsec = 0;
+
+    running = true;
+    decode_thread = thread(&arucotag_pipeline_s::decode_loop, this);
+    detect_thread = thread(&arucotag_pipeline_s::detect_loop, this);
+    warnx("pipeline started");
+}
+
+
+/* Stop the threads once the frames in flight went through them, and drop
+ * the results that were not popped.
+ */
+void
+arucotag_pipeline_s::stop()
+{
+    if (!running) return;
+
+    // The stop marker goes through all stages
+    to_decode.push(NULL);
+    sem_post(&decode_sem);
+    decode_thread.join();
+    detect_thread.join();
+
+    pipeline_slot *slot;
+    while (done.pop(slot))
+        /* empty body */;
+    while (!sem_trywait(&decode_sem) || !sem_trywait(&detect_sem) || !sem_trywait(&done_sem))
+        /* empty body */;
+
+    running = false;
+    warnx("pipeline stopped");
+}
+
+
+/* Copy frame in an idle slot and send it to the decoding thread. The frame
+ * is dropped if all slots are in use.
+ */
+bool
+arucotag_pipeline_s::push(const or_sensor_frame *fdata, const find_options &opt)
+{
+    pushed = fdata->ts;
+    if (idle.empty())
+    {
+        dropped++;
+        return false;
+    }
+    pipeline_slot *slot = idle.back();
+    idle.pop_back();
+
+    // The port data is overwritten by the next read, keep a copy
+    slot->buffer.assign(fdata->pixels._buffer, fdata->pixels._buffer + fdata->pixels._length);
+    slot->data = *fdata;
+    slot->data.pixels._buffer = slot->buffer.data();
+    slot->data.pixels._maximum = slot->buffer.size();
+    slot->data.pixels._release = NULL;
+    slot->opt = opt;
+    slot->copied = fdata->pixels._length;
+
+    to_decode.push(slot);
+    sem_post(&decode_sem);
+    return true;
+}
+
+
+/* Get the oldest processed frame, or NULL if none is ready.
+ */
+pipeline_slot *
+arucotag_pipeline_s::pop()
+{
+    pipeline_slot *slot;
+    return done.pop(slot) ? slot : NULL;
+}
+
+
+/* Give a slot back to the pipeline once its results are published.
+ */
+void
+arucotag_pipeline_s::release(pipeline_slot *slot)
+{
+    idle.push_back(slot);
+}
+
+
+/* Wait until a processed frame is ready or until the given monotonic time.
+ * Returns true if a processed frame is ready.
+ */
+bool
+arucotag_pipeline_s::wait(const timespec &until) const
+{
+    if (ready()) return true;
+
+    // sem_timedwait() only knows about CLOCK_REALTIME
+    timespec now, rt;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    clock_gettime(CLOCK_REALTIME, &rt);
+    double dt = ts_diff(until, now);
+    if (dt > 0)
+    {
+        rt = ts_add(rt, dt);
+        while (sem_timedwait(&done_sem, &rt) && errno == EINTR)
+            /* empty body */;
+    }
+    return ready();
+}
+
+
+void
+arucotag_pipeline_s::decode_loop()
+{
+    pipeline_slot *slot;
+    for(;;)
+    {
+        while (!to_decode.pop(slot))
+            sem_wait(&decode_sem);
+
+        if (slot)
+        {
+            try {
+                slot->decoded = slot->ingest.decode(&slot->data, slot->frame, slot->opt);
+                slot->copied += slot->ingest.copied;
+            } catch (const cv::Exception &e) {
+                warnx("decode: %s", e.what());
+                slot->decoded = false;
+            }
+        }
+
+        to_detect.push(slot);
+        sem_post(&detect_sem);
+        if (!slot) return;
+    }
+}
+
+
+void
+arucotag_pipeline_s::detect_loop()
+{
+    pipeline_slot *slot;
+    for(;;)
+    {
+        while (!to_detect.pop(slot))
+            sem_wait(&detect_sem);
+        if (!slot) return;
+
+        slot->ids.clear();
+        slot->corners.clear();
+        slot->levels.clear();
+        slot->rejected = 0;
+        slot->detect_time = 0;
+        if (slot->decoded)
+        {
+            timespec t0;
+            if (slot->opt.timing)
+                clock_gettime(CLOCK_MONOTONIC, &t0);
+            try {
+                finder.find(slot->frame, dict, slot->opt, slot->ingest.scale);
+                slot->ids = finder.ids;
+                slot->corners = finder.corners;
+                slot->levels = finder.levels;
+                slot->rejected = finder.rejected;
+            } catch (const cv::Exception &e) {
+                warnx("detect: %s", e.what());
+            }
+            if (slot->opt.timing)
+                slot->detect_time = ts_elapsed(t0);
+        }
+
+        done.push(slot);
+        sem_post(&done_sem);
+        if (sem_t *n = notify.load())
+            sem_post(n);
+    }
+}
+
+
+/* --- Cameras ---------------------------------------------------------- */
+
+arucotag_cameras_s::arucotag_cameras_s()
+{
+    sem_init(&done, 0, 0);
+}
+
+arucotag_cameras_s::~arucotag_cameras_s()
+{
+    // The pipelines post done until they are stopped
+    list.clear();
+    sem_destroy(&done);
+}
+
+
+/* Wait until the pipeline of the frame port or of some camera has a
+ * processed frame, or until the given monotonic time. The pipelines post
+ * done, but not only while waiting, so it is drained first.
+ * Returns true if a processed frame is ready.
+ */
+bool
+arucotag_cameras_s::wait(const arucotag_pipeline_s *pipe, const timespec &until) const
+{
+    while (!sem_trywait(&done))
+        /* empty body */;
+    if (pipe->ready() || ready()) return true;
+
+    // sem_timedwait() only knows about CLOCK_REALTIME
+    timespec now, rt;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    clock_gettime(CLOCK_REALTIME, &rt);
+    double dt = ts_diff(until, now);
+    if (dt > 0)
+    {
+        rt = ts_add(rt, dt);
+        while (sem_timedwait(&done, &rt) && errno == EINTR)
+            /* empty body */;
+    }
+    return pipe->ready() || ready();
+}
@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2020 LAAS/CNRS
+ * All rights reserved.
+ *
+ * Redistribution  and  use  in  source  and binary  forms,  with  or  without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * THE SOFTWARE  IS PROVIDED "AS IS"  AND THE AUTHOR  DISCLAIMS ALL WARRANTIES
+ * WITH  REGARD   TO  THIS  SOFTWARE  INCLUDING  ALL   IMPLIED  WARRANTIES  OF
+ * MERCHANTABILITY AND  FITNESS.  IN NO EVENT  SHALL THE AUTHOR  BE LIABLE FOR
+ * ANY  SPECIAL, DIRECT,  INDIRECT, OR  CONSEQUENTIAL DAMAGES  OR  ANY DAMAGES
+ * WHATSOEVER  RESULTING FROM  LOSS OF  USE, DATA  OR PROFITS,  WHETHER  IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR  OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *                                                  Martin Jacquet - June 2020
+ */
+#include "ports.hpp"
+
+#include <cstring>
+
+/* --- Ports in memory -------------------------------------------------- */
+
+arucotag_memory_ports::arucotag_memory_ports() :
+    input_frame(NULL), has_drone(false), has_calib(false), writes(0), stats_writes(0)
+{
+    memset(&drone, 0, sizeof(drone));
+    memset(&intrinsics, 0, sizeof(intrinsics));
+    memset(&extrinsics, 0, sizeof(extrinsics));
+    memset(&stats_data, 0, sizeof(stats_data));
+}
+
+bool
+arucotag_memory_ports::open_camera(const char *camera)
+{
+    camera_input &c = cameras[camera];
+    memset(&c, 0, sizeof(c));
+    return true;
+}
+
+const or_sensor_frame *
+arucotag_memory_ports::read_camera(const char *camera)
+{
+    auto i = cameras.find(camera);
+    return i == cameras.end() ? NULL : i->second.frame;
+}
+
+const or_sensor_intrinsics *
+arucotag_memory_ports::read_camera_intrinsics(const char *camera)
+{
+    auto i = cameras.find(camera);
+    return i == cameras.end() || !i->second.has_calib ? NULL : &i->second.intrinsics;
+}
+
+const or_sensor_extrinsics *
+arucotag_memory_ports::read_camera_extrinsics(const char *camera)
+{
+    auto i = cameras.find(camera);
+    return i == cameras.end() || !i->second.has_calib ? NULL : &i->second.extrinsics;
+}
+
+bool
+arucotag_memory_ports::open(const char *marker)
+{
+    poses[marker];
+    pixel_poses[marker];
+    return true;
+}
+
+void
+arucotag_memory_ports::close(const char *marker)
+{
+    poses.erase(marker);
+    pixel_poses.erase(marker);
+}
+
+or_pose_estimator_state *
+arucotag_memory_ports::pose(const char *marker)
+{
+    auto i = poses.find(marker);
+    return i == poses.end() ? NULL : &i->second;
+}
+
+or_sensor_pixel *
+arucotag_memory_ports::pixel_pose(const char *marker)
+{
+    auto i = pixel_poses.find(marker);
+    return i == pixel_poses.end() ? NULL : &i->second;
+}
+
+void
+arucotag_memory_ports::write_pose(const char *marker)
+{
+    writes++;
+    if (on_pose)
+        on_pose(marker, poses[marker]);
+}
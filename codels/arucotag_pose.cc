@@ -0,0 +1,429 @@
+/*
+ * Copyright (c) 2020 LAAS/CNRS
+ * All rights reserved.
+ *
+ * Redistribution  and  use  in  source  and binary  forms,  with  or  without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * THE SOFTWARE  IS PROVIDED "AS IS"  AND THE AUTHOR  DISCLAIMS ALL WARRANTIES
+ * WITH  REGARD   TO  THIS  SOFTWARE  INCLUDING  ALL   IMPLIED  WARRANTIES  OF
+ * MERCHANTABILITY AND  FITNESS.  IN NO EVENT  SHALL THE AUTHOR  BE LIABLE FOR
+ * ANY  SPECIAL, DIRECT,  INDIRECT, OR  CONSEQUENTIAL DAMAGES  OR  ANY DAMAGES
+ * WHATSOEVER  RESULTING FROM  LOSS OF  USE, DATA  OR PROFITS,  WHETHER  IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR  OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *                                                  Martin Jacquet - June 2020
+ */
+#include "acarucotag.h"
+
+#include "arucotag_c_types.h"
+
+#include "codels.hpp"
+
+
+/* --- History -------------------------------------------------------- */
+
+/* Increase the age of the active tags of h for a new frame taken at ts, and
+ * forget the tags that were not seen for more than hist_age frames or, if
+ * positive, hist_age_time seconds. The tags seen in this frame are reset
+ * afterwards, when their pose is estimated.
+ */
+void
+arucotag_detector_s::age_history(tag_history &h, const or_time_ts &ts)
+{
+    vector<uint16_t> &active = h.active;
+    size_t n = 0;
+    for (size_t k = 0; k < active.size(); k++)
+    {
+        tag_detection &tag = h.tags[active[k]];
+        double dt = (ts.sec - tag.seen.sec) + ((double)ts.nsec - tag.seen.nsec)*1e-9;
+        if (++tag.age > hist_age || (hist_age_time > 0 && dt > hist_age_time))
+        {
+            tag.active = false;
+            tag.history.clear();
+            continue;
+        }
+        active[n++] = active[k];
+    }
+    active.resize(n);
+}
+
+
+/* --- Pose estimation -------------------------------------------------- */
+
+/* Index of the solution among q[0] and q[1] that is the closest to the
+ * history of tag, by a vote of its poses. Returns -1 on a tie.
+ */
+static int
+vote_pose(const tag_detection &tag, const Quaterniond q[2])
+{
+    uint16_t vote_0 = 0, vote_1 = 0;
+    for (size_t h = 0; h < tag.history.size(); h++)
+    {
+        const Quaterniond &qh = tag.history[h].q;
+        double dq_0 = qh.angularDistance(q[0]), dq_1 = qh.angularDistance(q[1]);
+        if (dq_0 < 0.8 * dq_1)
+            vote_0++;
+        else if (dq_1 < 0.8 * dq_0)
+            vote_1++;
+    }
+
+    // Choose either solution if it has at least 2 more votes than the other one
+    if (vote_0 < vote_1)
+        return 1;
+    if (vote_0 > vote_1)
+        return 0;
+    return -1;
+}
+
+/* Add the pose selected for this frame to the history of tag */
+static void
+keep_pose(const arucotag_detector_s *detect, tag_detection &tag,
+          const Vector3d &C_p_M, Quaterniond &C_q_M)
+{
+    if (tag.history.empty())
+    {
+        // Fix w >= 0 as convention
+        if (C_q_M.w() < 0)
+            C_q_M.coeffs() = -C_q_M.coeffs();
+    }
+    // avoid flips between q and -q
+    else if (tag.history.back().q.dot(C_q_M) < 0)
+        C_q_M.coeffs() = -C_q_M.coeffs();
+
+    // The oldest pose is dropped once the history is full
+    tag.history.push(pose6D(C_p_M, C_q_M), detect->hist_size);
+}
+
+/* Estimate the pose of a tag in camera frame from its corners in image.
+ *
+ * tag holds the history of the tag and is updated, it must not be shared
+ * with another concurrent call.
+ * Returns false if no pose could be selected for this frame.
+ */
+static bool
+select_pose(const vector<Point2f> &corners, const arucotag_calib_s *calib,
+            const arucotag_detector_s *detect, tag_detection &tag,
+            Vector3d &C_p_M, Quaterniond &C_q_M)
+{
+    // Solve PnP for the tag, the solutions are sorted by reprojection error
+    ippe_pose pose[2];
+    int n = ippe_square(calib->cam, detect->geometry.l, corners.data(), pose);
+
+    // Get the "correct" translation and rotation among the two retrieved solutions
+    // Check ambiguity is often done using the likelihood ratio of reproj. errors, 0.6 seems a decent ambiguity threshold, according to [Muñoz-Salinas 18]
+    // However, the reprojection error alone is often not enough to lift the ambiguity and causes flips in successive detection
+    // Rather, impose a basic temporal consistency in detections by selecting the pose that minimizes the angular distance between with previous poses
+    // I use the likelihood ratio wrt distance to last detection to discriminate to enfore temporal consistency
+    // For more robustness, a last detections are stored in a ring buffer and we use a basic voting scheme according to this ratio
+    // In order to be more robust to misses detections among frames, we keep a detetion is memory for a given amount of frames even if it is undetected
+    if (n == 0)
+        return false;
+
+    // If the tag is newly detected, or the second solution is invalid,
+    // select the minimum error solution
+    int s = 0;
+    if (!tag.history.empty() && n == 2)
+    {
+        Quaterniond q[2] = { pose[0].q, pose[1].q };
+        s = vote_pose(tag, q);
+        if (s < 0)
+            return false;
+    }
+    C_p_M = pose[s].t;
+    C_q_M = pose[s].q;
+
+    keep_pose(detect, tag, C_p_M, C_q_M);
+    return true;
+}
+
+
+/* Express the pose of a tag and its covariance in the output frame, and
+ * convert the rotation covariance to quaternion covariance.
+ */
+static void
+finish_tag(const Point2f &center, const arucotag_calib_s *calib,
+           const body_state &body, int16_t out_frame,
+           const Vector3d &C_p_M, const Quaterniond &C_q_M,
+           Matrix3d cov_pos, Matrix3d cov_rot, tag_estimate &est)
+{
+    // Transform to desired frame and propagate covariance
+    Vector3d position;
+    Quaterniond orientation;
+    switch (out_frame)
+    {
+        case 0:  // Camera frame
+            position = C_p_M;
+            orientation = C_q_M;
+            break;
+        case 1:  // Body frame
+            position = calib->B_R_C * C_p_M + calib->B_p_C;
+            orientation = calib->B_R_C * C_q_M;
+            cov_pos = calib->B_R_C * cov_pos * calib->B_R_C.transpose();
+            cov_rot = calib->B_R_C * cov_rot * calib->B_R_C.transpose();
+            break;
+        case 2:  // World frame
+            Vector3d B_p_M = calib->B_R_C * C_p_M + calib->B_p_C;
+            position = body.W_R_B * B_p_M + body.W_p_B;
+            orientation = body.W_R_B * calib->B_R_C * C_q_M;
+            // Propagate to body frame
+            cov_pos = calib->B_R_C * cov_pos * calib->B_R_C.transpose();
+            cov_rot = calib->B_R_C * cov_rot * calib->B_R_C.transpose();
+            // Propagate to world frame
+            // The jacobian of the transformation wrt the quaternion W_q_B is given by Eq. 174 from [Solà 2017], see Sec. 4.3.2 therein
+            // Available at: https://arxiv.org/abs/1711.02508
+            Matrix<double,3,4> J_R;
+            J_R.col(0) = 2* (body.W_q_B.w()*B_p_M + body.W_q_B.vec().cross(B_p_M));
+            J_R.block(0,1,3,3) = 2* ((body.W_q_B.vec().transpose() * B_p_M)(0) * Matrix3d::Identity() + body.W_q_B.vec() * B_p_M.transpose() - B_p_M * body.W_q_B.vec().transpose() - body.W_q_B.w() * skew(B_p_M));
+            cov_pos = body.W_R_B * cov_pos * body.W_R_B.transpose() + J_R * body.S_W_q_B * J_R.transpose() + body.S_W_p_B;
+            cov_rot = body.W_R_B * cov_rot * body.W_R_B.transpose() + J_R * body.S_W_q_B * J_R.transpose();
+            break;
+    }
+
+    // Convert rotation covariance (i.e. element of tangent space R^(3)) to quaternion covariance (i.e. element of R^4)
+    Matrix<double,4,3> J_exp;
+    AngleAxisd aa(orientation);
+    double theta = aa.angle();
+    const Vector3d &u = aa.axis();
+    if (theta < 1e-5)           // trivial continuous extension when theta->0
+        J_exp << 0,0,0, 0.5,0,0, 0,0.5,0, 0,0,0.5;
+    else if (theta < 0.5) {     // small angle approx.: if theta/2 < 0.25rad (~15°)
+        J_exp.row(0) = -theta/4 * u;
+        J_exp.block<3,3>(1,0) = 0.5*Matrix3d::Identity() - theta*theta/8 * u*u.transpose();
+    } else {
+        double c = cos(theta/2), s = sin(theta/2);
+        J_exp.row(0) = -0.5 * s * u;
+        J_exp.block<3,3>(1,0) = s/theta*Matrix3d::Identity() + (c/2 - s/theta) * u*u.transpose();
+    }
+
+    est.position = position;
+    est.orientation = orientation;
+    est.cov_pos = cov_pos;
+    est.cov_q = J_exp * cov_rot * J_exp.transpose();
+    est.center = center;
+}
+
+
+/* Estimate the pose and covariance of the tracked tags first to first+n-1
+ * of the current frame, n <= 4, seen by the camera of the given history and
+ * calibration. The covariance of the tags is computed in one batch.
+ */
+void
+estimate_tags(arucotag_detector_s *detect, tag_history &history,
+              const arucotag_calib_s *calib, const body_state &body,
+              uint16_t s_pix, int16_t out_frame, size_t first, size_t n)
+{
+    size_t k[4], m = 0;
+    Vector3d C_p_M[4];
+    Quaterniond C_q_M[4];
+    Matrix3d cov_pos[4], cov_rot[4];
+    bool timed = detect->opt.timing;
+    timespec t0, t1, t2;
+
+    if (timed)
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (size_t j = first; j < first + n; j++)
+    {
+        size_t i = detect->tracked[j];
+        int id = detect->ids[i];
+        detect->estimates[j].valid = false;
+        if (select_pose(detect->corners[i], calib, detect, history.tags[id],
+                        C_p_M[m], C_q_M[m]))
+            k[m++] = j;
+    }
+
+    // Compute covariance
+    if (timed)
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+    pose_covariance(detect->geometry, calib->K, s_pix, m, C_q_M, C_p_M, cov_pos, cov_rot);
+    if (timed)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &t2);
+        detect->pnp_ns += ts_diff(t1, t0)*1e9;
+        detect->covariance_ns += ts_diff(t2, t1)*1e9;
+    }
+
+    for (size_t j = 0; j < m; j++)
+    {
+        // Centroid of the tag in pixel coordinates
+        const vector<Point2f> &corners = detect->corners[detect->tracked[k[j]]];
+        Point2f center(0, 0);
+        for (int p = 0; p < 4; p++)
+            center += corners[p];
+
+        tag_estimate &est = detect->estimates[k[j]];
+        finish_tag(center / 4., calib, body, out_frame,
+                   C_p_M[j], C_q_M[j], cov_pos[j], cov_rot[j], est);
+        est.valid = true;
+    }
+}
+
+
+/* Estimate the pose and covariance of the k-th bundle seen in the current
+ * frame, from the corners of all its tags detected by the camera of the given
+ * history and calibration.
+ *
+ * The pose is refined from the two IPPE solutions of its largest tag in
+ * image. As for a single tag, the solution with the smallest reprojection
+ * error is selected for a new bundle, else by temporal consistency with the
+ * history of the bundle.
+ */
+void
+estimate_bundle(arucotag_detector_s *detect, tag_history &history,
+                const arucotag_calib_s *calib, const body_state &body,
+                uint16_t s_pix, int16_t out_frame, size_t k)
+{
+    tag_bundle &bundle = detect->bundles[detect->bundles_seen[k]];
+    tag_estimate &est = detect->bundle_estimates[k];
+    const tag_geometry &g = detect->geometry;
+    bool timed = detect->opt.timing;
+    timespec t0, t1, t2;
+    est.valid = false;
+
+    if (timed)
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    // Stack the corners of its tags, and find the largest one
+    size_t n = bundle.dets.size(), largest = 0;
+    double area = -1;
+    bundle.X.resize(4*n);
+    bundle.m.resize(4*n);
+    for (size_t j = 0; j < n; j++)
+    {
+        const vector<Point2f> &corners = detect->corners[bundle.dets[j]];
+        uint16_t t = detect->markers[detect->ids[bundle.dets[j]]].member;
+        for (int c = 0; c < 4; c++)
+        {
+            bundle.X[4*j + c] = bundle.O_R_M[t] * Vector3d(g.a[c], g.b[c], 0) + bundle.O_p_M[t];
+            bundle.m[4*j + c] = ippe_detail::undistort(calib->cam, corners[c].x, corners[c].y);
+        }
+        double a = std::fabs((corners[2] - corners[0]).cross(corners[3] - corners[1]));
+        if (a > area)
+        {
+            area = a;
+            largest = j;
+        }
+    }
+
+    // Object poses from the solutions of the largest tag
+    ippe_pose tag_pose[2];
+    bundle_pose pose[2];
+    uint16_t t = detect->markers[detect->ids[bundle.dets[largest]]].member;
+    int ns = ippe_square(calib->cam, g.l, detect->corners[bundle.dets[largest]].data(), tag_pose);
+    int m = 0;
+    for (int s = 0; s < ns; s++)
+    {
+        pose[m].R = tag_pose[s].q.toRotationMatrix() * bundle.O_R_M[t].transpose();
+        pose[m].t = tag_pose[s].t - pose[m].R * bundle.O_p_M[t];
+        if (bundle_refine(calib->cam, 4*n, bundle.X.data(), bundle.m.data(), pose[m]))
+            m++;
+    }
+    if (m == 2 && pose[1].error < pose[0].error)
+        std::swap(pose[0], pose[1]);
+
+    // Select a solution as select_pose does, unless both converged to the
+    // same pose
+    tag_detection &tag = history.tags[bundle.ids[0]];
+    Quaterniond q[2];
+    int s = m ? 0 : -1;
+    for (int i = 0; i < m; i++)
+        q[i] = Quaterniond(pose[i].R);
+    if (m == 2 && q[0].angularDistance(q[1]) > 1e-3 && !tag.history.empty())
+        s = vote_pose(tag, q);
+
+    Matrix3d cov_pos, cov_rot;
+    bool ok = s >= 0;
+    if (timed)
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+    ok = ok && bundle_covariance(pose[s], s_pix, cov_pos, cov_rot);
+    if (timed)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &t2);
+        detect->pnp_ns += ts_diff(t1, t0)*1e9;
+        detect->covariance_ns += ts_diff(t2, t1)*1e9;
+    }
+    if (!ok)
+        return;
+
+    Vector3d C_p_O = pose[s].t;
+    Quaterniond C_q_O = q[s];
+    keep_pose(detect, tag, C_p_O, C_q_O);
+
+    // The pixel of the bundle is the projection of its origin
+    Vector2d center = ippe_detail::project(calib->cam, C_p_O);
+    finish_tag(Point2f(center(0), center(1)), calib, body, out_frame,
+               C_p_O, C_q_O, cov_pos, cov_rot, est);
+    est.valid = true;
+}
+
+
+/* --- Fusion ----------------------------------------------------------- */
+
+/* Add the estimate of a tag in a frame taken at t */
+void
+tag_fusion::add(const tag_estimate &est, const or_time_ts &t)
+{
+    Matrix3d inv;
+    bool ok;
+    est.cov_pos.computeInverseWithCheck(inv, ok);
+    double wq = 1 / std::max(est.cov_q.trace(), 1e-12);
+    Vector4d q(est.orientation.w(), est.orientation.x(), est.orientation.y(), est.orientation.z());
+
+    if (!n)
+    {
+        ts = t;
+        info.setZero();
+        info_p.setZero();
+        invertible = true;
+        this->q.setZero();
+        cov_q.setZero();
+        w = 0;
+        best = est;
+    }
+    else
+    {
+        if (t.sec > ts.sec || (t.sec == ts.sec && t.nsec > ts.nsec))
+            ts = t;
+        if (est.cov_pos.trace() < best.cov_pos.trace())
+            best = est;
+        // q and -q are the same orientation
+        if (this->q.dot(q) < 0)
+            q = -q;
+    }
+    n++;
+
+    invertible = invertible && ok;
+    if (ok)
+    {
+        info += inv;
+        info_p += inv * est.position;
+    }
+    this->q += wq * q;
+    cov_q += wq*wq * est.cov_q;
+    w += wq;
+}
+
+/* The fused estimate. The pixel of the tag is the one of the best estimate,
+ * which is also used as is if a position covariance was not invertible.
+ */
+void
+tag_fusion::fuse(tag_estimate &out) const
+{
+    out = best;
+    if (n < 2 || !invertible)
+        return;
+
+    out.cov_pos = info.inverse();
+    out.position = out.cov_pos * info_p;
+
+    Vector4d m = q / q.norm();
+    out.orientation = Quaterniond(m(0), m(1), m(2), m(3));
+    out.cov_q = cov_q / (w*w);
+}
@@ -0,0 +1,429 @@
+/*
+ * Copyright (c) 2020 LAAS/CNRS
+ * All rights reserved.
+ *
+ * Redistribution  and  use  in  source  and binary  forms,  with  or  without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * THE SOFTWARE  IS PROVIDED "AS IS"  AND THE AUTHOR  DISCLAIMS ALL WARRANTIES
+ * WITH  REGARD   TO  THIS  SOFTWARE  INCLUDING  ALL   IMPLIED  WARRANTIES  OF
+ * MERCHANTABILITY AND  FITNESS.  IN NO EVENT  SHALL THE AUTHOR  BE LIABLE FOR
+ * ANY  SPECIAL, DIRECT,  INDIRECT, OR  CONSEQUENTIAL DAMAGES  OR  ANY DAMAGES
+ * WHATSOEVER  RESULTING FROM  LOSS OF  USE, DATA  OR PROFITS,  WHETHER  IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR  OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *                                                  Martin Jacquet - June 2020
+ */
+#include "acarucotag.h"
+
+#include "arucotag_c_types.h"
+
+#include "codels.hpp"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+
+/* Write all of iov at offset off. Returns false on error, with errno set.
+ */
+static bool
+pwritev_all(int fd, iovec *iov, int n, off_t off)
+{
+    while (n > 0)
+    {
+        ssize_t w = pwritev(fd, iov, n, off);
+        if (w < 0)
+        {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        off += w;
+        while (n > 0 && (size_t)w >= iov->iov_len)
+        {
+            w -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return true;
+}
+
+
+/* --- Recorder --------------------------------------------------------- */
+
+arucotag_record_s::arucotag_record_s() :
+    fd(-1), offset(0), pixels(NULL), pending(false), running(false),
+    failed(false), frames(0), bytes(0), wait_ns(0), wait_max_ns(0)
+{
+    memset(&header, 0, sizeof(header));
+    sem_init(&request, 0, 0);
+    sem_init(&done, 0, 0);
+}
+
+arucotag_record_s::~arucotag_record_s()
+{
+    stop();
+    sem_destroy(&request);
+    sem_destroy(&done);
+}
+
+
+/* Start recording to the empty file fd, named path. The file is closed by
+ * stop(), also on error.
+ * Returns false on error, with errno set.
+ */
+bool
+arucotag_record_s::start(const char *path, int fd)
+{
+    stop();
+
+    arucotag_rec_file h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, arucotag_rec_magic, sizeof(h.magic));
+    h.version = arucotag_rec_version;
+    h.frame_size = sizeof(arucotag_rec_frame);
+    iovec iov = { &h, sizeof(h) };
+    if (!pwritev_all(fd, &iov, 1, 0))
+    {
+        int e = errno;
+        ::close(fd);
+        errno = e;
+        return false;
+    }
+
+    this->path = path;
+    this->fd = fd;
+    offset = sizeof(h);
+    index.clear();
+    pending = false;
+    frames = 0;
+    bytes = 0;
+    wait_ns = wait_max_ns = 0;
+    failed = false;
+    running = true;
+    writer = thread(&arucotag_record_s::write_loop, this);
+    return true;
+}
+
+
+/* Stop the writer thread, then append the index and close the file.
+ * Returns false if the recording could not be completed, with errno set.
+ */
+bool
+arucotag_record_s::stop()
+{
+    if (!running) return true;
+
+    fence();
+    pixels = NULL;
+    sem_post(&request);
+    writer.join();
+    running = false;
+
+    bool ok = !failed;
+    int e = failed ? EIO : 0;
+    if (ok)
+    {
+        arucotag_rec_footer footer;
+        memset(&footer, 0, sizeof(footer));
+        memcpy(footer.magic, arucotag_rec_index_magic, sizeof(footer.magic));
+        footer.index = offset;
+        footer.count = index.size();
+        iovec iov[2] = {
+            { index.data(), index.size()*sizeof(uint64_t) },
+            { &footer, sizeof(footer) }
+        };
+        ok = pwritev_all(fd, iov, 2, offset);
+        if (!ok) e = errno;
+    }
+    if (::close(fd) && ok)
+    {
+        ok = false;
+        e = errno;
+    }
+    fd = -1;
+    errno = e;
+    return ok;
+}
+
+
+/* Hand the frame to the writer thread, without copy: the port data must
+ * not change until fence() returns.
+ */
+void
+arucotag_record_s::submit(const or_sensor_frame *fdata)
+{
+    header.sec = fdata->ts.sec;
+    header.nsec = fdata->ts.nsec;
+    header.size = fdata->pixels._length;
+    header.width = fdata->width;
+    header.height = fdata->height;
+    header.bpp = fdata->bpp;
+    header.compressed = fdata->compressed;
+    header.seq = frames;
+    pixels = fdata->pixels._buffer;
+    pending = true;
+    sem_post(&request);
+}
+
+
+/* Wait until the last submitted frame is written. This is normally
+ * immediate, since the writer thread has a whole frame period.
+ */
+void
+arucotag_record_s::fence()
+{
+    if (!pending) return;
+    pending = false;
+    if (sem_trywait(&done) == 0) return;
+
+    timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (sem_wait(&done) && errno == EINTR)
+        /* empty body */;
+    uint64_t ns = ts_elapsed(start)*1e9;
+    wait_ns += ns;
+    if (ns > wait_max_ns) wait_max_ns = ns;
+}
+
+
+/* Writer thread. Each submitted frame is written at the end of the file
+ * with a single pwritev() from the port data, then done is posted. After an
+ * error, frames are acknowledged without being written.
+ */
+void
+arucotag_record_s::write_loop()
+{
+    static const char zeros[arucotag_rec_align] = { 0 };
+
+    for(;;)
+    {
+        while (sem_wait(&request) && errno == EINTR)
+            /* empty body */;
+        if (!pixels) return;
+
+        if (!failed)
+        {
+            size_t pad = (arucotag_rec_align - header.size % arucotag_rec_align) % arucotag_rec_align;
+            iovec iov[3] = {
+                { &header, sizeof(header) },
+                { (void *)pixels, header.size },
+                { (void *)zeros, pad }
+            };
+            if (pwritev_all(fd, iov, 3, offset))
+            {
+                index.push_back(offset);
+                uint64_t n = sizeof(header) + header.size + pad;
+                offset += n;
+                bytes += n;
+                frames++;
+            }
+            else
+            {
+                warn("record %s", path.c_str());
+                failed = true;
+            }
+        }
+        sem_post(&done);
+    }
+}
+
+
+/* --- Recording -------------------------------------------------------- */
+
+/* Map the recording and index its records, from the index at the end of the
+ * file if it is complete, or by walking the records otherwise.
+ * Returns false on error, with errno set (EINVAL if this is not a
+ * recording).
+ */
+bool
+frame_recording::open(const char *path)
+{
+    close();
+
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st))
+    {
+        int e = errno;
+        ::close(fd);
+        errno = e;
+        return false;
+    }
+    if ((size_t)st.st_size < sizeof(arucotag_rec_file))
+    {
+        ::close(fd);
+        errno = EINVAL;
+        return false;
+    }
+    void *p = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+    int e = errno;
+    ::close(fd);
+    if (p == MAP_FAILED)
+    {
+        errno = e;
+        return false;
+    }
+    base = (char *)p;
+    length = st.st_size;
+
+    const arucotag_rec_file *h = (const arucotag_rec_file *)base;
+    if (memcmp(h->magic, arucotag_rec_magic, sizeof(h->magic)) ||
+        h->version != arucotag_rec_version ||
+        h->frame_size != sizeof(arucotag_rec_frame))
+    {
+        close();
+        errno = EINVAL;
+        return false;
+    }
+    madvise(base, length, MADV_SEQUENTIAL);
+
+    if (length >= sizeof(arucotag_rec_file) + sizeof(arucotag_rec_footer))
+    {
+        const arucotag_rec_footer *f =
+            (const arucotag_rec_footer *)(base + length - sizeof(arucotag_rec_footer));
+        if (!memcmp(f->magic, arucotag_rec_index_magic, sizeof(f->magic)) &&
+            f->index + f->count*sizeof(uint64_t) + sizeof(*f) == length)
+        {
+            const uint64_t *o = (const uint64_t *)(base + f->index);
+            index.assign(o, o + f->count);
+            return true;
+        }
+    }
+
+    // No index: stop at the first truncated or inconsistent record
+    uint64_t off = sizeof(arucotag_rec_file);
+    while (off + sizeof(arucotag_rec_frame) <= length)
+    {
+        const arucotag_rec_frame *r = (const arucotag_rec_frame *)(base + off);
+        uint64_t end = off + sizeof(*r) + r->size;
+        if (end > length || r->seq != index.size()) break;
+        index.push_back(off);
+        off = (end + arucotag_rec_align-1) & ~(uint64_t)(arucotag_rec_align-1);
+    }
+    return true;
+}
+
+void
+frame_recording::close()
+{
+    if (base)
+        munmap(base, length);
+    base = NULL;
+    length = 0;
+    index.clear();
+}
+
+
+/* Fill f with the header of record i. The pixels point into the mapping.
+ */
+void
+frame_recording::frame(size_t i, or_sensor_frame *f) const
+{
+    const arucotag_rec_frame *r = header(i);
+    f->ts.sec = r->sec;
+    f->ts.nsec = r->nsec;
+    f->compressed = r->compressed;
+    f->height = r->height;
+    f->width = r->width;
+    f->bpp = r->bpp;
+    f->pixels._maximum = f->pixels._length = r->size;
+    f->pixels._buffer = (uint8_t *)base + index[i] + sizeof(arucotag_rec_frame);
+    f->pixels._release = NULL;
+}
+
+
+/* --- Replay ----------------------------------------------------------- */
+
+/* Open a recording and start replaying it from its first frame.
+ * Returns false on error, with errno set.
+ */
+bool
+arucotag_replay_s::open(const char *path, bool realtime, bool loop)
+{
+    active = false;
+    if (!rec.open(path)) return false;
+    if (!rec.size())
+    {
+        rec.close();
+        errno = ENODATA;
+        return false;
+    }
+
+    // A pass lasts one mean frame period more than its frames span
+    size_t n = rec.size();
+    int64_t d = rec.ts_ns(n-1) - rec.ts_ns(0);
+    span = n > 1 ? d + d / (int64_t)(n-1) : 33333333;
+
+    this->realtime = realtime;
+    this->loop = loop;
+    next = 0;
+    shift = 0;
+    frames = 0;
+    active = true;
+    return true;
+}
+
+
+/* Monotonic time at which the next frame is due. Returns false if it is due
+ * now: as fast as possible, or before the first frame.
+ */
+bool
+arucotag_replay_s::due(timespec &t) const
+{
+    if (!realtime || !frames) return false;
+
+    int64_t d;
+    if (next < rec.size())
+        d = rec.ts_ns(next) - rec.ts_ns(0);
+    else if (loop)
+        d = span;
+    else
+        return false;
+    t = ts_add(start, d*1e-9);
+    return true;
+}
+
+
+/* Make the next frame current. At the end of the recording, restart or
+ * deactivate the replay and return false.
+ */
+bool
+arucotag_replay_s::advance()
+{
+    if (next >= rec.size())
+    {
+        if (!loop)
+        {
+            active = false;
+            return false;
+        }
+        next = 0;
+        shift += span;
+        start = ts_add(start, span*1e-9);
+    }
+
+    rec.frame(next, &frame);
+    int64_t ts = rec.ts_ns(next) + shift;
+    frame.ts.sec = ts / 1000000000;
+    frame.ts.nsec = ts % 1000000000;
+    if (!frames)
+        clock_gettime(CLOCK_MONOTONIC, &start);
+    next++;
+    frames++;
+    return true;
+}
@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2020 LAAS/CNRS
+ * All rights reserved.
+ *
+ * Redistribution  and  use  in  source  and binary  forms,  with  or  without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * THE SOFTWARE  IS PROVIDED "AS IS"  AND THE AUTHOR  DISCLAIMS ALL WARRANTIES
+ * WITH  REGARD   TO  THIS  SOFTWARE  INCLUDING  ALL   IMPLIED  WARRANTIES  OF
+ * MERCHANTABILITY AND  FITNESS.  IN NO EVENT  SHALL THE AUTHOR  BE LIABLE FOR
+ * ANY  SPECIAL, DIRECT,  INDIRECT, OR  CONSEQUENTIAL DAMAGES  OR  ANY DAMAGES
+ * WHATSOEVER  RESULTING FROM  LOSS OF  USE, DATA  OR PROFITS,  WHETHER  IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR  OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *                                                  Martin Jacquet - June 2020
+ */
+#include "acarucotag.h"
+
+#include "arucotag_c_types.h"
+
+#include "codels.hpp"
+
+
+/* --- Worker pool ------------------------------------------------------ */
+
+worker_pool::worker_pool() :
+    fn(NULL), arg(NULL), count(0), next(0), busy(0), generation(0), quit(false)
+{
+}
+
+worker_pool::~worker_pool()
+{
+    resize(0);
+}
+
+
+/* Set the number of threads of the pool, in addition to the calling thread.
+ * Must not be called while a job is running.
+ */
+void
+worker_pool::resize(size_t n)
+{
+    if (n == threads.size()) return;
+
+    {
+        unique_lock<mutex> l(lock);
+        quit = true;
+    }
+    wake.notify_all();
+    for (thread &t: threads)
+        t.join();
+    threads.clear();
+
+    quit = false;
+    for (size_t i=0; i<n; i++)
+        threads.emplace_back(&worker_pool::loop, this);
+}
+
+
+/* Run a job on all threads and wait for its completion. */
+void
+worker_pool::dispatch(size_t n, job_fn f, const void *a)
+{
+    {
+        unique_lock<mutex> l(lock);
+        fn = f;
+        arg = a;
+        count = n;
+        next = 0;
+        busy = threads.size();
+        generation++;
+    }
+    wake.notify_all();
+
+    work();
+
+    unique_lock<mutex> l(lock);
+    done.wait(l, [this]{ return busy == 0; });
+}
+
+
+void
+worker_pool::work()
+{
+    for (size_t i = next++; i < count; i = next++)
+        fn(arg, i);
+}
+
+
+void
+worker_pool::loop()
+{
+    unique_lock<mutex> l(lock);
+    uint64_t seen = generation;
+    while (true)
+    {
+        wake.wait(l, [&]{ return quit || generation != seen; });
+        if (quit) return;
+        seen = generation;
+
+        l.unlock();
+        work();
+        l.lock();
+
+        if (--busy == 0)
+            done.notify_one();
+    }
+}
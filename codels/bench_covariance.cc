@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2020 LAAS/CNRS
+ * All rights reserved.
+ *
+ * Redistribution  and  use  in  source  and binary  forms,  with  or  without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * THE SOFTWARE  IS PROVIDED "AS IS"  AND THE AUTHOR  DISCLAIMS ALL WARRANTIES
+ * WITH  REGARD   TO  THIS  SOFTWARE  INCLUDING  ALL   IMPLIED  WARRANTIES  OF
+ * MERCHANTABILITY AND  FITNESS.  IN NO EVENT  SHALL THE AUTHOR  BE LIABLE FOR
+ * ANY  SPECIAL, DIRECT,  INDIRECT, OR  CONSEQUENTIAL DAMAGES  OR  ANY DAMAGES
+ * WHATSOEVER  RESULTING FROM  LOSS OF  USE, DATA  OR PROFITS,  WHETHER  IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR  OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *                                                  Martin Jacquet - June 2020
+ */
+
+/* Microbenchmark of the pose covariance kernel (covariance.hpp) against the
+ * former implementation (8x6 Jacobian and explicit 6x6 inverse).
+ *
+ * Usage: bench_covariance [tags [iterations]]
+ */
+#include "covariance.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+using namespace Eigen;
+
+static Matrix3d
+skew(Vector3d v)
+{
+    Matrix3d skew;
+    skew << 0,-v(2),v(1),  v(2),0,-v(0),  -v(1),v(0),0;
+    return skew;
+}
+
+/* Former implementation, from detect_main */
+static void
+reference(const Matrix<double,3,4> &corners_marker, const Matrix3d &K, double s_pix,
+          const Quaterniond &C_q_M, const Vector3d &C_p_M,
+          Matrix3d &cov_pos, Matrix3d &cov_rot)
+{
+    Matrix<double,8,6> J;
+    for (uint16_t i=0; i<4; i++)
+    {
+        Vector3d hi = K * (C_q_M * corners_marker.col(i) + C_p_M);
+        Matrix<double,2,3> J_pix; J_pix <<
+            1/hi(2), 0, -hi(0)/hi(2)/hi(2),
+            0, 1/hi(2), -hi(1)/hi(2)/hi(2);
+        Matrix<double,3,6> J_proj;
+        J_proj.block<3,3>(0,0) = K;
+        J_proj.block<3,3>(0,3) = -K * C_q_M.matrix() * skew(corners_marker.col(i));
+        J.block<2,6>(i*2,0) = J_pix*J_proj;
+    }
+    Matrix<double,6,6> cov = s_pix*s_pix * (J.transpose() * J).inverse();
+    cov_pos = cov.block<3,3>(0,0);
+    cov_rot = cov.block<3,3>(3,3);
+}
+
+template<typename F>
+static double
+timeit(int iterations, F f)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++)
+        f();
+    std::chrono::duration<double> dt = std::chrono::steady_clock::now() - start;
+    return dt.count();
+}
+
+int
+main(int argc, char **argv)
+{
+    int tags = argc > 1 ? atoi(argv[1]) : 16;
+    int iterations = argc > 2 ? atoi(argv[2]) : 20000;
+    if (tags < 1 || iterations < 1) {
+        fprintf(stderr, "usage: %s [tags [iterations]]\n", argv[0]);
+        return 2;
+    }
+
+    const double half = 0.05, s_pix = 2;
+    Matrix3d K;
+    K << 800, 0.1, 640,
+           0, 800, 360,
+           0,   0,   1;
+
+    Matrix<double,3,4> corners_marker;
+    corners_marker <<
+        -1,  1,  1, -1,
+         1,  1, -1, -1,
+         0,  0,  0,  0;
+    corners_marker *= half;
+    tag_geometry g;
+    g.set(half);
+
+    // Random tags in front of the camera, facing it within 60 degrees
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<double> u(-1, 1);
+    std::vector<Quaterniond> q(tags);
+    std::vector<Vector3d> t(tags);
+    for (int i = 0; i < tags; i++) {
+        Vector3d axis(u(rng), u(rng), 0.2*u(rng));
+        q[i] = AngleAxisd(M_PI + (M_PI/3)*u(rng)*0.5, axis.normalized());
+        t[i] << 0.5*u(rng), 0.3*u(rng), 1.5 + u(rng);
+    }
+
+    std::vector<Matrix3d> ref_pos(tags), ref_rot(tags), pos(tags), rot(tags);
+
+    // Check the kernel against the former implementation
+    pose_covariance(g, K, s_pix, tags, q.data(), t.data(), pos.data(), rot.data());
+    double err = 0;
+    for (int i = 0; i < tags; i++) {
+        reference(corners_marker, K, s_pix, q[i], t[i], ref_pos[i], ref_rot[i]);
+        err = std::max(err, (pos[i] - ref_pos[i]).norm() / ref_pos[i].norm());
+        err = std::max(err, (rot[i] - ref_rot[i]).norm() / ref_rot[i].norm());
+    }
+    printf("max relative difference: %g\n", err);
+
+    double t_ref = timeit(iterations, [&]{
+        for (int i = 0; i < tags; i++)
+            reference(corners_marker, K, s_pix, q[i], t[i], ref_pos[i], ref_rot[i]);
+    });
+    double t_scalar = timeit(iterations, [&]{
+        for (int i = 0; i < tags; i++)
+            pose_covariance(g, K, s_pix, 1, &q[i], &t[i], &pos[i], &rot[i]);
+    });
+    double t_batch = timeit(iterations, [&]{
+        pose_covariance(g, K, s_pix, tags, q.data(), t.data(), pos.data(), rot.data());
+    });
+
+    double n = (double)tags * iterations;
+    printf("%d tags, %d iterations\n", tags, iterations);
+    printf("former:  %8.1f ns/tag\n", t_ref / n * 1e9);
+    printf("scalar:  %8.1f ns/tag  (x%.1f)\n", t_scalar / n * 1e9, t_ref / t_scalar);
+    printf("batched: %8.1f ns/tag  (x%.1f)\n", t_batch / n * 1e9, t_ref / t_batch);
+
+    return err < 1e-6 ? 0 : 1;
+}
@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2020 LAAS/CNRS
+ * All rights reserved.
+ *
+ * Redistribution  and  use  in  source  and binary  forms,  with  or  without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * THE SOFTWARE  IS PROVIDED "AS IS"  AND THE AUTHOR  DISCLAIMS ALL WARRANTIES
+ * WITH  REGARD   TO  THIS  SOFTWARE  INCLUDING  ALL   IMPLIED  WARRANTIES  OF
+ * MERCHANTABILITY AND  FITNESS.  IN NO EVENT  SHALL THE AUTHOR  BE LIABLE FOR
+ * ANY  SPECIAL, DIRECT,  INDIRECT, OR  CONSEQUENTIAL DAMAGES  OR  ANY DAMAGES
+ * WHATSOEVER  RESULTING FROM  LOSS OF  USE, DATA  OR PROFITS,  WHETHER  IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR  OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *                                                  Martin Jacquet - June 2020
+ */
+
+/* Microbenchmark of the square tag PnP (ippe.hpp) against
+ * cv::solvePnPGeneric with SOLVEPNP_IPPE_SQUARE. Both are checked to agree
+ * by test_ippe.
+ *
+ * Usage: bench_ippe [tags [iterations]]
+ */
+#include "ippe.hpp"
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/core/eigen.hpp>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+using namespace Eigen;
+using namespace cv;
+using std::vector;
+
+template<typename F>
+static double
+timeit(int iterations, F f)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++)
+        f();
+    std::chrono::duration<double> dt = std::chrono::steady_clock::now() - start;
+    return dt.count();
+}
+
+int
+main(int argc, char **argv)
+{
+    int tags = argc > 1 ? atoi(argv[1]) : 1000;
+    int iterations = argc > 2 ? atoi(argv[2]) : 100;
+    if (tags < 1 || iterations < 1) {
+        fprintf(stderr, "usage: %s [tags [iterations]]\n", argv[0]);
+        return 2;
+    }
+
+    // Same layout as update_calib and set_length
+    const double half = 0.05;
+    Mat K_cv = (Mat_<float>(3,3) <<
+        800, 0.1, 640,
+          0, 800, 360,
+          0,   0,   1);
+    Mat D = (Mat_<float>(5,1) << -0.12, 0.08, -0.01, 0.001, -0.0005);
+    Mat corners_marker = (Mat_<double>(4,3) <<
+        -half,  half, 0,
+         half,  half, 0,
+         half, -half, 0,
+        -half, -half, 0);
+
+    ippe_camera cam;
+    cam.fx = K_cv.at<float>(0,0);
+    cam.fy = K_cv.at<float>(1,1);
+    cam.cx = K_cv.at<float>(0,2);
+    cam.cy = K_cv.at<float>(1,2);
+    for (int i = 0; i < 5; i++)
+        cam.d[i] = D.at<float>(i);
+
+    // Random tags in front of the camera, facing it within 60 degrees, with
+    // half a pixel of noise on the corners
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<double> u(-1, 1);
+    vector<vector<Point2f>> corners(tags);
+    for (int i = 0; i < tags; i++) {
+        Vector3d axis(u(rng), u(rng), 0.2*u(rng));
+        Matrix3d R = AngleAxisd(M_PI + (M_PI/3)*u(rng)*0.5, axis.normalized()).toRotationMatrix();
+        Mat R_cv, rvec;
+        eigen2cv(R, R_cv);
+        Rodrigues(R_cv, rvec);
+        Vec3d tvec(0.5*u(rng), 0.3*u(rng), 1.5 + u(rng));
+        projectPoints(corners_marker, rvec, tvec, K_cv, D, corners[i]);
+        for (Point2f &c : corners[i])
+            c += Point2f(0.5*u(rng), 0.5*u(rng));
+    }
+
+    vector<Vec3d> rotations, translations;
+    Mat1f reproj_error(2, 1);
+    double t_cv = timeit(iterations, [&]{
+        for (int i = 0; i < tags; i++)
+            solvePnPGeneric(corners_marker, corners[i], K_cv, D, rotations, translations,
+                            false, SOLVEPNP_IPPE_SQUARE, noArray(), noArray(), reproj_error);
+    });
+    double t_ippe = timeit(iterations, [&]{
+        ippe_pose pose[2];
+        for (int i = 0; i < tags; i++)
+            ippe_square(cam, half, corners[i].data(), pose);
+    });
+
+    double n = (double)tags * iterations;
+    printf("%d tags, %d iterations\n", tags, iterations);
+    printf("opencv: %8.1f ns/tag\n", t_cv / n * 1e9);
+    printf("ippe:   %8.1f ns/tag  (x%.1f)\n", t_ippe / n * 1e9, t_cv / t_ippe);
+
+    return 0;
+}
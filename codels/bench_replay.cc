@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2020 LAAS/CNRS
+ * All rights reserved.
+ *
+ * Redistribution  and  use  in  source  and binary  forms,  with  or  without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * THE SOFTWARE  IS PROVIDED "AS IS"  AND THE AUTHOR  DISCLAIMS ALL WARRANTIES
+ * WITH  REGARD   TO  THIS  SOFTWARE  INCLUDING  ALL   IMPLIED  WARRANTIES  OF
+ * MERCHANTABILITY AND  FITNESS.  IN NO EVENT  SHALL THE AUTHOR  BE LIABLE FOR
+ * ANY  SPECIAL, DIRECT,  INDIRECT, OR  CONSEQUENTIAL DAMAGES  OR  ANY DAMAGES
+ * WHATSOEVER  RESULTING FROM  LOSS OF  USE, DATA  OR PROFITS,  WHETHER  IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR  OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *                                                  Martin Jacquet - June 2020
+ */
+
+/* Offline replay benchmark of the detect task.
+ *
+ * Frames are loaded from image files and fed to the codels of the detect
+ * task (detect_poll, detect_main, detect_log) through stand-in ports, with
+ * the same detection, pose, covariance and output frame code as in the
+ * component. The frame rate, the latency of each stage (see set_timing) and
+ * the number of allocations per frame are reported.
+ *
+ * Recordings made with the record service are fed as recorded, from their
+ * mapping.
+ *
+ * Usage: bench_replay [options] image|recording|directory...
+ *   -c file    calibration: fx fy cx cy [k1 k2 k3 p1 p2] (default 800 800 at
+ *              the image center, no distortion)
+ *   -l length  marker length in meters (default 0.1)
+ *   -m ids     tracked markers, comma separated (default 0)
+ *   -n loops   timed passes over the frames, after one warm up pass (default 10)
+ *   -o frame   output frame (0: camera; 1: body; 2: world, default 0)
+ *   -p         pipeline mode
+ *   -w workers pose estimation threads (default 0)
+ *   -j         decode jpeg frames with libjpeg (codec 1)
+ *   -u         feed uncompressed 8 bits grayscale frames
+ */
+#include "bench_runtime.hpp"
+
+#include <dirent.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+
+/* --- Frames ----------------------------------------------------------- */
+
+struct bench_frame {
+    string path;
+    vector<uint8_t> data;
+    or_sensor_frame frame;
+};
+
+static void
+list_frames(const string &path, vector<string> &files)
+{
+    DIR *dir = opendir(path.c_str());
+    if (!dir) {
+        files.push_back(path);
+        return;
+    }
+    vector<string> entries;
+    while (struct dirent *e = readdir(dir))
+        if (e->d_name[0] != '.')
+            entries.push_back(path + "/" + e->d_name);
+    closedir(dir);
+    std::sort(entries.begin(), entries.end());
+    files.insert(files.end(), entries.begin(), entries.end());
+}
+
+/* Load a frame as published by a camera: the compressed file data, or the
+ * decoded grayscale image if uncompressed is set.
+ */
+static bool
+load_frame(const string &path, bool uncompressed, bench_frame &f)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return false;
+    f.path = path;
+    f.data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+
+    Mat image = imdecode(Mat(1, f.data.size(), CV_8UC1, f.data.data()), IMREAD_GRAYSCALE);
+    if (image.empty()) return false;
+
+    memset(&f.frame, 0, sizeof(f.frame));
+    f.frame.width = image.cols;
+    f.frame.height = image.rows;
+    f.frame.compressed = !uncompressed;
+    f.frame.bpp = 1;
+    if (uncompressed) {
+        Mat c = image.isContinuous() ? image : image.clone();
+        f.data.assign(c.data, c.data + c.total());
+    }
+    f.frame.pixels._maximum = f.frame.pixels._length = f.data.size();
+    f.frame.pixels._buffer = f.data.data();
+    return true;
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *calib_path = NULL;
+    float length = 0.1;
+    string markers = "0";
+    int loops = 10;
+    int16_t out_frame = 0;
+    bool pipeline = false, jpeg = false, uncompressed = false;
+    uint16_t workers = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:l:m:n:o:pw:ju")) != -1)
+        switch (opt) {
+            case 'c': calib_path = optarg; break;
+            case 'l': length = atof(optarg); break;
+            case 'm': markers = optarg; break;
+            case 'n': loops = atoi(optarg); break;
+            case 'o': out_frame = atoi(optarg); break;
+            case 'p': pipeline = true; break;
+            case 'w': workers = atoi(optarg); break;
+            case 'j': jpeg = true; break;
+            case 'u': uncompressed = true; break;
+            default: goto usage;
+        }
+    if (optind >= argc || loops < 1 || length <= 0) {
+    usage:
+        fprintf(stderr, "usage: %s [-c calib] [-l length] [-m ids] [-n loops] [-o frame] "
+                "[-p] [-w workers] [-j] [-u] image|recording|directory...\n", argv[0]);
+        return 2;
+    }
+
+    vector<string> files;
+    for (int i = optind; i < argc; i++)
+        list_frames(argv[i], files);
+    vector<bench_frame> frames;
+    vector<std::unique_ptr<frame_recording>> recordings;
+    for (const string &path : files) {
+        recordings.emplace_back(new frame_recording);
+        frame_recording &rec = *recordings.back();
+        if (rec.open(path.c_str())) {
+            for (size_t i = 0; i < rec.size(); i++) {
+                frames.emplace_back();
+                frames.back().path = path;
+                rec.frame(i, &frames.back().frame);
+            }
+            continue;
+        }
+        recordings.pop_back();
+
+        frames.emplace_back();
+        if (!load_frame(path, uncompressed, frames.back())) {
+            warnx("cannot load %s", path.c_str());
+            frames.pop_back();
+        }
+    }
+    if (frames.empty()) errx(2, "no frames");
+
+    static bench_component c;
+    if (calib_path) {
+        if (!bench_load_calib(calib_path, c.io.intrinsics))
+            errx(2, "cannot read calibration from %s", calib_path);
+    } else {
+        c.io.intrinsics.calib.fx = c.io.intrinsics.calib.fy = 800;
+        c.io.intrinsics.calib.cx = frames[0].frame.width / 2.;
+        c.io.intrinsics.calib.cy = frames[0].frame.height / 2.;
+    }
+
+    if (!c.init(length))
+        errx(2, "cannot set marker length or calibration");
+
+    size_t start = 0;
+    do {
+        size_t end = markers.find(',', start);
+        string id = markers.substr(start, end - start);
+        char *e;
+        long n = strtol(id.c_str(), &e, 10);
+        if (id.empty() || *e || !c.track(n))
+            errx(2, "cannot track marker %s", id.c_str());
+        start = end == string::npos ? end : end + 1;
+    } while (start != string::npos);
+
+    if (!c.configure(pipeline, workers, jpeg ? 1 : 0, out_frame))
+        return 2;
+
+    // One pass to warm up, then timed passes. Each frame gets a new
+    // timestamp, at 30Hz.
+    or_time_ts ts = { 0, 0 };
+    uint32_t processed = 0;
+    uint64_t allocated = 0;
+    double elapsed = 0;
+    for (int loop = 0; loop <= loops; loop++) {
+        if (loop == 1) {
+            timing_reset(&c.ids.timing, c.self);
+            processed = c.fed;
+            allocated = bench_allocations();
+            c.io.writes = 0;
+            elapsed = bench_now();
+        }
+
+        for (bench_frame &f : frames) {
+            ts.nsec += 33333333;
+            if (ts.nsec >= 1000000000) { ts.nsec -= 1000000000; ts.sec++; }
+            f.frame.ts = ts;
+            c.feed(&f.frame);
+        }
+        c.drain();
+    }
+    elapsed = bench_now() - elapsed;
+    processed = c.fed - processed;
+    allocated = bench_allocations() - allocated;
+
+    arucotag_stage_latency_s stages;
+    timing_info(c.ids.timing, &stages, c.self);
+
+    printf("%zu frames, %d passes, %s%s, %u workers\n", frames.size(), loops,
+           pipeline ? "pipeline" : "sequential", jpeg ? ", libjpeg" : "", workers);
+    printf("%.1f frames/s, %.3f ms/frame\n", processed / elapsed, elapsed / processed * 1e3);
+    if (bench_allocations_counted)
+        printf("%.1f allocations/frame\n", (double)allocated / processed);
+    printf("%.1f port writes/frame\n\n", (double)c.io.writes / processed);
+    bench_print_stages(stages);
+
+    c.stop();
+    return 0;
+}
@@ -0,0 +1,289 @@
+/*
+ * Copyright (c) 2020 LAAS/CNRS
+ * All rights reserved.
+ *
+ * Redistribution  and  use  in  source  and binary  forms,  with  or  without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * THE SOFTWARE  IS PROVIDED "AS IS"  AND THE AUTHOR  DISCLAIMS ALL WARRANTIES
+ * WITH  REGARD   TO  THIS  SOFTWARE  INCLUDING  ALL   IMPLIED  WARRANTIES  OF
+ * MERCHANTABILITY AND  FITNESS.  IN NO EVENT  SHALL THE AUTHOR  BE LIABLE FOR
+ * ANY  SPECIAL, DIRECT,  INDIRECT, OR  CONSEQUENTIAL DAMAGES  OR  ANY DAMAGES
+ * WHATSOEVER  RESULTING FROM  LOSS OF  USE, DATA  OR PROFITS,  WHETHER  IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR  OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *                                                  Martin Jacquet - June 2020
+ */
+#include "bench_runtime.hpp"
+
+#include <atomic>
+#include <cstdio>
+
+using std::string;
+
+
+/* --- Allocation counter ----------------------------------------------- */
+
+/* This relies on the glibc allocator entry points to interpose malloc().
+ */
+static std::atomic<uint64_t> allocations{0};
+
+uint64_t
+bench_allocations()
+{
+    return allocations.load();
+}
+
+#ifdef __GLIBC__
+extern "C" {
+    void *__libc_malloc(size_t);
+    void *__libc_calloc(size_t, size_t);
+    void *__libc_realloc(void *, size_t);
+    void *__libc_memalign(size_t, size_t);
+
+    void *malloc(size_t n) noexcept {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        return __libc_malloc(n);
+    }
+    void *calloc(size_t n, size_t s) noexcept {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        return __libc_calloc(n, s);
+    }
+    void *realloc(void *p, size_t n) noexcept {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        return __libc_realloc(p, n);
+    }
+    void *aligned_alloc(size_t a, size_t n) noexcept {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        return __libc_memalign(a, n);
+    }
+    int posix_memalign(void **r, size_t a, size_t n) noexcept {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        void *p = __libc_memalign(a, n);
+        if (!p) return ENOMEM;
+        *r = p;
+        return 0;
+    }
+}
+const bool bench_allocations_counted = true;
+#else
+const bool bench_allocations_counted = false;
+#endif
+
+
+/* --- Runtime ---------------------------------------------------------- */
+
+/* Events of the detect task, normally defined by the genom server */
+const char arucotag_start[] = "::arucotag::start";
+const char arucotag_wait[] = "::arucotag::wait";
+const char arucotag_pause_wait[] = "::arucotag::pause_wait";
+const char arucotag_poll[] = "::arucotag::poll";
+const char arucotag_pause_poll[] = "::arucotag::pause_poll";
+const char arucotag_main[] = "::arucotag::main";
+const char arucotag_log[] = "::arucotag::log";
+const char arucotag_ether[] = "::arucotag::ether";
+
+static genom_event
+bench_raise(genom_event ex, const void *detail, size_t size, genom_context self)
+{
+    return ex;
+}
+
+/* --- Component -------------------------------------------------------- */
+
+bench_component::bench_component() : ids(), fed(0)
+{
+    memset(&iface, 0, sizeof(iface));
+    iface.raise = bench_raise;
+    self = &iface;
+    io.has_calib = true;
+}
+
+bool
+bench_component::init(float length)
+{
+    detect_start(&ids, self);
+    ids.tag_info.length = length;
+    if (set_length(length, &ids.detect, self) != genom_ok)
+        return false;
+    if (detect_wait(io, length, &ids.calib, self) != arucotag_poll)
+        return false;
+    ids.timing_cfg.enable = true;
+    return set_timing(true, 1, &ids.timing, &ids.detect, self) == genom_ok;
+}
+
+bool
+bench_component::track(int id)
+{
+    string name = std::to_string(id);
+    return add_marker(io, name.c_str(), &ids.ports, &ids.detect, self) == arucotag_ether;
+}
+
+bool
+bench_component::untrack(int id)
+{
+    string name = std::to_string(id);
+    return remove_marker(io, name.c_str(), &ids.ports, &ids.detect, self) == arucotag_ether;
+}
+
+bool
+bench_component::configure(bool pipeline, uint16_t workers, int16_t codec, int16_t out_frame)
+{
+    ids.codec = codec;
+    if (set_codec(codec, &ids.detect, self) != genom_ok)
+        return false;
+    ids.workers = workers;
+    if (set_workers(workers, &ids.detect, self) != genom_ok)
+        return false;
+    ids.pipeline = pipeline;
+    ids.out_frame = out_frame;
+    return true;
+}
+
+void
+bench_component::step()
+{
+    if (detect_poll(io, ids.stopped, &ids.ports, &ids.last_ts, ids.poll_mode,
+                    &ids.poll, ids.pipe, &ids.timing, &ids.record, &ids.replay,
+                    &ids.cameras, ids.detect, self) != arucotag_main)
+        return;
+    if (detect_main(io, ids.tag_info.s_pix, ids.calib, &ids.detect, &ids.ports,
+                    ids.out_frame, ids.pipeline, &ids.pipe, &ids.timing, ids.replay,
+                    &ids.cameras, self) == arucotag_log)
+        detect_log(io, ids.detect, ids.out_frame, &ids.log, &ids.timing, self);
+}
+
+void
+bench_component::feed(or_sensor_frame *f)
+{
+    while (ids.pipe->running && ids.pipe->idle.empty())
+        step();
+    io.input_frame = f;
+    fed++;
+    step();
+}
+
+void
+bench_component::drain()
+{
+    while (ids.pipe->running && processed() < fed)
+        step();
+}
+
+void
+bench_component::stop()
+{
+    detect_stop(&ids.pipe, &ids.cameras, self);
+}
+
+const or_pose_estimator_state *
+bench_component::published(int id) const
+{
+    auto i = io.poses.find(std::to_string(id));
+    return i == io.poses.end() ? NULL : &i->second;
+}
+
+
+/* --- Helpers ---------------------------------------------------------- */
+
+/* Draw the tag id of the given length at pose (R, t) in camera frame, with a
+ * white quiet zone of one cell, warped with the homography of its pose in the
+ * image of the pinhole camera K (CV_64F). side is about its side in pixels,
+ * for the resolution of the texture.
+ */
+void
+bench_draw_tag(Mat &frame, const Ptr<aruco::Dictionary> &dict, int id, double length,
+               double side, const Mat &K, const Matrix3d &R, const Vector3d &t)
+{
+    // Texture at twice the size of the marker in the image
+    const int q = dict->markerSize + 2;
+    int k = std::max(4, (int)ceil(2*side / q));
+    Mat marker;
+    aruco::drawMarker(dict, id, q*k, marker, 1);
+    Mat texture(Size((q+2)*k, (q+2)*k), CV_8UC1, Scalar(255));
+    Mat inner = texture(Rect(k, k, q*k, q*k));
+    marker.copyTo(inner);
+
+    // Corners of the texture, in the order of tag_geometry, in the tag
+    // frame and in the image
+    static const double sa[4] = { -1,  1,  1, -1 };
+    static const double sb[4] = {  1,  1, -1, -1 };
+    double e = length/2 * (q+2) / q;
+    float w = (q+2)*k - 0.5f;
+    vector<Point2f> src = {
+        Point2f(-0.5f, -0.5f), Point2f(w, -0.5f), Point2f(w, w), Point2f(-0.5f, w)
+    };
+    vector<Point2f> dst(4);
+    double umin = HUGE_VAL, umax = -HUGE_VAL, vmin = HUGE_VAL, vmax = -HUGE_VAL;
+    for (int i = 0; i < 4; i++) {
+        Vector3d c = R * Vector3d(e*sa[i], e*sb[i], 0) + t;
+        double u = K.at<double>(0,0) * c(0)/c(2) + K.at<double>(0,1) * c(1)/c(2) + K.at<double>(0,2);
+        double v = K.at<double>(1,1) * c(1)/c(2) + K.at<double>(1,2);
+        dst[i] = Point2f(u, v);
+        umin = std::min(umin, u); umax = std::max(umax, u);
+        vmin = std::min(vmin, v); vmax = std::max(vmax, v);
+    }
+
+    // Warp into the bounding box only
+    Rect roi(floor(umin) - 1, floor(vmin) - 1, ceil(umax - umin) + 3, ceil(vmax - vmin) + 3);
+    roi &= Rect(0, 0, frame.cols, frame.rows);
+    if (roi.empty()) return;
+    for (Point2f &p : dst)
+        p = p - Point2f(roi.x, roi.y);
+    Mat H = getPerspectiveTransform(src, dst);
+    Mat out = frame(roi);
+    warpPerspective(texture, out, H, roi.size(), INTER_LINEAR, BORDER_TRANSPARENT);
+}
+
+
+double
+bench_now()
+{
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+/* Calibration file: fx fy cx cy [k1 k2 k3 p1 p2] */
+bool
+bench_load_calib(const char *path, or_sensor_intrinsics &intrinsics)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) return false;
+    or_sensor_calibration &c = intrinsics.calib;
+    or_sensor_distortion &d = intrinsics.disto;
+    int n = fscanf(f, "%f %f %f %f %f %f %f %f %f",
+                   &c.fx, &c.fy, &c.cx, &c.cy, &d.k1, &d.k2, &d.k3, &d.p1, &d.p2);
+    fclose(f);
+    return n == 4 || n == 9;
+}
+
+static void
+print_stage(const char *name, const arucotag_latency_s &l)
+{
+    if (!l.count) return;
+    printf("%-12s %8lu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", name, (unsigned long)l.count,
+           l.min*1e6, l.mean*1e6, l.p50*1e6, l.p90*1e6, l.p99*1e6, l.max*1e6);
+}
+
+void
+bench_print_stages(const arucotag_stage_latency_s &stages)
+{
+    printf("%-12s %8s %9s %9s %9s %9s %9s %9s  (us)\n",
+           "stage", "count", "min", "mean", "p50", "p90", "p99", "max");
+    print_stage("poll", stages.poll);
+    print_stage("decode", stages.decode);
+    print_stage("detect", stages.detect);
+    print_stage("pnp", stages.pnp);
+    print_stage("covariance", stages.covariance);
+    print_stage("publish", stages.publish);
+    print_stage("log", stages.log);
+    print_stage("frame", stages.frame);
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2020 LAAS/CNRS
+ * All rights reserved.
+ *
+ * Redistribution  and  use  in  source  and binary  forms,  with  or  without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * THE SOFTWARE  IS PROVIDED "AS IS"  AND THE AUTHOR  DISCLAIMS ALL WARRANTIES
+ * WITH  REGARD   TO  THIS  SOFTWARE  INCLUDING  ALL   IMPLIED  WARRANTIES  OF
+ * MERCHANTABILITY AND  FITNESS.  IN NO EVENT  SHALL THE AUTHOR  BE LIABLE FOR
+ * ANY  SPECIAL, DIRECT,  INDIRECT, OR  CONSEQUENTIAL DAMAGES  OR  ANY DAMAGES
+ * WHATSOEVER  RESULTING FROM  LOSS OF  USE, DATA  OR PROFITS,  WHETHER  IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR  OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *                                                  Martin Jacquet - June 2020
+ */
+#ifndef H_ARUCOTAG_BENCH_RUNTIME
+#define H_ARUCOTAG_BENCH_RUNTIME
+
+/* Stand-in genom runtime for the benchmarks and tests: the codels run on
+ * ports in memory, exceptions are returned as events, and the component is
+ * set up and driven as by its services and the detect task.
+ */
+#include "arucotag_c_types.h"
+#include "codels.hpp"
+
+struct bench_component {
+    arucotag_ids ids;
+    genom_context_iface iface;
+    genom_context self;
+    arucotag_memory_ports io;
+
+    uint32_t fed;       // frames fed so far
+
+    bench_component();
+
+    // detect_start, set_length and detect_wait with the calibration in
+    // io.intrinsics, then set_timing
+    bool init(float length);
+    bool track(int id);
+    bool untrack(int id);
+    bool configure(bool pipeline, uint16_t workers, int16_t codec, int16_t out_frame);
+
+    // Run the task until the frame is taken. In pipeline mode, wait for a
+    // free slot first, so that no frame is dropped.
+    void feed(or_sensor_frame *f);
+    // Run the task until all the frames fed are processed
+    void drain();
+    // Poll the frame port and process the frame or the pipeline results
+    void step();
+    void stop();
+
+    uint32_t processed() const { return ids.detect->ingest_info.frames; }
+    const or_pose_estimator_state *published(int id) const;
+};
+
+/* Allocations on all threads, if counted (glibc only) */
+extern const bool bench_allocations_counted;
+uint64_t bench_allocations();
+
+double bench_now();
+void bench_draw_tag(Mat &frame, const Ptr<aruco::Dictionary> &dict, int id, double length,
+                    double side, const Mat &K, const Matrix3d &R, const Vector3d &t);
+bool bench_load_calib(const char *path, or_sensor_intrinsics &intrinsics);
+void bench_print_stages(const arucotag_stage_latency_s &stages);
+
+#endif /* H_ARUCOTAG_BENCH_RUNTIME */
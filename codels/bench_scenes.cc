@@ -0,0 +1,491 @@
+/*
+ * Copyright (c) 2020 LAAS/CNRS
+ * All rights reserved.
+ *
+ * Redistribution  and  use  in  source  and binary  forms,  with  or  without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * THE SOFTWARE  IS PROVIDED "AS IS"  AND THE AUTHOR  DISCLAIMS ALL WARRANTIES
+ * WITH  REGARD   TO  THIS  SOFTWARE  INCLUDING  ALL   IMPLIED  WARRANTIES  OF
+ * MERCHANTABILITY AND  FITNESS.  IN NO EVENT  SHALL THE AUTHOR  BE LIABLE FOR
+ * ANY  SPECIAL, DIRECT,  INDIRECT, OR  CONSEQUENTIAL DAMAGES  OR  ANY DAMAGES
+ * WHATSOEVER  RESULTING FROM  LOSS OF  USE, DATA  OR PROFITS,  WHETHER  IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR  OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *                                                  Martin Jacquet - June 2020
+ */
+
+/* Scaling benchmark of the detect task on synthetic scenes.
+ *
+ * Frames are rendered with the dictionary, marker length and calibration (K
+ * and D) of the component, with markers at known poses. Starting from a
+ * baseline scene, each sweep varies one parameter: image size, number of
+ * markers (1 to 250), marker size in pixels, blur, noise, tilt of the
+ * markers and pose estimation workers. Each scene goes through the codels
+ * of the detect task with the stand-in runtime of bench_replay. The frame
+ * rate, latency percentiles, allocations per frame, the fraction of markers
+ * found and the pose error against ground truth are reported.
+ *
+ * Usage: bench_scenes [options]
+ *   -c file    calibration at the baseline image size: fx fy cx cy
+ *              [k1 k2 k3 p1 p2] (default 70 degrees horizontal field of
+ *              view, no distortion)
+ *   -l length  marker length in meters (default 0.1)
+ *   -f frames  frames per scene (default 30)
+ *   -s sweeps  comma separated among size, markers, scale, blur, noise,
+ *              tilt and workers, or none for the baseline only (default all)
+ *   -W width   baseline image width (default 1280)
+ *   -H height  baseline image height (default 720)
+ *   -m count   baseline number of markers (default 10)
+ *   -S pixels  baseline marker side (default 80)
+ *   -b sigma   baseline blur (default 0)
+ *   -n sigma   baseline noise, in gray levels (default 0)
+ *   -t degrees baseline max tilt of markers (default 30)
+ *   -w workers baseline pose estimation threads (default 0)
+ *   -p         pipeline mode
+ *   -r seed    random seed (default 1)
+ */
+#include "bench_runtime.hpp"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <numeric>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+#define frame_period_ns 33333333
+
+
+/* --- Scenes ----------------------------------------------------------- */
+
+struct scene {
+    int width, height;
+    int markers;        // ids 0 to markers-1, on a grid
+    double side;        // marker side in pixels, at most half a grid cell
+    double blur;        // sigma of the gaussian blur (px)
+    double noise;       // sigma of the gaussian noise (gray levels)
+    double tilt;        // max angle between markers and the image plane (deg)
+    uint16_t workers;
+};
+
+struct truth {
+    Vector3d p;
+    Quaterniond q;
+};
+
+/* Renders markers as seen by the camera: each marker, with a white quiet
+ * zone of one cell, is warped with the homography of its pose in the
+ * undistorted image, then the image is distorted as a whole.
+ */
+class scene_renderer {
+public:
+    scene_renderer(const Ptr<aruco::Dictionary> &dict, double length) :
+        dict(dict), length(length), distorted(false) {}
+
+    void set_camera(const Mat &K, const Mat &D, Size size);
+    double render(const scene &s, std::mt19937 &rng, Mat &frame, vector<truth> &gt);
+
+private:
+    Ptr<aruco::Dictionary> dict;
+    double length;
+    Mat K, D;
+    Size size;
+    Mat mapx, mapy;     // undistorted position of each pixel
+    bool distorted;
+
+    void draw(Mat &frame, int id, double side, const Matrix3d &R, const Vector3d &t);
+};
+
+void
+scene_renderer::set_camera(const Mat &K, const Mat &D, Size size)
+{
+    K.convertTo(this->K, CV_64F);
+    D.convertTo(this->D, CV_64F);
+    this->size = size;
+    distorted = norm(this->D, NORM_INF) > 0;
+    if (!distorted) return;
+
+    vector<Point2f> px, und;
+    px.reserve(size.area());
+    for (int v = 0; v < size.height; v++)
+        for (int u = 0; u < size.width; u++)
+            px.push_back(Point2f(u, v));
+    undistortPoints(px, und, this->K, this->D, noArray(), this->K);
+    mapx.create(size, CV_32F);
+    mapy.create(size, CV_32F);
+    for (int v = 0; v < size.height; v++)
+        for (int u = 0; u < size.width; u++) {
+            mapx.at<float>(v, u) = und[v*size.width + u].x;
+            mapy.at<float>(v, u) = und[v*size.width + u].y;
+        }
+}
+
+void
+scene_renderer::draw(Mat &frame, int id, double side, const Matrix3d &R, const Vector3d &t)
+{
+    bench_draw_tag(frame, dict, id, length, side, K, R, t);
+}
+
+/* Render a frame of scene s and the true poses of its markers, indexed by
+ * id. Returns the side of the markers in pixels.
+ */
+double
+scene_renderer::render(const scene &s, std::mt19937 &rng, Mat &frame, vector<truth> &gt)
+{
+    std::uniform_real_distribution<double> u(0, 1);
+    frame.create(size, CV_8UC1);
+    frame.setTo(Scalar(128));
+
+    // One marker per grid cell, with some jitter
+    int cols = std::max(1, (int)ceil(sqrt(s.markers * (double)size.width / size.height)));
+    int rows = (s.markers + cols - 1) / cols;
+    double cw = (double)size.width / cols, ch = (double)size.height / rows;
+    double side = std::min(s.side, 0.5*std::min(cw, ch));
+    double jitter = std::max(0., std::min(cw, ch) - 1.8*side) / 2;
+    vector<int> cells(rows*cols);
+    std::iota(cells.begin(), cells.end(), 0);
+    std::shuffle(cells.begin(), cells.end(), rng);
+
+    double fx = K.at<double>(0,0), fy = K.at<double>(1,1);
+    double z = fx * length / side;
+    gt.resize(s.markers);
+    for (int id = 0; id < s.markers; id++) {
+        double pu = (cells[id] % cols + 0.5) * cw + jitter * (2*u(rng) - 1);
+        double pv = (cells[id] / cols + 0.5) * ch + jitter * (2*u(rng) - 1);
+        Vector3d t((pu - K.at<double>(0,2)) / fx * z, (pv - K.at<double>(1,2)) / fy * z, z);
+
+        // Facing the camera, then tilted about a random axis of the tag plane
+        double tilt = u(rng) * s.tilt * M_PI/180, a = 2*M_PI*u(rng);
+        Matrix3d R =
+            (AngleAxisd(M_PI, Vector3d::UnitX()) *
+             AngleAxisd(tilt, Vector3d(cos(a), sin(a), 0)) *
+             AngleAxisd(2*M_PI*u(rng), Vector3d::UnitZ())).toRotationMatrix();
+
+        draw(frame, id, side, R, t);
+        gt[id].p = t;
+        gt[id].q = Quaterniond(R);
+    }
+
+    if (distorted) {
+        Mat undistorted = frame.clone();
+        remap(undistorted, frame, mapx, mapy, INTER_LINEAR, BORDER_CONSTANT, Scalar(128));
+    }
+    if (s.blur > 0)
+        GaussianBlur(frame, frame, Size(0, 0), s.blur);
+    if (s.noise > 0) {
+        Mat n(size, CV_16S), f;
+        randn(n, 0, s.noise);
+        frame.convertTo(f, CV_16S);
+        add(f, n, f);
+        f.convertTo(frame, CV_8U);
+    }
+    return side;
+}
+
+
+/* --- Benchmark -------------------------------------------------------- */
+
+struct published {
+    int id;
+    or_time_ts ts;
+    bool present;
+    Vector3d p;
+    Quaterniond q;
+};
+
+struct result {
+    double side;
+    double fps;
+    arucotag_stage_latency_s stages;
+    double allocations;     // per frame
+    double found;           // fraction of markers found
+    double pos[2];          // median and p95 of the position error, relative to the distance
+    double rot[2];          // median and p95 of the rotation error (rad)
+};
+
+static double
+percentile(vector<double> &v, double p)
+{
+    if (v.empty()) return NAN;
+    size_t i = std::min(v.size() - 1, (size_t)(p * v.size()));
+    std::nth_element(v.begin(), v.begin() + i, v.end());
+    return v[i];
+}
+
+class scene_bench {
+public:
+    scene_bench(bench_component &c, const or_sensor_intrinsics &base, Size base_size,
+                int frames, bool pipeline, unsigned seed) :
+        c(c), base(base), base_size(base_size), frames(frames), pipeline(pipeline),
+        rng(seed), renderer(c.ids.detect->dict, 2*c.ids.detect->geometry.l),
+        tracked(0), counter(0) {}
+
+    bool run(const scene &s, result &r);
+
+private:
+    bench_component &c;
+    or_sensor_intrinsics base;  // calibration at base_size
+    Size base_size, size;
+    int frames;
+    bool pipeline;
+    std::mt19937 rng;
+    scene_renderer renderer;
+    int tracked;                // markers 0 to tracked-1 are tracked
+    int64_t counter;            // frames fed, for timestamps
+};
+
+bool
+scene_bench::run(const scene &s, result &r)
+{
+    // Calibration scaled to the image size
+    Size sz(s.width, s.height);
+    if (sz != size) {
+        double kx = (double)s.width / base_size.width, ky = (double)s.height / base_size.height;
+        c.io.intrinsics = base;
+        c.io.intrinsics.calib.fx *= kx;
+        c.io.intrinsics.calib.cx *= kx;
+        c.io.intrinsics.calib.gamma *= kx;
+        c.io.intrinsics.calib.fy *= ky;
+        c.io.intrinsics.calib.cy *= ky;
+        if (set_calib(c.io, &c.ids.calib, &c.ids.cameras, c.self) != arucotag_ether)
+            return false;
+        renderer.set_camera(c.ids.calib->K_cv, c.ids.calib->D, sz);
+        size = sz;
+    }
+    for (; tracked < s.markers; tracked++)
+        if (!c.track(tracked)) return false;
+    for (; tracked > s.markers; tracked--)
+        if (!c.untrack(tracked - 1)) return false;
+    if (!c.configure(pipeline, s.workers, 0, 0))
+        return false;
+
+    // Render the frames beforehand
+    vector<Mat> images(frames);
+    vector<vector<truth>> gt(frames);
+    vector<or_sensor_frame> f(frames);
+    for (int i = 0; i < frames; i++) {
+        r.side = renderer.render(s, rng, images[i], gt[i]);
+        memset(&f[i], 0, sizeof(f[i]));
+        f[i].width = sz.width;
+        f[i].height = sz.height;
+        f[i].bpp = 1;
+        f[i].pixels._maximum = f[i].pixels._length = images[i].total();
+        f[i].pixels._buffer = images[i].data;
+    }
+
+    // A warm up pass, then a timed pass. Published poses are kept as is
+    // and checked afterwards.
+    vector<published> poses;
+    poses.reserve(2 * frames * s.markers);
+    c.io.on_pose = [&](const char *name, const or_pose_estimator_state &st) {
+        published p;
+        p.id = atoi(name);
+        p.ts = st.ts;
+        p.present = st.pos._present && st.att._present;
+        p.p = Vector3d(st.pos._value.x, st.pos._value.y, st.pos._value.z);
+        p.q = Quaterniond(st.att._value.qw, st.att._value.qx, st.att._value.qy, st.att._value.qz);
+        poses.push_back(p);
+    };
+
+    int64_t first = 0;
+    uint64_t allocated = 0;
+    double elapsed = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass == 1) {
+            poses.clear();
+            timing_reset(&c.ids.timing, c.self);
+            first = counter;
+            allocated = bench_allocations();
+            elapsed = bench_now();
+        }
+        for (int i = 0; i < frames; i++) {
+            int64_t ns = ++counter * frame_period_ns;
+            f[i].ts.sec = ns / 1000000000;
+            f[i].ts.nsec = ns % 1000000000;
+            c.feed(&f[i]);
+        }
+        c.drain();
+    }
+    elapsed = bench_now() - elapsed;
+    allocated = bench_allocations() - allocated;
+    c.io.on_pose = nullptr;
+
+    r.fps = frames / elapsed;
+    r.allocations = (double)allocated / frames;
+    timing_info(c.ids.timing, &r.stages, c.self);
+
+    // Compare with the ground truth of the frame of each pose
+    vector<double> pos, rot;
+    size_t found = 0;
+    for (const published &p : poses) {
+        int64_t i = (p.ts.sec * (int64_t)1000000000 + p.ts.nsec) / frame_period_ns - first - 1;
+        if (!p.present || i < 0 || i >= frames || p.id >= s.markers) continue;
+        const truth &t = gt[i][p.id];
+        found++;
+        pos.push_back((p.p - t.p).norm() / t.p.norm());
+        rot.push_back(p.q.angularDistance(t.q));
+    }
+    r.found = (double)found / (frames * s.markers);
+    r.pos[0] = percentile(pos, 0.5);
+    r.pos[1] = percentile(pos, 0.95);
+    r.rot[0] = percentile(rot, 0.5);
+    r.rot[1] = percentile(rot, 0.95);
+    return true;
+}
+
+
+/* --- Report ----------------------------------------------------------- */
+
+static void
+print_header(const char *sweep, const scene &base, bool pipeline)
+{
+    printf("\n%s sweep, from %dx%d, %d markers of %gpx, blur %g, noise %g, tilt %g, %u workers%s\n",
+           sweep, base.width, base.height, base.markers, base.side, base.blur, base.noise,
+           base.tilt, base.workers, pipeline ? ", pipeline" : "");
+    printf("%-16s %8s %9s %9s %9s %9s %8s %7s %8s %8s %7s %7s\n",
+           "", "frames/s", "frame p50", "frame p99", "detect", "pnp+cov", "allocs",
+           "found", "pos p50", "pos p95", "rot p50", "rot p95");
+    printf("%-16s %8s %9s %9s %9s %9s %8s %7s %8s %8s %7s %7s\n",
+           "", "", "(ms)", "(ms)", "p50 (ms)", "mean (ms)", "/frame",
+           "(%)", "(%)", "(%)", "(deg)", "(deg)");
+}
+
+static void
+print_result(const string &label, const result &r)
+{
+    const arucotag_stage_latency_s &st = r.stages;
+    printf("%-16s %8.1f %9.2f %9.2f %9.2f %9.3f %8.1f %7.1f %8.3f %8.3f %7.2f %7.2f\n",
+           label.c_str(), r.fps, st.frame.p50*1e3, st.frame.p99*1e3, st.detect.p50*1e3,
+           (st.pnp.mean + st.covariance.mean)*1e3, r.allocations, 100*r.found,
+           100*r.pos[0], 100*r.pos[1], r.rot[0]*180/M_PI, r.rot[1]*180/M_PI);
+    fflush(stdout);
+}
+
+
+int
+main(int argc, char **argv)
+{
+    const char *calib_path = NULL;
+    float length = 0.1;
+    int frames = 30;
+    string sweeps = "size,markers,scale,blur,noise,tilt,workers";
+    scene base = { 1280, 720, 10, 80, 0, 0, 30, 0 };
+    bool pipeline = false;
+    unsigned seed = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:l:f:s:W:H:m:S:b:n:t:w:pr:")) != -1)
+        switch (opt) {
+            case 'c': calib_path = optarg; break;
+            case 'l': length = atof(optarg); break;
+            case 'f': frames = atoi(optarg); break;
+            case 's': sweeps = optarg; break;
+            case 'W': base.width = atoi(optarg); break;
+            case 'H': base.height = atoi(optarg); break;
+            case 'm': base.markers = atoi(optarg); break;
+            case 'S': base.side = atof(optarg); break;
+            case 'b': base.blur = atof(optarg); break;
+            case 'n': base.noise = atof(optarg); break;
+            case 't': base.tilt = atof(optarg); break;
+            case 'w': base.workers = atoi(optarg); break;
+            case 'p': pipeline = true; break;
+            case 'r': seed = atoi(optarg); break;
+            default: goto usage;
+        }
+    if (optind < argc || frames < 1 || length <= 0 || base.width < 64 || base.height < 64 ||
+        base.markers < 1 || base.markers > 250 || base.side < 8) {
+    usage:
+        fprintf(stderr, "usage: %s [-c calib] [-l length] [-f frames] [-s sweeps] "
+                "[-W width] [-H height] [-m markers] [-S pixels] [-b sigma] [-n sigma] "
+                "[-t degrees] [-w workers] [-p] [-r seed]\n", argv[0]);
+        return 2;
+    }
+
+    or_sensor_intrinsics calib;
+    memset(&calib, 0, sizeof(calib));
+    if (calib_path) {
+        if (!bench_load_calib(calib_path, calib))
+            errx(2, "cannot read calibration from %s", calib_path);
+    } else {
+        calib.calib.fx = calib.calib.fy = base.width/2 / tan(35 * M_PI/180);
+        calib.calib.cx = base.width / 2.;
+        calib.calib.cy = base.height / 2.;
+    }
+
+    static bench_component c;
+    c.io.intrinsics = calib;
+    if (!c.init(length))
+        errx(2, "cannot set marker length or calibration");
+    theRNG().state = seed;
+    scene_bench bench(c, calib, Size(base.width, base.height), frames, pipeline, seed);
+
+    // Each sweep varies one parameter of the baseline scene
+    struct sweep {
+        const char *name;
+        vector<double> values;
+        void (*set)(scene &, double);
+    };
+    const sweep all[] = {
+        { "size", { 480, 720, 1080, 1440, 2160 },
+          [](scene &s, double h) { s.width = h*16/9; s.height = h; } },
+        { "markers", { 1, 10, 50, 100, 250 },
+          [](scene &s, double n) { s.markers = n; } },
+        { "scale", { 20, 40, 80, 160, 320 },
+          [](scene &s, double px) { s.side = px; } },
+        { "blur", { 0, 0.5, 1, 2, 3 },
+          [](scene &s, double b) { s.blur = b; } },
+        { "noise", { 0, 2, 5, 10, 20 },
+          [](scene &s, double n) { s.noise = n; } },
+        { "tilt", { 0, 15, 30, 45, 60, 75 },
+          [](scene &s, double t) { s.tilt = t; } },
+        { "workers", { 0, 1, 2, 4, 8 },
+          [](scene &s, double w) { s.workers = w; } },
+    };
+
+    unsigned cores = std::thread::hardware_concurrency();
+    result r;
+    if (sweeps == "none") {
+        print_header("baseline", base, pipeline);
+        if (!bench.run(base, r)) errx(1, "cannot run scene");
+        print_result("baseline", r);
+    }
+    for (const sweep &w : all) {
+        if (("," + sweeps + ",").find("," + string(w.name) + ",") == string::npos)
+            continue;
+        print_header(w.name, base, pipeline);
+        for (double v : w.values) {
+            scene s = base;
+            w.set(s, v);
+            if (s.workers > 0 && cores && s.workers > cores) continue;
+            if (!bench.run(s, r)) errx(1, "cannot run scene");
+
+            char label[32];
+            if (!strcmp(w.name, "size"))
+                snprintf(label, sizeof(label), "%dx%d", s.width, s.height);
+            else if (!strcmp(w.name, "markers"))
+                snprintf(label, sizeof(label), "%d (%.0fpx)", s.markers, r.side);
+            else
+                snprintf(label, sizeof(label), "%g", v);
+            print_result(label, r);
+        }
+    }
+
+    c.stop();
+    return 0;
+}
@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2020 LAAS/CNRS
+ * All rights reserved.
+ *
+ * Redistribution  and  use  in  source  and binary  forms,  with  or  without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * THE SOFTWARE  IS PROVIDED "AS IS"  AND THE AUTHOR  DISCLAIMS ALL WARRANTIES
+ * WITH  REGARD   TO  THIS  SOFTWARE  INCLUDING  ALL   IMPLIED  WARRANTIES  OF
+ * MERCHANTABILITY AND  FITNESS.  IN NO EVENT  SHALL THE AUTHOR  BE LIABLE FOR
+ * ANY  SPECIAL, DIRECT,  INDIRECT, OR  CONSEQUENTIAL DAMAGES  OR  ANY DAMAGES
+ * WHATSOEVER  RESULTING FROM  LOSS OF  USE, DATA  OR PROFITS,  WHETHER  IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR  OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *                                                  Martin Jacquet - June 2020
+ */
+#ifndef H_ARUCOTAG_BUNDLE
+#define H_ARUCOTAG_BUNDLE
+
+#include <eigen3/Eigen/Dense>
+#include <cmath>
+#include <cstddef>
+
+#include "ippe.hpp"
+
+/* --- Tag bundle PnP --------------------------------------------------- */
+
+/* Pose of a rigid object from the corners of all the visible tags attached to
+ * it, solved as one problem instead of one IPPE per tag:
+ *
+ *  - the pose is initialized from the IPPE solutions of one of the tags,
+ *    composed with the pose of this tag in the object frame,
+ *  - it is refined by Gauss-Newton on the reprojection error in pixels of
+ *    all the corners, with the translation and the rotation (in tangent
+ *    space, perturbed on the right as in pose_covariance()) as parameters,
+ *  - the covariance is s_pix^2 (J^T J)^-1 at the solution, with J (2n x 6)
+ *    stacking the Jacobians of the n corners. J^T J is the one of the last
+ *    iteration, so the covariance costs one 6x6 Cholesky.
+ *
+ * Corners are undistorted once, the residuals are those of the pinhole
+ * camera (fx, fy, cx, cy).
+ */
+
+typedef Eigen::Matrix<double,6,6> bundle_matrix;
+typedef Eigen::Matrix<double,6,1> bundle_vector;
+
+struct bundle_pose {
+    Eigen::Matrix3d R;  // orientation of the object in camera frame
+    Eigen::Vector3d t;  // position of the object in camera frame
+    bundle_matrix H;    // J^T J at (R, t), translation first
+    double error;       // rms reprojection error (pixels)
+};
+
+namespace bundle_detail {
+
+inline Eigen::Matrix3d
+skew(const Eigen::Vector3d &v)
+{
+    Eigen::Matrix3d S;
+    S <<     0, -v(2),  v(1),
+          v(2),     0, -v(0),
+         -v(1),  v(0),     0;
+    return S;
+}
+
+inline Eigen::Matrix3d
+expmap(const Eigen::Vector3d &w)
+{
+    double theta = w.norm();
+    if (theta < 1e-12)
+        return Eigen::Matrix3d::Identity() + skew(w);
+    return Eigen::AngleAxisd(theta, w / theta).toRotationMatrix();
+}
+
+}
+
+/* Refine the pose of an object from n points X in object frame and their
+ * undistorted normalized image coordinates m. pose holds the initial guess
+ * on input. Returns false if a point goes behind the camera or the normal
+ * equations are singular.
+ */
+inline bool
+bundle_refine(const ippe_camera &cam, size_t n, const Eigen::Vector3d *X,
+              const Eigen::Vector2d *m, bundle_pose &pose, int iterations = 10)
+{
+    using namespace bundle_detail;
+
+    bool done = false;
+    for (int it = 0; ; it++)
+    {
+        bundle_matrix H = bundle_matrix::Zero();
+        bundle_vector g = bundle_vector::Zero();
+        double e = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            Eigen::Vector3d p = pose.R * X[i] + pose.t;
+            if (!(p(2) > 0))
+                return false;
+            double iz = 1. / p(2), x = p(0)*iz, y = p(1)*iz;
+            Eigen::Vector2d r(cam.fx*(m[i](0) - x), cam.fy*(m[i](1) - y));
+            e += r.squaredNorm();
+
+            // Jacobian wrt translation, and wrt rotation -A * R * skew(X)
+            Eigen::Matrix<double,2,3> A;
+            A << cam.fx*iz, 0,         -cam.fx*x*iz,
+                 0,         cam.fy*iz, -cam.fy*y*iz;
+            Eigen::Matrix<double,2,6> J;
+            J.leftCols<3>() = A;
+            J.rightCols<3>() = -A * pose.R * skew(X[i]);
+            H.selfadjointView<Eigen::Upper>().rankUpdate(J.transpose());
+            g.noalias() += J.transpose() * r;
+        }
+        pose.H = H.selfadjointView<Eigen::Upper>();
+        pose.error = std::sqrt(e / (2*n));
+        if (done || it == iterations)
+            return true;
+
+        Eigen::LLT<bundle_matrix> llt(pose.H);
+        if (llt.info() != Eigen::Success)
+            return false;
+        bundle_vector dx = llt.solve(g);
+        if (!dx.allFinite())
+            return false;
+        pose.t += dx.head<3>();
+        pose.R = pose.R * expmap(dx.tail<3>());
+        done = dx.squaredNorm() < 1e-16;
+    }
+}
+
+/* Covariance of the position and rotation of the object at pose. Cross
+ * (pos/rot) covariance is neglected, as in pose_covariance(). Returns false if
+ * J^T J is not invertible.
+ */
+inline bool
+bundle_covariance(const bundle_pose &pose, double s_pix,
+                  Eigen::Matrix3d &cov_pos, Eigen::Matrix3d &cov_rot)
+{
+    Eigen::LLT<bundle_matrix> llt(pose.H);
+    if (llt.info() != Eigen::Success)
+        return false;
+    bundle_matrix C = s_pix*s_pix * llt.solve(bundle_matrix::Identity());
+    cov_pos = C.topLeftCorner<3,3>();
+    cov_rot = C.bottomRightCorner<3,3>();
+    return true;
+}
+
+#endif /* H_ARUCOTAG_BUNDLE */
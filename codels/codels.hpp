@@ -33,14 +33,29 @@
 #include <eigen3/Eigen/Dense>
 #include <opencv2/core/eigen.hpp>
 
-#include <queue>
+#include "bundle.hpp"
+#include "covariance.hpp"
+#include "ippe.hpp"
+#include "latency.hpp"
+#include "log.hpp"
+#include "ports.hpp"
+#include "record.hpp"
+#include "ring.hpp"
+#include "spsc.hpp"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 
 #include <iostream>
 #include <sys/time.h>
+#include <time.h>
 #include <aio.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <err.h>
+#include <semaphore.h>
 
 using namespace std;
 using namespace cv;
@@ -51,16 +66,17 @@ struct arucotag_calib_s {
     Matrix3d K = Matrix3d::Zero();              // intrinsic calibration matrix
     Mat K_cv = Mat::zeros(Size(3,3), CV_32F);   // opencv representation of K
     Mat D = Mat::zeros(Size(1,5), CV_32F);      // camera distortion coefs
+    ippe_camera cam;                            // K and D for the tag PnP
     Vector3d B_p_C = Vector3d::Zero();          // translation from camera to body
     Matrix3d B_R_C = Matrix3d::Identity();      // rotation from body to camera
 };
 
 
 /* --- Detection -------------------------------------------------------- */
-#define arucotag_hist_size 10
-#define arucotag_age_max 10
+#define arucotag_hist_max 20    // capacity of the history of each tag
 
 struct pose6D {
+    pose6D() {}
     pose6D(Vector3d t_in, Quaterniond q_in) {
         t = t_in;
         q = q_in;
@@ -69,28 +85,420 @@ struct pose6D {
     Quaterniond q;  // orientation (in camera frame, quaternion reprensation)
 };
 struct tag_detection {
-    uint16_t id;        // id of detecte tag
-    // uint16_t age;       // "age" of detection (0 for current frame, increases by 1 for each past frame)
-    queue<pose6D> history;    // history of detections
+    bool active = false;    // tag was seen recently, history is valid
+    uint16_t age = 0;       // "age" of detection (0 for current frame, increases by 1 for each past frame)
+    or_time_ts seen;        // timestamp of the last frame the tag was seen in
+    ring_buffer<pose6D, arucotag_hist_max> history;    // history of detections
+};
+
+// Previous detections of the tags seen by a camera. Poses are selected for
+// consistency with the history in the camera frame, so each camera has its
+// own.
+struct tag_history {
+    vector<tag_detection> tags;     // sized to the dictionary, indexed by id
+    vector<uint16_t> active;        // ids of active entries of tags
+
+    tag_history(size_t n) : tags(n) { active.reserve(n); }
+};
+
+struct tag_estimate {
+    bool valid;             // a pose was selected for this frame
+    Vector3d position;      // in output frame
+    Quaterniond orientation;
+    Matrix3d cov_pos;
+    Matrix4d cov_q;
+    Point2f center;         // centroid in pixel coordinates
+};
+
+// Estimates of a tag in the frames of the cameras processed together. The
+// position is the information weighted mean, the orientation the mean of
+// quaternions weighted by the inverse trace of their covariance.
+struct tag_fusion {
+    uint16_t n;             // estimates added
+    or_time_ts ts;          // timestamp of the latest frame
+    Matrix3d info;          // sum of the inverse position covariances
+    Vector3d info_p;        // sum of the inverse position covariances times positions
+    bool invertible;        // all position covariances were invertible
+    Vector4d q;             // weighted sum of orientations (w, x, y, z)
+    Matrix4d cov_q;         // sum of squared weights times orientation covariances
+    double w;               // sum of orientation weights
+    tag_estimate best;      // estimate with the smallest position covariance
+
+    void reset() { n = 0; }
+    void add(const tag_estimate &est, const or_time_ts &t);
+    void fuse(tag_estimate &out) const;
+};
+
+#define arucotag_bundle_max 16      // tags in a bundle
+
+// Tags rigidly attached to an object, whose pose is solved from the corners
+// of all its visible tags and published as one. Its tags are tracked markers
+// named after the bundle. The history of the object in each camera is kept in
+// the entry of its first tag.
+struct tag_bundle {
+    char name[16];                  // name of its output ports
+    vector<int> ids;                // its tags
+    vector<Matrix3d> O_R_M;         // orientation of each tag in object frame
+    vector<Vector3d> O_p_M;         // position of each tag in object frame
+
+    // Current frame, only touched by the estimation of the bundle
+    vector<size_t> dets;            // detections of its tags
+    vector<Vector3d> X;             // their corners in object frame
+    vector<Vector2d> m;             // and in normalized image coordinates
+};
+
+// Settings of frame decoding and of the tag finder. They are copied along
+// with each frame so that the pipeline never reads them while they are
+// updated.
+struct find_options {
+    int16_t codec = 0;          // decoder of compressed frames (0: opencv; 1: jpeg)
+    bool track = false;         // restrict detection to regions around previous detections
+    float track_pad = 0.5;      // padding of regions, relative to tag size
+    uint16_t track_rescan = 10; // frames between full frame scans
+    uint16_t decimation = 1;    // decimation of frames for full frame scans
+    int16_t gray16_mode = 0;    // conversion of 16 bits frames (0: shift; 1: window)
+    uint16_t gray16_shift = 8;  // right shift of 16 bits values
+    uint16_t gray16_low = 0;    // 16 bits value mapped to 0
+    uint16_t gray16_high = 65535;   // 16 bits value mapped to 255
+    bool timing = false;        // measure the latency of stages
+
+    // Detector parameters. They are never modified once set here, new
+    // parameters are swapped in so that frames in flight keep the ones they
+    // were started with.
+    Ptr<aruco::DetectorParameters> params = aruco::DetectorParameters::create();
+
+    // Ids to detect, indexed by id, or NULL for all ids. Replaced rather than
+    // modified, like params.
+    Ptr<vector<uint8_t>> tracked;
+};
+
+// Finds tags in frames. The detections of the last frame are kept to predict
+// the regions of interest of the next one.
+struct tag_finder {
+    vector<int> ids;                    // ids of detected tags
+    vector<vector<Point2f>> corners;    // corners of detected tags in image
+    vector<uint8_t> levels;             // pyramid level that produced each detection (0: full resolution)
+
+    // Region of interest tracking
+    uint16_t since_scan = 0;    // frames since last full frame scan
+    vector<int> prev_ids;       // tags expected in the regions
+    vector<Rect> rois;          // regions of interest
+    Ptr<aruco::DetectorParameters> roi_params = aruco::DetectorParameters::create();
+    vector<int> roi_ids;
+    vector<vector<Point2f>> roi_corners;
+
+    // Multi-resolution detection
+    Mat small;                  // decimated frame
+    Mat gray;                   // grayscale frame for corner refinement
+    vector<Point2f> refined;    // corners to refine at full resolution
+
+    // Tracked id filter
+    Ptr<aruco::DetectorParameters> raw_params = aruco::DetectorParameters::create();
+    uint32_t rejected = 0;      // detections of untracked tags dropped in the last frame
+
+    void find(const Mat &frame, const Ptr<aruco::Dictionary> &dict, const find_options &opt,
+              uint16_t scale = 1);
+    void search(const Mat &frame, const Ptr<aruco::Dictionary> &dict, const find_options &opt,
+                uint16_t decimation);
+    void reject(const find_options &opt);
+    void refine(const Mat &frame, Size win, TermCriteria criteria);
+};
+
+// Decodes the luma of JPEG images, optionally downscaled by 2, 4 or 8 in the
+// DCT domain. The decoder state is kept between images. Without libjpeg,
+// decode() always fails.
+class jpeg_gray {
+public:
+    jpeg_gray();
+    ~jpeg_gray();
+    jpeg_gray(const jpeg_gray &) = delete;
+    jpeg_gray &operator=(const jpeg_gray &) = delete;
+
+    bool decode(const uint8_t *data, size_t size, uint16_t scale, Mat &out);
+
+private:
+    struct state;
+    state *s;
+};
+
+// Turns frame data into images for the tag finder. Compressed frames are
+// decoded straight from the frame data into a buffer kept between frames.
+// Uncompressed frames are wrapped without copy, so the frame data must
+// outlive the image.
+struct frame_ingest {
+    Mat decoded;        // decoded compressed frames
+    Mat converted;      // uncompressed frames converted to 8 bits grayscale
+    jpeg_gray jpeg;     // decoder of jpeg frames
+    uint16_t scale = 1; // downscaling of the last frame by the decoder
+    size_t copied = 0;  // bytes of frame data copied for the last frame
+    double time = 0;    // time spent on the last frame (s)
+
+    bool decode(const or_sensor_frame *fdata, Mat &frame, const find_options &opt);
+
+private:
+    bool convert(const or_sensor_frame *fdata, Mat &frame, const find_options &opt);
+};
+
+struct ingest_stats {
+    uint32_t frames = 0;        // frames ingested
+    size_t copied = 0;          // bytes copied for the last frame
+    uint64_t copied_total = 0;  // bytes copied for all frames
+    double time = 0;            // mean ingestion time (s), averaged over the last 100 frames
+    double time_max = 0;        // max ingestion time (s)
+
+    void add(size_t c, double t) {
+        frames++;
+        copied = c;
+        copied_total += c;
+        time += (t - time) / (frames < 100 ? frames : 100);
+        if (t > time_max) time_max = t;
+    }
+};
+
+// Runs jobs on a fixed set of threads. The calling thread takes part in
+// the work, so a pool without threads runs jobs serially.
+class worker_pool {
+public:
+    worker_pool();
+    ~worker_pool();
+
+    void resize(size_t n);
+    size_t size() const { return threads.size(); }
+
+    // Call f(i) for i in [0, n) and return when all calls are done
+    template<typename F> void run(size_t n, const F &f) {
+        if (threads.empty() || n < 2)
+            for (size_t i=0; i<n; i++) f(i);
+        else
+            dispatch(n, &call<F>, &f);
+    }
+
+private:
+    typedef void (*job_fn)(const void *, size_t);
+    template<typename F> static void call(const void *f, size_t i) {
+        (*static_cast<const F *>(f))(i);
+    }
+    void dispatch(size_t n, job_fn fn, const void *arg);
+    void work();
+    void loop();
+
+    vector<thread> threads;
+    mutex lock;
+    condition_variable wake, done;
+    job_fn fn;
+    const void *arg;
+    size_t count;               // number of calls of the current job
+    atomic<size_t> next;        // next call to run
+    size_t busy;                // threads still working on the current job
+    uint64_t generation;        // incremented for each job
+    bool quit;
+};
+
+// Tracked marker, indexed by marker id in the detector
+struct tracked_marker {
+    int16_t port = -1;  // index of the marker in ports, -1 if not tracked
+    char name[16] = ""; // name of its output ports
+    int16_t bundle = -1; // index of its bundle in the detector, -1 if none
+    uint16_t member = 0; // index of the tag in its bundle
 };
 
 struct arucotag_detector_s {
     Ptr<aruco::Dictionary> dict = aruco::getPredefinedDictionary(aruco::DICT_6X6_250); // TODO give choice of dictionary https://docs.opencv.org/4.4.0/d9/d6a/group__aruco.html#gac84398a9ed9dd01306592dd616c2c975
+    find_options opt;                   // tag finder settings
+    tag_finder finder;                  // tag finder used when the pipeline is off
+    frame_ingest ingest;                // frame decoder used when the pipeline is off
+    Mat frame;                          // current frame
+    ingest_stats ingest_info;           // frame ingestion statistics
     vector<int> ids;                    // ids of detected tags
-    Matrix<double,3,4> corners_marker;  // coordinates of corners in marker frame
-    Mat corners_marker_cv;              // opencv reprensation of corners_marker
-    vector<tag_detection> last_detections;  // previous detections
+    vector<vector<Point2f>> corners;    // corners of detected tags in image
+    vector<uint8_t> levels;             // pyramid level that produced each detection (0: full resolution)
+    tag_geometry geometry;              // geometry of tags, for the pose and its covariance
+    tag_history history;                // previous detections of tags seen on the frame port
+    uint16_t hist_size = 10;            // poses kept in history
+    uint16_t hist_age = 10;             // frames after which an unseen tag is forgotten
+    double hist_age_time = 0;           // seconds after which an unseen tag is forgotten, if positive
+
+    // Tracked markers
+    vector<tracked_marker> markers;     // sized to the dictionary, indexed by id
+    vector<uint8_t> seen;               // markers detected in current frame, indexed by port
+    bool filter = false;                // drop untracked tags in the tag finder
+    uint32_t rejected = 0;              // untracked tags dropped in the last frame
+    uint64_t rejected_total = 0;        // untracked tags dropped in all frames
+
+    // Per-tag pose estimation
+    worker_pool pool;                   // threads estimating tags concurrently
+    vector<size_t> tracked;             // detections of tracked tags in the current frame
+    vector<uint8_t> selected;           // ids estimated in the current frame, indexed by id
+    vector<tag_estimate> estimates;     // estimated poses of tracked tags
+    atomic<uint64_t> pnp_ns{0};         // time spent solving poses since the last frame, if timed
+    atomic<uint64_t> covariance_ns{0};  // time spent computing covariances since the last frame, if timed
+    or_time_ts decoded_ts = {0, 0};     // timestamp of the last frame decoded in the task
+
+    // Tag bundles
+    vector<tag_bundle> bundles;         // bundles, in order of addition
+    vector<uint16_t> bundles_seen;      // bundles with tags in the current frame
+    vector<tag_estimate> bundle_estimates;  // estimated poses of bundles_seen
+
+    // Fusion of the tags seen by several cameras
+    vector<tag_fusion> fused;           // estimates of the current round, indexed by port
+    vector<int> round_ids;              // ids of tags detected in the current round, for the log
+    vector<uint8_t> round_levels;
+
+    arucotag_detector_s() :
+        history(dict->bytesList.rows), markers(dict->bytesList.rows) {}
+
+    void age_history(tag_history &h, const or_time_ts &ts);
+
+    // Update the tracked id filter of the tag finder after a change of
+    // the tracked markers
+    void update_filter() {
+        if (!filter) {
+            opt.tracked = Ptr<vector<uint8_t>>();
+            return;
+        }
+        Ptr<vector<uint8_t>> t = makePtr<vector<uint8_t>>(markers.size());
+        for (size_t i = 0; i < markers.size(); i++)
+            (*t)[i] = markers[i].port >= 0;
+        opt.tracked = t;
+    }
+
+    // Record the tags dropped by the filter in the current frame
+    void add_rejected(uint32_t n) {
+        rejected = n;
+        rejected_total += n;
+    }
+
+    // Tracked marker with the given id, or NULL
+    const tracked_marker *marker(int id) const {
+        if (id < 0 || (size_t)id >= markers.size() || markers[id].port < 0)
+            return NULL;
+        return &markers[id];
+    }
 
     void set_length(double l) {
-        corners_marker <<
-            -1,  1,  1, -1,
-             1,  1, -1, -1,
-             0,  0,  0,  0;
-        corners_marker *= l;
+        geometry.set(l);
+    }
+};
+
+
+/* --- Pose estimation -------------------------------------------------- */
+struct body_state {
+    Vector3d W_p_B;     // position of the body in world frame
+    Matrix3d W_R_B;     // orientation of the body in world frame
+    Quaterniond W_q_B;
+    Matrix3d S_W_p_B;   // covariance of the position
+    Matrix4d S_W_q_B;   // covariance of the orientation quaternion
+};
+
+#define arucotag_estimate_batch 4   // tags estimated together
+
+void estimate_tags(arucotag_detector_s *detect, tag_history &history,
+                   const arucotag_calib_s *calib, const body_state &body,
+                   uint16_t s_pix, int16_t out_frame, size_t first, size_t n);
+void estimate_bundle(arucotag_detector_s *detect, tag_history &history,
+                     const arucotag_calib_s *calib, const body_state &body,
+                     uint16_t s_pix, int16_t out_frame, size_t k);
+
+
+/* --- Pipeline --------------------------------------------------------- */
+#define arucotag_pipeline_depth 4   // frames in flight in the pipeline
+
+struct pipeline_slot {
+    or_sensor_frame data;               // frame header, pixels point to buffer
+    vector<uint8_t> buffer;             // copy of the frame pixels
+    frame_ingest ingest;                // frame decoder of this slot
+    Mat frame;                          // decoded frame
+    bool decoded;                       // frame was decoded successfully
+    size_t copied;                      // bytes of frame data copied for this frame
+    find_options opt;                   // tag finder settings for this frame
+    vector<int> ids;                    // ids of detected tags
+    vector<vector<Point2f>> corners;    // corners of detected tags in image
+    vector<uint8_t> levels;             // pyramid level of each detection
+    uint32_t rejected;                  // untracked tags dropped
+    double detect_time;                 // time spent detecting tags (s), if timed
+};
+
+// Overlaps the decoding of frame N+1 and the detection of tags in frame N
+// with the pose estimation of frame N-1, which stays in the task thread
+// along with port accesses. Frames go through the stages in order, so
+// results are published in the order the frames were read.
+struct arucotag_pipeline_s {
+    pipeline_slot slots[arucotag_pipeline_depth];
+    vector<pipeline_slot *> idle;   // slots owned by the task thread
+
+    // Queues between stages, large enough for all slots plus the stop marker
+    spsc_queue<pipeline_slot *, 2*arucotag_pipeline_depth> to_decode, to_detect, done;
+    sem_t decode_sem, detect_sem;
+    mutable sem_t done_sem;
+    atomic<sem_t *> notify;         // also posted for each frame done, if not NULL
+
+    Ptr<aruco::Dictionary> dict;
+    tag_finder finder;              // tag finder of the detection thread
+    thread decode_thread, detect_thread;
+    bool running;
+    or_time_ts pushed;              // timestamp of the last frame pushed
+    uint32_t dropped;               // frames dropped because the pipeline was full
 
-        Matrix<double,4,3> tmp = corners_marker.transpose();
-        eigen2cv(tmp, corners_marker_cv);
+    arucotag_pipeline_s();
+    ~arucotag_pipeline_s();
+
+    void start(const Ptr<aruco::Dictionary> &d);
+    void stop();
+    bool push(const or_sensor_frame *fdata, const find_options &opt);
+    pipeline_slot *pop();
+    void release(pipeline_slot *slot);
+    bool ready() const { return done.size() > 0; }
+    bool wait(const timespec &until) const;
+
+private:
+    void decode_loop();
+    void detect_loop();
+};
+
+
+/* --- Cameras ---------------------------------------------------------- */
+#define arucotag_cameras_max 8      // cameras in addition to the frame port
+
+// A camera read from the camera_frame port of its name, in addition to the
+// frame port. Its frames always go through its own pipeline, whose threads
+// decode them and detect tags, while the poses are estimated in the task
+// with its calibration and its own history of tags.
+struct arucotag_camera {
+    char name[16];
+    arucotag_calib_s calib;
+    bool calibrated;                // calibration ports were read
+    arucotag_pipeline_s pipe;
+    tag_history history;
+    or_time_ts last_ts;             // timestamp of the last frame read
+    uint32_t frames;                // frames read
+    uint32_t processed;             // frames whose tags were published
+
+    arucotag_camera(const char *n, size_t tags) :
+        calibrated(false), history(tags), frames(0), processed(0) {
+        snprintf(name, sizeof(name), "%s", n);
+        last_ts.sec = last_ts.nsec = 0;
+    }
+};
+
+struct arucotag_cameras_s {
+    vector<unique_ptr<arucotag_camera>> list;
+    mutable sem_t done;             // posted by all the pipelines, see wait()
+
+    arucotag_cameras_s();
+    ~arucotag_cameras_s();
+
+    arucotag_camera *find(const char *name) {
+        for (auto &c : list)
+            if (!strcmp(c->name, name)) return c.get();
+        return NULL;
     }
+    // Some camera has detection results
+    bool ready() const {
+        for (auto &c : list)
+            if (c->pipe.ready()) return true;
+        return false;
+    }
+    bool wait(const arucotag_pipeline_s *pipe, const timespec &until) const;
 };
 
 
@@ -103,46 +511,305 @@ Matrix3d skew(Vector3d v)
     return skew;
 }
 
+
+/* --- Polling ---------------------------------------------------------- */
+static inline
+double ts_diff(const timespec &a, const timespec &b)
+{
+    return (a.tv_sec - b.tv_sec) + (a.tv_nsec - b.tv_nsec)*1e-9;
+}
+
 static inline
-Quaterniond cvaa2eigenquat(Vec3d r)
+double ts_elapsed(const timespec &since)
 {
-    AngleAxisd aa;
-    aa.angle() = norm(r);
-    cv2eigen(r/aa.angle(), aa.axis());
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ts_diff(now, since);
+}
 
-    return (Quaterniond) aa;
+static inline
+timespec ts_add(const timespec &a, double dt)
+{
+    timespec r;
+    int64_t ns = a.tv_nsec + (int64_t)(dt*1e9);
+    r.tv_sec = a.tv_sec + ns / 1000000000;
+    r.tv_nsec = ns % 1000000000;
+    if (r.tv_nsec < 0) { r.tv_nsec += 1000000000; r.tv_sec--; }
+    return r;
 }
 
+static inline
+void sleep_until(const timespec &t)
+{
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) == EINTR)
+        /* empty body */;
+}
+
+struct arucotag_poll_s {
+    double period;          // estimated frame period (s), 0 while unknown
+    double jitter;          // mean absolute deviation of the frame period (s)
+    uint16_t outliers;      // consecutive frame intervals rejected by the estimator
+    bool armed;             // true when a frame arrival is predicted
+    timespec wake;          // time at which to start polling for the next frame (monotonic)
+    timespec deadline;      // end of the tight polling window (monotonic)
+    timespec last_empty;    // last poll that did not find a new frame (monotonic)
+    bool empty;             // last_empty is meaningful for the next frame
+
+    uint32_t frames;        // frames received
+    uint64_t reads;         // port reads
+    uint32_t samples;       // latency samples
+    double latency;         // mean extra wake-up latency (s), averaged over the last 100 frames
+    double latency_max;     // max extra wake-up latency (s)
+
+    arucotag_poll_s() :
+        period(0), jitter(0), outliers(0), armed(false), empty(false),
+        frames(0), reads(0), samples(0), latency(0), latency_max(0) {}
+
+    // Update the frame period estimate with the timestamp difference between
+    // two consecutive frames. Intervals far from the current estimate (dropped
+    // frames, rate changes) are ignored unless they persist.
+    void update_period(double dt) {
+        if (dt <= 0 || dt > 1) return;
+        if (period == 0 || outliers > 8) {
+            period = dt;
+            jitter = 0;
+            outliers = 0;
+        } else if (dt > 0.5*period && dt < 1.5*period) {
+            jitter += (fabs(dt - period) - jitter) / 8;
+            period += (dt - period) / 8;
+            outliers = 0;
+        } else
+            outliers++;
+    }
+
+    // Record the extra latency due to polling for a frame found at time now
+    void update_latency(const timespec &now) {
+        frames++;
+        if (!empty) return;
+        double l = ts_diff(now, last_empty);
+        samples++;
+        latency += (l - latency) / (samples < 100 ? samples : 100);
+        if (l > latency_max) latency_max = l;
+        empty = false;
+    }
+};
+
+
+/* --- Timing ----------------------------------------------------------- */
+enum timing_stage {
+    timing_poll, timing_decode, timing_detect, timing_pnp, timing_covariance,
+    timing_publish, timing_log, timing_frame, timing_stages
+};
+
+// Latency of the stages of the detect task. Nothing is measured while
+// disabled.
+struct arucotag_timing_s {
+    bool enable;
+    double period;                      // publication period of the stats port (s)
+    latency_histogram stage[timing_stages];
+    timespec frame_start;               // start of the poll of the current frame
+    timespec published;                 // last publication of the stats port
+    or_time_ts ts;                      // timestamp of the last frame
+
+    arucotag_timing_s() : enable(false), period(1) {
+        frame_start.tv_sec = frame_start.tv_nsec = 0;
+        published = frame_start;
+        ts.sec = ts.nsec = 0;
+    }
+
+    void reset() {
+        for (int i = 0; i < timing_stages; i++)
+            stage[i].reset();
+    }
+
+    void add(timing_stage s, double dt) { stage[s].add(dt); }
+    void fill(arucotag_stage_latency_s *stages) const;
+};
+
 
 /* --- Log -------------------------------------------------------------- */
+#define arucotag_log_line 1024              // room for one text line, in bytes
+// smallest log ring, in bytes: a frame with all the tags of the dictionary
+#define arucotag_log_capacity_min (256*arucotag_log_line)
+#define arucotag_log_rotate_min (1<<20)     // smallest log file size when rotating
+#define arucotag_log_prealloc (16<<20)      // log file space preallocated at once
+#define arucotag_log_uring_depth 4          // io_uring fixed buffers, and writes in flight
+#define arucotag_log_uring_size (256<<10)   // size of each io_uring buffer
+
+// Entries are formatted by the task thread and handed to a writer thread
+// through a lock-free ring, so that the task never waits for the disk.
+// Entries are only missed when the ring is full. The writer thread uses
+// io_uring when available, and rotates files at a given size. Files are
+// switched between two entries, at ring positions chosen by the task.
 struct arucotag_log_s {
-    aiocb req;
-    char buffer[4096];
-    bool pending, skipped;
+    vector<char> buffer;            // entry being formatted, grown as needed
+    bool skipped;                   // entries were missed since the last one
+    bool binary;                    // fixed size records (log.hpp) instead of text
     uint32_t decimation;
     size_t missed, total;
-    arucotag_log_s() {
-        this->req.aio_fildes = -1;
-        this->req.aio_buf = this->buffer;
-    }
-    # define arucotag_logfmt	"%g "
-    # define arucotag_log_header                                            \
-        "ts frame i px py x y z qw qx qy qz roll pitch yaw sxx sxy syy sxz syz szz sqww sqwx sqxx sqwy sqxy sqyy sqwz sqxz sqyz sqzz "
-    # define arucotag_log_fmt                                               \
-        "%d.%09d %i %s "                                                    \
-        "%d %d "                                                            \
-        arucotag_logfmt arucotag_logfmt arucotag_logfmt                     \
-        arucotag_logfmt arucotag_logfmt arucotag_logfmt arucotag_logfmt     \
-        arucotag_logfmt arucotag_logfmt arucotag_logfmt                     \
-        arucotag_logfmt arucotag_logfmt arucotag_logfmt                     \
-        arucotag_logfmt arucotag_logfmt arucotag_logfmt                     \
-        arucotag_logfmt arucotag_logfmt arucotag_logfmt                     \
-        arucotag_logfmt arucotag_logfmt arucotag_logfmt                     \
-        arucotag_logfmt arucotag_logfmt arucotag_logfmt                     \
-        arucotag_logfmt
+    size_t high_water;              // largest number of bytes queued in the ring
+    bool oversized;                 // an entry larger than the ring was dropped
+
+    string path;                    // first file, the next ones get a numbered suffix
+    vector<char> header;            // written at the start of each file
+    size_t rotate;                  // file size limit, 0 for no rotation
+    size_t file_bytes;              // bytes queued for the current file
+    spsc_queue<size_t, 16> rotations;   // ring positions where a new file starts
+
+    unique_ptr<spsc_ring> ring;     // entries queued for the writer thread
+    sem_t sem;
+    thread writer;
+    atomic<bool> running;
+    atomic<bool> failed;            // the writer thread gave up after an error
+    atomic<bool> uring;             // the writer thread uses io_uring
+    atomic<uint64_t> written;       // bytes written to files
+    timespec started;               // monotonic time logging started
+
+    arucotag_log_s();
+    ~arucotag_log_s();
+
+    void start(const char *path, int fd, const vector<char> &header,
+               size_t capacity, size_t rotate);
+    void stop();
+    bool push(const char *data, size_t n);
+    double throughput() const;
+
+private:
+    void write_loop(int fd);
+};
+
+
+/* --- Record ----------------------------------------------------------- */
+
+// Records the frames read from the frame port (record.hpp). The writer
+// thread writes each frame straight from the port data, which stays valid
+// until the port is read again: fence() must be called before each read of
+// the port while recording. Only the task thread calls start(), stop(),
+// submit() and fence().
+struct arucotag_record_s {
+    int fd;
+    string path;
+    uint64_t offset;                // end of the file, owned by the writer thread
+    vector<uint64_t> index;         // offsets of the records, owned by the writer thread
+    arucotag_rec_frame header;      // frame being written
+    const uint8_t *pixels;          // pixels of the frame being written, NULL to stop
+    bool pending;                   // a frame was submitted and not waited for
+
+    sem_t request, done;
+    thread writer;
+    bool running;
+    atomic<bool> failed;            // the writer thread gave up after an error
+    atomic<uint32_t> frames;
+    atomic<uint64_t> bytes;
+    atomic<uint64_t> wait_ns, wait_max_ns;  // time spent in fence()
+
+    arucotag_record_s();
+    ~arucotag_record_s();
+
+    bool start(const char *path, int fd);
+    bool stop();
+    void submit(const or_sensor_frame *fdata);
+    void fence();
+
+private:
+    void write_loop();
+};
+
+// Read-only view of a recording, mapped in memory and indexed when opened.
+// Mapped pages are private, so frames can be handed out as port data.
+class frame_recording {
+public:
+    frame_recording() : base(NULL), length(0) {}
+    ~frame_recording() { close(); }
+
+    bool open(const char *path);
+    void close();
+
+    size_t size() const { return index.size(); }
+    const arucotag_rec_frame *header(size_t i) const {
+        return (const arucotag_rec_frame *)(base + index[i]);
+    }
+    int64_t ts_ns(size_t i) const {
+        return header(i)->sec * (int64_t)1000000000 + header(i)->nsec;
+    }
+    void frame(size_t i, or_sensor_frame *f) const;
+
+private:
+    char *base;
+    size_t length;
+    vector<uint64_t> index;
+};
+
+// Feeds a recording to the detect task in place of the frame port, at the
+// recorded speed or as fast as possible. When looping, timestamps are
+// shifted at each pass so that they keep increasing.
+struct arucotag_replay_s {
+    frame_recording rec;
+    bool active;
+    bool realtime;
+    bool loop;
+    size_t next;                    // next record
+    or_sensor_frame frame;          // current frame, pixels in the mapping
+    timespec start;                 // monotonic time of the first frame of the pass
+    int64_t shift;                  // added to recorded timestamps (ns)
+    int64_t span;                   // from the first frame of a pass to the first of the next (ns)
+    uint32_t frames;                // frames replayed
+
+    arucotag_replay_s() : active(false), realtime(true), loop(false), next(0),
+                          shift(0), span(0), frames(0) {}
+
+    bool open(const char *path, bool realtime, bool loop);
+    bool due(timespec &t) const;
+    bool advance();
 };
 
 
+/* --- Codels on ports ------------------------------------------------- */
+
+/* The codels of the detect task and the services that open ports, on
+ * arucotag_ports. The genom codels of the same name bind their port handles
+ * and call these.
+ */
+genom_event detect_wait(arucotag_ports &io, float length, arucotag_calib_s **calib,
+                        const genom_context self);
+genom_event detect_poll(arucotag_ports &io, bool stopped,
+                        const sequence_arucotag_portinfo *ports, or_time_ts *last_ts,
+                        int16_t poll_mode, arucotag_poll_s **poll,
+                        const arucotag_pipeline_s *pipe, arucotag_timing_s **timing,
+                        arucotag_record_s **record, arucotag_replay_s **replay,
+                        arucotag_cameras_s **cameras, const arucotag_detector_s *detect,
+                        const genom_context self);
+genom_event detect_main(arucotag_ports &io, uint16_t s_pix, const arucotag_calib_s *calib,
+                        arucotag_detector_s **detect,
+                        const sequence_arucotag_portinfo *ports, int16_t out_frame,
+                        bool pipeline, arucotag_pipeline_s **pipe,
+                        arucotag_timing_s **timing, const arucotag_replay_s *replay,
+                        arucotag_cameras_s **cameras, const genom_context self);
+genom_event detect_log(arucotag_ports &io, const arucotag_detector_s *detect,
+                       int16_t out_frame, arucotag_log_s **log, arucotag_timing_s **timing,
+                       const genom_context self);
+genom_event add_marker(arucotag_ports &io, const char marker[16],
+                       sequence_arucotag_portinfo *ports, arucotag_detector_s **detect,
+                       const genom_context self);
+genom_event remove_marker(arucotag_ports &io, const char marker[16],
+                          sequence_arucotag_portinfo *ports, arucotag_detector_s **detect,
+                          const genom_context self);
+genom_event add_bundle(arucotag_ports &io, const char bundle[16],
+                       const sequence_arucotag_bundle_tag_s *tags,
+                       sequence_arucotag_portinfo *ports, arucotag_detector_s **detect,
+                       arucotag_cameras_s **cameras, const genom_context self);
+genom_event remove_bundle(arucotag_ports &io, const char bundle[16],
+                          sequence_arucotag_portinfo *ports, arucotag_detector_s **detect,
+                          arucotag_cameras_s **cameras, const genom_context self);
+genom_event set_calib(arucotag_ports &io, arucotag_calib_s **calib,
+                      arucotag_cameras_s **cameras, const genom_context self);
+genom_event add_camera(arucotag_ports &io, const char camera[16],
+                       arucotag_cameras_s **cameras, const arucotag_detector_s *detect,
+                       const genom_context self);
+genom_event remove_camera(arucotag_ports &io, const char camera[16],
+                          arucotag_cameras_s **cameras, const genom_context self);
+
+
 /* --- Exception -------------------------------------------------------- */
 static inline genom_event
 arucotag_e_sys_error(const char *s, genom_context self)
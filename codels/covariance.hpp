@@ -0,0 +1,237 @@
+/*
+ * Copyright (c) 2020 LAAS/CNRS
+ * All rights reserved.
+ *
+ * Redistribution  and  use  in  source  and binary  forms,  with  or  without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * THE SOFTWARE  IS PROVIDED "AS IS"  AND THE AUTHOR  DISCLAIMS ALL WARRANTIES
+ * WITH  REGARD   TO  THIS  SOFTWARE  INCLUDING  ALL   IMPLIED  WARRANTIES  OF
+ * MERCHANTABILITY AND  FITNESS.  IN NO EVENT  SHALL THE AUTHOR  BE LIABLE FOR
+ * ANY  SPECIAL, DIRECT,  INDIRECT, OR  CONSEQUENTIAL DAMAGES  OR  ANY DAMAGES
+ * WHATSOEVER  RESULTING FROM  LOSS OF  USE, DATA  OR PROFITS,  WHETHER  IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR  OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *                                                  Martin Jacquet - June 2020
+ */
+#ifndef H_ARUCOTAG_COVARIANCE
+#define H_ARUCOTAG_COVARIANCE
+
+#include <eigen3/Eigen/Dense>
+#include <cmath>
+#include <cstddef>
+
+/* --- Pose covariance -------------------------------------------------- */
+
+/* First order propagation of the isotropic pixel noise of the four corners of
+ * a square tag to the covariance of its pose, see Sec. VI.B in
+ * [Jacquet 2020] (10.1109/LRA.2020.3045654):
+ *
+ *   cov = s_pix^2 (J^T J)^-1
+ *
+ * where J (8x6) stacks the Jacobians of the projection of each corner wrt the
+ * translation and the rotation (in tangent space) of the tag.
+ *
+ * The corners are at l*(a_i, b_i, 0) with a_i, b_i = +-1 in the tag frame, so
+ * that the rotation part of J reduces to a few products of the columns of
+ * (pixellization * K * R), and J^T J is accumulated in place. J^T J is
+ * factorized with Cholesky, and only the diagonal blocks of its inverse are
+ * formed. Cross (pos/rot) covariance is neglected.
+ *
+ * The kernel is written for a generic scalar type T, either double for one
+ * tag or Eigen::Array4d for four tags in SIMD lanes. It does not allocate.
+ */
+
+// Geometry of a square tag, depends only on its length
+struct tag_geometry {
+    double l;           // half side length
+    double a[4], b[4];  // corners in tag frame, in the order of the detector
+
+    tag_geometry() { set(0); }
+
+    void set(double half) {
+        static const double sa[4] = { -1,  1,  1, -1 };
+        static const double sb[4] = {  1,  1, -1, -1 };
+        l = half;
+        for (int i = 0; i < 4; i++) {
+            a[i] = l * sa[i];
+            b[i] = l * sb[i];
+        }
+    }
+};
+
+namespace cov_detail {
+
+inline double inv(double x) { return 1. / x; }
+inline double root(double x) { return std::sqrt(x); }
+inline double splat(double x, double) { return x; }
+
+inline Eigen::Array4d inv(const Eigen::Array4d &x) { return x.inverse(); }
+inline Eigen::Array4d root(const Eigen::Array4d &x) { return x.sqrt(); }
+inline Eigen::Array4d splat(double x, const Eigen::Array4d &) { return Eigen::Array4d::Constant(x); }
+
+}
+
+/* Covariance of the position and rotation of tags at (R, t) in camera frame.
+ * R is row major, outputs are the upper triangles of symmetric matrices in
+ * the order xx, xy, xz, yy, yz, zz.
+ */
+template<typename T>
+void
+pose_covariance(const tag_geometry &g, const Eigen::Matrix3d &K, double s_pix,
+                const T R[9], const T t[3], T cov_pos[6], T cov_rot[6])
+{
+    using namespace cov_detail;
+    const double fx = K(0,0), sk = K(0,1), cx = K(0,2), fy = K(1,1), cy = K(1,2);
+    const T zero = splat(0, t[0]);
+
+    // Upper triangle of J^T J, row major
+    T H[6][6];
+    for (int i = 0; i < 6; i++)
+        for (int j = i; j < 6; j++)
+            H[i][j] = zero;
+
+    for (int c = 0; c < 4; c++)
+    {
+        const double a = g.a[c], b = g.b[c];
+
+        // Corner in camera frame, and in homogeneous pixel coordinates
+        T p0 = a*R[0] + b*R[1] + t[0];
+        T p1 = a*R[3] + b*R[4] + t[1];
+        T p2 = a*R[6] + b*R[7] + t[2];
+        T h0 = fx*p0 + sk*p1 + cx*p2;
+        T h1 = fy*p1 + cy*p2;
+        T iz = inv(p2);
+        T iz2 = iz*iz;
+
+        // A = J_pix * K, the Jacobian wrt translation
+        T A[2][3] = {
+            { fx*iz, sk*iz, cx*iz - h0*iz2 },
+            { zero,  fy*iz, cy*iz - h1*iz2 },
+        };
+
+        for (int r = 0; r < 2; r++)
+        {
+            // C = A * R, the Jacobian wrt rotation is -C * skew(m) with
+            // m = (a, b, 0)
+            T C0 = A[r][0]*R[0] + A[r][1]*R[3] + A[r][2]*R[6];
+            T C1 = A[r][0]*R[1] + A[r][1]*R[4] + A[r][2]*R[7];
+            T C2 = A[r][0]*R[2] + A[r][1]*R[5] + A[r][2]*R[8];
+            T J[6] = { A[r][0], A[r][1], A[r][2], b*C2, -a*C2, a*C1 - b*C0 };
+
+            for (int i = 0; i < 6; i++)
+                for (int j = i; j < 6; j++)
+                    H[i][j] += J[i]*J[j];
+        }
+    }
+
+    // Cholesky factorization H = L L^T, L stored in the lower triangle
+    T L[6][6];
+    for (int j = 0; j < 6; j++)
+    {
+        T d = H[j][j];
+        for (int k = 0; k < j; k++)
+            d -= L[j][k]*L[j][k];
+        L[j][j] = root(d);
+        T id = inv(L[j][j]);
+        for (int i = j+1; i < 6; i++)
+        {
+            T s = H[j][i];
+            for (int k = 0; k < j; k++)
+                s -= L[i][k]*L[j][k];
+            L[i][j] = s*id;
+        }
+    }
+
+    // W = L^-1, lower triangular
+    T W[6][6];
+    for (int i = 0; i < 6; i++)
+    {
+        W[i][i] = inv(L[i][i]);
+        for (int j = 0; j < i; j++)
+        {
+            T s = zero;
+            for (int k = j; k < i; k++)
+                s -= L[i][k]*W[k][j];
+            W[i][j] = s*W[i][i];
+        }
+    }
+
+    // Diagonal blocks of H^-1 = W^T W
+    const double s2 = s_pix*s_pix;
+    int n = 0;
+    for (int i = 0; i < 3; i++)
+        for (int j = i; j < 3; j++, n++)
+        {
+            T sp = zero, sr = zero;
+            for (int k = j; k < 6; k++)
+                sp += W[k][i]*W[k][j];
+            for (int k = j+3; k < 6; k++)
+                sr += W[k][i+3]*W[k][j+3];
+            cov_pos[n] = s2*sp;
+            cov_rot[n] = s2*sr;
+        }
+}
+
+
+/* Covariance of the position and rotation of n tags at (q[i], t[i]) in
+ * camera frame. Tags are processed four at a time.
+ */
+inline void
+pose_covariance(const tag_geometry &g, const Eigen::Matrix3d &K, double s_pix,
+                size_t n, const Eigen::Quaterniond *q, const Eigen::Vector3d *t,
+                Eigen::Matrix3d *cov_pos, Eigen::Matrix3d *cov_rot)
+{
+    using Eigen::Array4d;
+    static const int ij[6][2] = { {0,0}, {0,1}, {0,2}, {1,1}, {1,2}, {2,2} };
+
+    size_t i = 0;
+    for (; i < n && n - i > 1; i += 4)
+    {
+        // Load up to four tags in lanes, repeating the last one if needed
+        Array4d R[9], tv[3], cp[6], cr[6];
+        for (int l = 0; l < 4; l++)
+        {
+            size_t k = i + l < n ? i + l : n - 1;
+            Eigen::Matrix3d Rk = q[k].toRotationMatrix();
+            for (int e = 0; e < 9; e++)
+                R[e][l] = Rk(e / 3, e % 3);
+            for (int e = 0; e < 3; e++)
+                tv[e][l] = t[k](e);
+        }
+
+        pose_covariance<Array4d>(g, K, s_pix, R, tv, cp, cr);
+
+        for (int l = 0; l < 4 && i + l < n; l++)
+            for (int e = 0; e < 6; e++)
+            {
+                cov_pos[i+l](ij[e][0], ij[e][1]) = cov_pos[i+l](ij[e][1], ij[e][0]) = cp[e][l];
+                cov_rot[i+l](ij[e][0], ij[e][1]) = cov_rot[i+l](ij[e][1], ij[e][0]) = cr[e][l];
+            }
+    }
+
+    for (; i < n; i++)
+    {
+        Eigen::Matrix3d Rk = q[i].toRotationMatrix();
+        double R[9], tv[3] = { t[i](0), t[i](1), t[i](2) }, cp[6], cr[6];
+        for (int e = 0; e < 9; e++)
+            R[e] = Rk(e / 3, e % 3);
+
+        pose_covariance<double>(g, K, s_pix, R, tv, cp, cr);
+
+        for (int e = 0; e < 6; e++)
+        {
+            cov_pos[i](ij[e][0], ij[e][1]) = cov_pos[i](ij[e][1], ij[e][0]) = cp[e];
+            cov_rot[i](ij[e][0], ij[e][1]) = cov_rot[i](ij[e][1], ij[e][0]) = cr[e];
+        }
+    }
+}
+
+#endif /* H_ARUCOTAG_COVARIANCE */
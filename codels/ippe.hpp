@@ -0,0 +1,264 @@
+/*
+ * Copyright (c) 2020 LAAS/CNRS
+ * All rights reserved.
+ *
+ * Redistribution  and  use  in  source  and binary  forms,  with  or  without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * THE SOFTWARE  IS PROVIDED "AS IS"  AND THE AUTHOR  DISCLAIMS ALL WARRANTIES
+ * WITH  REGARD   TO  THIS  SOFTWARE  INCLUDING  ALL   IMPLIED  WARRANTIES  OF
+ * MERCHANTABILITY AND  FITNESS.  IN NO EVENT  SHALL THE AUTHOR  BE LIABLE FOR
+ * ANY  SPECIAL, DIRECT,  INDIRECT, OR  CONSEQUENTIAL DAMAGES  OR  ANY DAMAGES
+ * WHATSOEVER  RESULTING FROM  LOSS OF  USE, DATA  OR PROFITS,  WHETHER  IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR  OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *                                                  Martin Jacquet - June 2020
+ */
+#ifndef H_ARUCOTAG_IPPE
+#define H_ARUCOTAG_IPPE
+
+#include <eigen3/Eigen/Dense>
+#include <cmath>
+#include <limits>
+
+/* --- Square tag PnP --------------------------------------------------- */
+
+/* Infinitesimal Plane-based Pose Estimation [Collins 2014]
+ * (10.1007/s11263-014-0725-5) of a square tag from its four corners in
+ * image, as SOLVEPNP_IPPE_SQUARE in opencv:
+ *
+ *  - the corners are undistorted to normalized image coordinates,
+ *  - the homography H from the tag plane to the image is computed in closed
+ *    form from the four correspondences,
+ *  - the two rotations that agree with the Jacobian of H at the center of
+ *    the tag are computed, and the translation of each is the least squares
+ *    solution given the rotation.
+ *
+ * The corners of the tag are at l*(-1,1), l*(1,1), l*(1,-1), l*(-1,-1) in
+ * the tag frame, in this order. Everything is done on fixed size types, the
+ * solver does not allocate.
+ */
+
+// Pinhole camera with radial and tangential distortion, skew is ignored
+struct ippe_camera {
+    double fx, fy, cx, cy;
+    double d[5];    // distortion coefs, as read by opencv (k1, k2, p1, p2, k3)
+
+    ippe_camera() : fx(1), fy(1), cx(0), cy(0), d{0, 0, 0, 0, 0} {}
+};
+
+// Pose of a tag in camera frame
+struct ippe_pose {
+    Eigen::Quaterniond q;   // orientation
+    Eigen::Vector3d t;      // position
+    double error;           // rms reprojection error, in pixels
+};
+
+namespace ippe_detail {
+
+/* Normalized coordinates of pixel (u, v), with the same fixed point
+ * iterations as cv::undistortPoints. */
+inline Eigen::Vector2d
+undistort(const ippe_camera &c, double u, double v)
+{
+    const double *k = c.d;
+    double x0 = (u - c.cx) / c.fx, y0 = (v - c.cy) / c.fy;
+    double x = x0, y = y0;
+    for (int i = 0; i < 5; i++)
+    {
+        double r2 = x*x + y*y;
+        double icdist = 1. / (1 + ((k[4]*r2 + k[1])*r2 + k[0])*r2);
+        if (icdist < 0)
+            return Eigen::Vector2d(x0, y0);
+        double dx = 2*k[2]*x*y + k[3]*(r2 + 2*x*x);
+        double dy = k[2]*(r2 + 2*y*y) + 2*k[3]*x*y;
+        x = (x0 - dx) * icdist;
+        y = (y0 - dy) * icdist;
+    }
+    return Eigen::Vector2d(x, y);
+}
+
+/* Pixel coordinates of the point p in camera frame. */
+inline Eigen::Vector2d
+project(const ippe_camera &c, const Eigen::Vector3d &p)
+{
+    const double *k = c.d;
+    double x = p(0) / p(2), y = p(1) / p(2);
+    double r2 = x*x + y*y;
+    double radial = 1 + ((k[4]*r2 + k[1])*r2 + k[0])*r2;
+    double xd = x*radial + 2*k[2]*x*y + k[3]*(r2 + 2*x*x);
+    double yd = y*radial + k[2]*(r2 + 2*y*y) + 2*k[3]*x*y;
+    return Eigen::Vector2d(c.fx*xd + c.cx, c.fy*yd + c.cy);
+}
+
+/* Homography from the tag plane to the normalized image plane, with
+ * H(2,2) = 1. This is the unit square to quad mapping of [Heckbert 1989],
+ * composed with the mapping of the tag to the unit square. Returns false if
+ * the quad is degenerate.
+ */
+inline bool
+homography(double l, const Eigen::Vector2d m[4], Eigen::Matrix3d &H)
+{
+    double sx = m[0](0) - m[1](0) + m[2](0) - m[3](0);
+    double sy = m[0](1) - m[1](1) + m[2](1) - m[3](1);
+    double dx1 = m[1](0) - m[2](0), dx2 = m[3](0) - m[2](0);
+    double dy1 = m[1](1) - m[2](1), dy2 = m[3](1) - m[2](1);
+    double den = dx1*dy2 - dx2*dy1;
+    if (std::fabs(den) < std::numeric_limits<double>::epsilon())
+        return false;
+
+    double g = (sx*dy2 - dx2*sy) / den;
+    double h = (dx1*sy - sx*dy1) / den;
+    Eigen::Matrix3d Q;
+    Q << m[1](0) - m[0](0) + g*m[1](0), m[3](0) - m[0](0) + h*m[3](0), m[0](0),
+         m[1](1) - m[0](1) + g*m[1](1), m[3](1) - m[0](1) + h*m[3](1), m[0](1),
+         g,                             h,                             1;
+
+    // (x, y) in the tag plane to (u, v) in the unit square
+    Eigen::Matrix3d S;
+    S << 0.5/l, 0,      0.5,
+         0,     -0.5/l, 0.5,
+         0,     0,      1;
+    H = Q * S;
+    H /= H(2,2);
+    return true;
+}
+
+/* The two rotations whose projection agrees to first order with H at the
+ * center of the tag. Returns false if H is degenerate. */
+inline bool
+rotations(const Eigen::Matrix3d &H, Eigen::Matrix3d R[2])
+{
+    // Jacobian of H at the origin, which projects on v = (p, q, 1)
+    double p = H(0,2), q = H(1,2);
+    Eigen::Matrix2d J;
+    J << H(0,0) - H(2,0)*p, H(0,1) - H(2,1)*p,
+         H(1,0) - H(2,0)*q, H(1,1) - H(2,1)*q;
+
+    // Rv is the smallest rotation taking z to v/|v|
+    Eigen::Vector3d v = Eigen::Vector3d(p, q, 1).normalized();
+    double d = 1. / (1. + v(2));
+    Eigen::Matrix3d Rv;
+    Rv << 1 - v(0)*v(0)*d, -v(0)*v(1)*d,    v(0),
+          -v(0)*v(1)*d,    1 - v(1)*v(1)*d, v(1),
+          -v(0),           -v(1),           v(2);
+
+    // J = B A / z with A the upper 2x2 block of Rv^T R
+    Eigen::Matrix2d B;
+    B << Rv(0,0) - p*Rv(2,0), Rv(0,1) - p*Rv(2,1),
+         Rv(1,0) - q*Rv(2,0), Rv(1,1) - q*Rv(2,1);
+    Eigen::Matrix2d A = B.inverse() * J;
+
+    // The largest singular value of A is 1/z
+    double a00 = A.row(0).squaredNorm(), a11 = A.row(1).squaredNorm();
+    double a01 = A.row(0).dot(A.row(1));
+    double gamma2 = 0.5 * (a00 + a11 + std::sqrt((a00 - a11)*(a00 - a11) + 4*a01*a01));
+    if (!(gamma2 > std::numeric_limits<float>::epsilon()))
+        return false;
+    A /= std::sqrt(gamma2);
+
+    // Complete the first two columns to unit length, the sign of the last
+    // row gives the two solutions
+    double b0 = std::sqrt(std::max(0., 1 - A.col(0).squaredNorm()));
+    double b1 = std::sqrt(std::max(0., 1 - A.col(1).squaredNorm()));
+    if (A.col(0).dot(A.col(1)) > 0)
+        b1 = -b1;
+
+    for (int s = 0; s < 2; s++, b0 = -b0, b1 = -b1)
+    {
+        Eigen::Matrix3d M;
+        M.block<2,2>(0,0) = A;
+        M(2,0) = b0;
+        M(2,1) = b1;
+        M.col(2) = M.col(0).cross(M.col(1));
+        R[s] = Rv * M;
+    }
+    return true;
+}
+
+/* Least squares translation of the tag given its rotation R, from the
+ * normalized coordinates m of its corners. */
+inline Eigen::Vector3d
+translation(double l, const Eigen::Vector2d m[4], const Eigen::Matrix3d &R)
+{
+    static const double a[4] = { -1,  1,  1, -1 }, b[4] = { 1,  1, -1, -1 };
+
+    // Normal equations of [1 0 -u; 0 1 -v] t = [u rz - rx; v rz - ry]
+    Eigen::Matrix3d N = Eigen::Matrix3d::Zero();
+    Eigen::Vector3d r = Eigen::Vector3d::Zero();
+    for (int i = 0; i < 4; i++)
+    {
+        Eigen::Vector3d c = l * (a[i]*R.col(0) + b[i]*R.col(1));
+        double u = m[i](0), v = m[i](1);
+        double bx = u*c(2) - c(0), by = v*c(2) - c(1);
+        N(0,2) -= u;
+        N(1,2) -= v;
+        N(2,2) += u*u + v*v;
+        r(0) += bx;
+        r(1) += by;
+        r(2) -= u*bx + v*by;
+    }
+    N(0,0) = N(1,1) = 4;
+    N(2,0) = N(0,2);
+    N(2,1) = N(1,2);
+    return N.inverse() * r;
+}
+
+}
+
+/* Solve the pose of the square tag of half side length l from the pixel
+ * coordinates of its corners (any type with x and y members).
+ *
+ * The solutions are sorted by increasing reprojection error in normalized
+ * image coordinates, as in opencv. Returns the number of valid solutions,
+ * 0 if the corners are degenerate.
+ */
+template<typename P>
+int
+ippe_square(const ippe_camera &cam, double l, const P *corners, ippe_pose pose[2])
+{
+    using namespace ippe_detail;
+    static const double a[4] = { -1,  1,  1, -1 }, b[4] = { 1,  1, -1, -1 };
+
+    Eigen::Vector2d m[4];
+    for (int i = 0; i < 4; i++)
+        m[i] = undistort(cam, corners[i].x, corners[i].y);
+
+    Eigen::Matrix3d H, R[2];
+    if (!homography(l, m, H) || !rotations(H, R))
+        return 0;
+
+    double err[2];
+    int n = 0;
+    for (int s = 0; s < 2; s++)
+    {
+        Eigen::Vector3d t = translation(l, m, R[s]);
+        double e = 0, e_pix = 0;
+        for (int i = 0; i < 4; i++)
+        {
+            Eigen::Vector3d c = l * (a[i]*R[s].col(0) + b[i]*R[s].col(1)) + t;
+            e += (c.head<2>() / c(2) - m[i]).squaredNorm();
+            e_pix += (project(cam, c) - Eigen::Vector2d(corners[i].x, corners[i].y)).squaredNorm();
+        }
+        if (!std::isfinite(e) || !t.allFinite())
+            continue;
+
+        pose[n].q = Eigen::Quaterniond(R[s]);
+        pose[n].t = t;
+        pose[n].error = std::sqrt(e_pix / 8);
+        err[n++] = e;
+    }
+
+    if (n == 2 && err[1] < err[0])
+        std::swap(pose[0], pose[1]);
+    return n;
+}
+
+#endif /* H_ARUCOTAG_IPPE */
@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2020 LAAS/CNRS
+ * All rights reserved.
+ *
+ * Redistribution  and  use  in  source  and binary  forms,  with  or  without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * THE SOFTWARE  IS PROVIDED "AS IS"  AND THE AUTHOR  DISCLAIMS ALL WARRANTIES
+ * WITH  REGARD   TO  THIS  SOFTWARE  INCLUDING  ALL   IMPLIED  WARRANTIES  OF
+ * MERCHANTABILITY AND  FITNESS.  IN NO EVENT  SHALL THE AUTHOR  BE LIABLE FOR
+ * ANY  SPECIAL, DIRECT,  INDIRECT, OR  CONSEQUENTIAL DAMAGES  OR  ANY DAMAGES
+ * WHATSOEVER  RESULTING FROM  LOSS OF  USE, DATA  OR PROFITS,  WHETHER  IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR  OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *                                                  Martin Jacquet - June 2020
+ */
+#ifndef H_ARUCOTAG_LATENCY
+#define H_ARUCOTAG_LATENCY
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+/* --- Latency histogram ------------------------------------------------ */
+
+/* Histogram of durations on a log scale, with 8 linear bins per octave from
+ * 1us to about 16s. Percentiles are the upper edge of their bin, so they
+ * overestimate by at most 12.5% (at the bottom of an octave). Adding a sample
+ * is a few operations and does not allocate.
+ */
+class latency_histogram {
+public:
+    static const int octaves = 24;
+    static const int steps = 8;     // bins per octave
+    static const int bins = octaves * steps;
+
+    latency_histogram() { reset(); }
+
+    void reset() {
+        n = 0;
+        sum = hi = 0;
+        lo = HUGE_VAL;
+        memset(h, 0, sizeof(h));
+    }
+
+    // Add a duration, in seconds
+    void add(double s) {
+        n++;
+        sum += s;
+        if (s < lo) lo = s;
+        if (s > hi) hi = s;
+        h[bin(s)]++;
+    }
+
+    uint64_t count() const { return n; }
+    double min() const { return n ? lo : 0; }
+    double max() const { return hi; }
+    double mean() const { return n ? sum / n : 0; }
+
+    // Duration below which a fraction p of the samples lie, within the
+    // resolution of the bins
+    double percentile(double p) const {
+        if (!n) return 0;
+        uint64_t rank = (uint64_t)ceil(p * n), c = 0;
+        if (rank < 1) rank = 1;
+        for (int i = 0; i < bins; i++)
+            if ((c += h[i]) >= rank) {
+                double edge = ldexp(1. + (double)(i % steps + 1) / steps, i / steps) * 1e-6;
+                return edge < lo ? lo : edge > hi ? hi : edge;
+            }
+        return hi;
+    }
+
+private:
+    uint64_t n;
+    double sum, lo, hi;
+    uint32_t h[bins];
+
+    // Bin i covers [2^o (1 + k/steps), 2^o (1 + (k+1)/steps)) us, with
+    // o = i / steps and k = i % steps
+    static int bin(double s) {
+        double us = s * 1e6;
+        if (!(us >= 1)) return 0;
+        int e;
+        double m = frexp(us, &e);   // us = m 2^e, m in [0.5, 1)
+        int i = (e - 1) * steps + (int)((2*m - 1) * steps);
+        return i < bins ? i : bins - 1;
+    }
+};
+
+#endif /* H_ARUCOTAG_LATENCY */
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2020 LAAS/CNRS
+ * All rights reserved.
+ *
+ * Redistribution  and  use  in  source  and binary  forms,  with  or  without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * THE SOFTWARE  IS PROVIDED "AS IS"  AND THE AUTHOR  DISCLAIMS ALL WARRANTIES
+ * WITH  REGARD   TO  THIS  SOFTWARE  INCLUDING  ALL   IMPLIED  WARRANTIES  OF
+ * MERCHANTABILITY AND  FITNESS.  IN NO EVENT  SHALL THE AUTHOR  BE LIABLE FOR
+ * ANY  SPECIAL, DIRECT,  INDIRECT, OR  CONSEQUENTIAL DAMAGES  OR  ANY DAMAGES
+ * WHATSOEVER  RESULTING FROM  LOSS OF  USE, DATA  OR PROFITS,  WHETHER  IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR  OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *                                                  Martin Jacquet - June 2020
+ */
+#ifndef H_ARUCOTAG_LOG
+#define H_ARUCOTAG_LOG
+
+#include <stdint.h>
+
+/* --- Log format ------------------------------------------------------- */
+
+/* Text logs have one line per tag, with the columns of arucotag_log_header.
+ * An empty line marks missed entries. The pyramid level of detections is only
+ * in binary logs, the text columns are unchanged.
+ */
+#define arucotag_logfmt	"%g "
+#define arucotag_log_header                                             \
+    "ts frame i px py x y z qw qx qy qz roll pitch yaw sxx sxy syy sxz syz szz sqww sqwx sqxx sqwy sqxy sqyy sqwz sqxz sqyz sqzz "
+#define arucotag_log_fmt                                                \
+    "%d.%09d %i %s "                                                    \
+    "%d %d "                                                            \
+    arucotag_logfmt arucotag_logfmt arucotag_logfmt                     \
+    arucotag_logfmt arucotag_logfmt arucotag_logfmt arucotag_logfmt     \
+    arucotag_logfmt arucotag_logfmt arucotag_logfmt                     \
+    arucotag_logfmt arucotag_logfmt arucotag_logfmt                     \
+    arucotag_logfmt arucotag_logfmt arucotag_logfmt                     \
+    arucotag_logfmt arucotag_logfmt arucotag_logfmt                     \
+    arucotag_logfmt arucotag_logfmt arucotag_logfmt                     \
+    arucotag_logfmt arucotag_logfmt arucotag_logfmt                     \
+    arucotag_logfmt
+
+/* Binary logs start with an arucotag_log_file header, followed by one
+ * arucotag_log_frame record per logged frame, each followed by count
+ * arucotag_log_tag records. Records have a fixed layout without implicit
+ * padding, in host byte order. The Euler angles are not stored, they are
+ * computed by the arucotag-log2txt converter.
+ */
+#define arucotag_log_magic	"arucolog"
+#define arucotag_log_version	1
+
+struct arucotag_log_file {
+    char magic[8];          // arucotag_log_magic, not NUL terminated
+    uint16_t version;       // arucotag_log_version
+    uint16_t frame_size;    // sizeof(arucotag_log_frame)
+    uint16_t tag_size;      // sizeof(arucotag_log_tag)
+    uint16_t pad;
+};
+
+struct arucotag_log_frame {
+    int32_t sec, nsec;      // timestamp of the frame
+    int16_t frame;          // frame of the poses (0: camera; 1: body; 2: world)
+    uint16_t count;         // number of tag records that follow
+    uint8_t skipped;        // entries were missed before this one
+    uint8_t pad[3];
+};
+
+struct arucotag_log_tag {
+    char id[16];            // marker name, NUL padded
+    double pos[3];          // x y z
+    double att[4];          // qw qx qy qz
+    double pos_cov[6];      // upper triangle, as in or_t3d_pos_cov
+    double att_cov[10];     // upper triangle, as in or_t3d_att_cov
+    uint16_t px, py;        // center of the tag in image
+    uint8_t level;          // pyramid level of the detection
+    uint8_t pad[3];
+};
+
+static_assert(sizeof(arucotag_log_file) == 16, "arucotag_log_file layout");
+static_assert(sizeof(arucotag_log_frame) == 16, "arucotag_log_frame layout");
+static_assert(sizeof(arucotag_log_tag) == 208, "arucotag_log_tag layout");
+
+#endif /* H_ARUCOTAG_LOG */
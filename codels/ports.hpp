@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2020 LAAS/CNRS
+ * All rights reserved.
+ *
+ * Redistribution  and  use  in  source  and binary  forms,  with  or  without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * THE SOFTWARE  IS PROVIDED "AS IS"  AND THE AUTHOR  DISCLAIMS ALL WARRANTIES
+ * WITH  REGARD   TO  THIS  SOFTWARE  INCLUDING  ALL   IMPLIED  WARRANTIES  OF
+ * MERCHANTABILITY AND  FITNESS.  IN NO EVENT  SHALL THE AUTHOR  BE LIABLE FOR
+ * ANY  SPECIAL, DIRECT,  INDIRECT, OR  CONSEQUENTIAL DAMAGES  OR  ANY DAMAGES
+ * WHATSOEVER  RESULTING FROM  LOSS OF  USE, DATA  OR PROFITS,  WHETHER  IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR  OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *                                                  Martin Jacquet - June 2020
+ */
+#ifndef H_ARUCOTAG_PORTS
+#define H_ARUCOTAG_PORTS
+
+#include "arucotag_c_types.h"
+
+#include <functional>
+#include <string>
+#include <unordered_map>
+
+/* --- Ports ------------------------------------------------------------ */
+
+/* Ports of the component, as used by the codels of the detect task and the
+ * services that open and close them. The codels take this interface rather
+ * than genom port handles, so that they run the same against the genom
+ * ports or against memory.
+ *
+ * Inputs are read by read_*(), which return NULL if the port cannot be read.
+ * frame() is the data of the last read. Outputs are per marker: data is
+ * filled in place, then written. Cameras other than the frame port have
+ * their frame and calibration inputs opened under their name.
+ */
+class arucotag_ports {
+public:
+    virtual ~arucotag_ports() {}
+
+    virtual const or_sensor_frame *read_frame() = 0;
+    virtual const or_sensor_frame *frame() = 0;
+    virtual const or_pose_estimator_state *read_drone() = 0;
+    virtual const or_sensor_intrinsics *read_intrinsics() = 0;
+    virtual const or_sensor_extrinsics *read_extrinsics() = 0;
+
+    virtual bool open_camera(const char *camera) = 0;
+    virtual void close_camera(const char *camera) = 0;
+    virtual const or_sensor_frame *read_camera(const char *camera) = 0;
+    virtual const or_sensor_intrinsics *read_camera_intrinsics(const char *camera) = 0;
+    virtual const or_sensor_extrinsics *read_camera_extrinsics(const char *camera) = 0;
+
+    virtual bool open(const char *marker) = 0;
+    virtual void close(const char *marker) = 0;
+    virtual or_pose_estimator_state *pose(const char *marker) = 0;
+    virtual or_sensor_pixel *pixel_pose(const char *marker) = 0;
+    virtual void write_pose(const char *marker) = 0;
+    virtual void write_pixel_pose(const char *marker) = 0;
+
+    virtual arucotag_stage_latency_s *stats() = 0;
+    virtual void write_stats() = 0;
+};
+
+
+/* The genom ports. A codel binds the handles it is given and NULL for the
+ * others, which must not be used. The camera inputs are bound separately.
+ */
+class arucotag_genom_ports : public arucotag_ports {
+public:
+    arucotag_genom_ports(const arucotag_frame *frame, const arucotag_drone *drone,
+                         const arucotag_intrinsics *intrinsics,
+                         const arucotag_extrinsics *extrinsics,
+                         const arucotag_pose *pose, const arucotag_pixel_pose *pixel_pose,
+                         const arucotag_stats *stats, genom_context self) :
+        frame_port(frame), drone_port(drone), intrinsics_port(intrinsics),
+        extrinsics_port(extrinsics), pose_port(pose), pixel_pose_port(pixel_pose),
+        stats_port(stats), camera_port(NULL), camera_intrinsics_port(NULL),
+        camera_extrinsics_port(NULL), self(self) {}
+
+    void bind_cameras(const arucotag_camera_frame *frame,
+                      const arucotag_camera_intrinsics *intrinsics,
+                      const arucotag_camera_extrinsics *extrinsics) {
+        camera_port = frame;
+        camera_intrinsics_port = intrinsics;
+        camera_extrinsics_port = extrinsics;
+    }
+
+    const or_sensor_frame *read_frame() {
+        if (frame_port->read(self) != genom_ok) return NULL;
+        return frame_port->data(self);
+    }
+    const or_sensor_frame *frame() { return frame_port->data(self); }
+    const or_pose_estimator_state *read_drone() {
+        if (drone_port->read(self) != genom_ok) return NULL;
+        return drone_port->data(self);
+    }
+    const or_sensor_intrinsics *read_intrinsics() {
+        if (intrinsics_port->read(self) != genom_ok) return NULL;
+        return intrinsics_port->data(self);
+    }
+    const or_sensor_extrinsics *read_extrinsics() {
+        if (extrinsics_port->read(self) != genom_ok) return NULL;
+        return extrinsics_port->data(self);
+    }
+
+    bool open_camera(const char *camera) {
+        return camera_port->open(camera, self) == genom_ok &&
+            camera_intrinsics_port->open(camera, self) == genom_ok &&
+            camera_extrinsics_port->open(camera, self) == genom_ok;
+    }
+    void close_camera(const char *camera) {
+        camera_port->close(camera, self);
+        camera_intrinsics_port->close(camera, self);
+        camera_extrinsics_port->close(camera, self);
+    }
+    const or_sensor_frame *read_camera(const char *camera) {
+        if (camera_port->read(camera, self) != genom_ok) return NULL;
+        return camera_port->data(camera, self);
+    }
+    const or_sensor_intrinsics *read_camera_intrinsics(const char *camera) {
+        if (camera_intrinsics_port->read(camera, self) != genom_ok) return NULL;
+        return camera_intrinsics_port->data(camera, self);
+    }
+    const or_sensor_extrinsics *read_camera_extrinsics(const char *camera) {
+        if (camera_extrinsics_port->read(camera, self) != genom_ok) return NULL;
+        return camera_extrinsics_port->data(camera, self);
+    }
+
+    bool open(const char *marker) {
+        return pixel_pose_port->open(marker, self) == genom_ok &&
+            pose_port->open(marker, self) == genom_ok;
+    }
+    void close(const char *marker) {
+        pixel_pose_port->close(marker, self);
+        pose_port->close(marker, self);
+    }
+    or_pose_estimator_state *pose(const char *marker) { return pose_port->data(marker, self); }
+    or_sensor_pixel *pixel_pose(const char *marker) { return pixel_pose_port->data(marker, self); }
+    void write_pose(const char *marker) { pose_port->write(marker, self); }
+    void write_pixel_pose(const char *marker) { pixel_pose_port->write(marker, self); }
+
+    arucotag_stage_latency_s *stats() { return stats_port->data(self); }
+    void write_stats() { stats_port->write(self); }
+
+private:
+    const arucotag_frame *frame_port;
+    const arucotag_drone *drone_port;
+    const arucotag_intrinsics *intrinsics_port;
+    const arucotag_extrinsics *extrinsics_port;
+    const arucotag_pose *pose_port;
+    const arucotag_pixel_pose *pixel_pose_port;
+    const arucotag_stats *stats_port;
+    const arucotag_camera_frame *camera_port;
+    const arucotag_camera_intrinsics *camera_intrinsics_port;
+    const arucotag_camera_extrinsics *camera_extrinsics_port;
+    genom_context self;
+};
+
+
+/* Ports in memory, for running the codels without a genom server. Inputs
+ * are set by the caller: input_frame is served as is, and drone, intrinsics
+ * and extrinsics are readable only if their flag is set, as are the inputs
+ * of each camera once opened. Outputs are kept
+ * in maps, so that accessing them costs a lookup as with genom. on_pose, if
+ * set, sees every pose written.
+ */
+class arucotag_memory_ports : public arucotag_ports {
+public:
+    const or_sensor_frame *input_frame;
+    or_pose_estimator_state drone;
+    or_sensor_intrinsics intrinsics;
+    or_sensor_extrinsics extrinsics;
+    bool has_drone, has_calib;
+
+    struct camera_input {
+        const or_sensor_frame *frame;
+        or_sensor_intrinsics intrinsics;
+        or_sensor_extrinsics extrinsics;
+        bool has_calib;
+    };
+    std::unordered_map<std::string, camera_input> cameras;
+
+    std::unordered_map<std::string, or_pose_estimator_state> poses;
+    std::unordered_map<std::string, or_sensor_pixel> pixel_poses;
+    arucotag_stage_latency_s stats_data;
+    uint64_t writes;            // pose, pixel_pose and stats writes
+    uint64_t stats_writes;
+    std::function<void(const char *marker, const or_pose_estimator_state &)> on_pose;
+
+    arucotag_memory_ports();
+
+    const or_sensor_frame *read_frame() { return input_frame; }
+    const or_sensor_frame *frame() { return input_frame; }
+    const or_pose_estimator_state *read_drone() { return has_drone ? &drone : NULL; }
+    const or_sensor_intrinsics *read_intrinsics() { return has_calib ? &intrinsics : NULL; }
+    const or_sensor_extrinsics *read_extrinsics() { return has_calib ? &extrinsics : NULL; }
+
+    bool open_camera(const char *camera);
+    void close_camera(const char *camera) { cameras.erase(camera); }
+    const or_sensor_frame *read_camera(const char *camera);
+    const or_sensor_intrinsics *read_camera_intrinsics(const char *camera);
+    const or_sensor_extrinsics *read_camera_extrinsics(const char *camera);
+
+    bool open(const char *marker);
+    void close(const char *marker);
+    or_pose_estimator_state *pose(const char *marker);
+    or_sensor_pixel *pixel_pose(const char *marker);
+    void write_pose(const char *marker);
+    void write_pixel_pose(const char *marker) { writes++; }
+
+    arucotag_stage_latency_s *stats() { return &stats_data; }
+    void write_stats() { writes++; stats_writes++; }
+};
+
+#endif /* H_ARUCOTAG_PORTS */
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2020 LAAS/CNRS
+ * All rights reserved.
+ *
+ * Redistribution  and  use  in  source  and binary  forms,  with  or  without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * THE SOFTWARE  IS PROVIDED "AS IS"  AND THE AUTHOR  DISCLAIMS ALL WARRANTIES
+ * WITH  REGARD   TO  THIS  SOFTWARE  INCLUDING  ALL   IMPLIED  WARRANTIES  OF
+ * MERCHANTABILITY AND  FITNESS.  IN NO EVENT  SHALL THE AUTHOR  BE LIABLE FOR
+ * ANY  SPECIAL, DIRECT,  INDIRECT, OR  CONSEQUENTIAL DAMAGES  OR  ANY DAMAGES
+ * WHATSOEVER  RESULTING FROM  LOSS OF  USE, DATA  OR PROFITS,  WHETHER  IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR  OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *                                                  Martin Jacquet - June 2020
+ */
+#ifndef H_ARUCOTAG_RECORD
+#define H_ARUCOTAG_RECORD
+
+#include <stdint.h>
+
+/* --- Frame recording format ------------------------------------------- */
+
+/* A recording starts with an arucotag_rec_file header, followed by one
+ * record per frame: an arucotag_rec_frame header and the pixels of the
+ * frame as read from the port (raw or compressed), padded to
+ * arucotag_rec_align bytes. Records are only ever appended. When the
+ * recording is closed, the offsets of the records are appended as an array
+ * of uint64_t, followed by an arucotag_rec_footer. A recording without
+ * footer (e.g. after a crash) is indexed by walking the records.
+ *
+ * Headers have a fixed layout without implicit padding, in host byte order,
+ * and every record starts on an arucotag_rec_align boundary so that mapped
+ * pixels are suitably aligned.
+ */
+#define arucotag_rec_magic	"arucorec"
+#define arucotag_rec_index_magic	"arucoidx"
+#define arucotag_rec_version	1
+#define arucotag_rec_align	64
+
+struct arucotag_rec_file {
+    char magic[8];          // arucotag_rec_magic, not NUL terminated
+    uint16_t version;       // arucotag_rec_version
+    uint16_t frame_size;    // sizeof(arucotag_rec_frame)
+    uint32_t pad[13];
+};
+
+struct arucotag_rec_frame {
+    int32_t sec, nsec;      // timestamp of the frame
+    uint32_t size;          // bytes of pixels that follow
+    uint16_t width, height;
+    uint16_t bpp;           // bytes per pixel, for raw frames
+    uint8_t compressed;     // pixels are an encoded image
+    uint8_t pad0;
+    uint32_t seq;           // index of the record in the recording
+    uint32_t pad[10];
+};
+
+struct arucotag_rec_footer {
+    char magic[8];          // arucotag_rec_index_magic
+    uint64_t index;         // offset of the index
+    uint64_t count;         // number of records
+    uint64_t pad;
+};
+
+static_assert(sizeof(arucotag_rec_file) == arucotag_rec_align, "arucotag_rec_file layout");
+static_assert(sizeof(arucotag_rec_frame) == arucotag_rec_align, "arucotag_rec_frame layout");
+static_assert(sizeof(arucotag_rec_footer) == 32, "arucotag_rec_footer layout");
+
+#endif /* H_ARUCOTAG_RECORD */
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2020 LAAS/CNRS
+ * All rights reserved.
+ *
+ * Redistribution  and  use  in  source  and binary  forms,  with  or  without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * THE SOFTWARE  IS PROVIDED "AS IS"  AND THE AUTHOR  DISCLAIMS ALL WARRANTIES
+ * WITH  REGARD   TO  THIS  SOFTWARE  INCLUDING  ALL   IMPLIED  WARRANTIES  OF
+ * MERCHANTABILITY AND  FITNESS.  IN NO EVENT  SHALL THE AUTHOR  BE LIABLE FOR
+ * ANY  SPECIAL, DIRECT,  INDIRECT, OR  CONSEQUENTIAL DAMAGES  OR  ANY DAMAGES
+ * WHATSOEVER  RESULTING FROM  LOSS OF  USE, DATA  OR PROFITS,  WHETHER  IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR  OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *                                                  Martin Jacquet - June 2020
+ */
+#ifndef H_ARUCOTAG_RING
+#define H_ARUCOTAG_RING
+
+#include <cstddef>
+
+/* --- Ring buffer ------------------------------------------------------ */
+
+/* Fixed capacity ring buffer stored inline. Pushing to a full buffer drops
+ * the oldest element. Elements are indexed from the oldest (0) to the most
+ * recent (size() - 1).
+ */
+template<typename T, size_t N>
+class ring_buffer {
+    T buffer[N];
+    size_t head;    // index of the oldest element
+    size_t count;
+
+public:
+    ring_buffer() : head(0), count(0) {}
+
+    void push(const T &v) {
+        if (count < N)
+            buffer[(head + count++) % N] = v;
+        else {
+            buffer[head] = v;
+            head = (head + 1) % N;
+        }
+    }
+
+    // Push, dropping the oldest elements to keep at most limit elements
+    void push(const T &v, size_t limit) {
+        while (count && count >= limit)
+            pop();
+        push(v);
+    }
+
+    void pop() {
+        head = (head + 1) % N;
+        count--;
+    }
+
+    void clear() { head = count = 0; }
+
+    const T &operator[](size_t i) const { return buffer[(head + i) % N]; }
+    const T &front() const { return buffer[head]; }
+    const T &back() const { return (*this)[count - 1]; }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    static constexpr size_t capacity() { return N; }
+};
+
+#endif /* H_ARUCOTAG_RING */
@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2020 LAAS/CNRS
+ * All rights reserved.
+ *
+ * Redistribution  and  use  in  source  and binary  forms,  with  or  without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * THE SOFTWARE  IS PROVIDED "AS IS"  AND THE AUTHOR  DISCLAIMS ALL WARRANTIES
+ * WITH  REGARD   TO  THIS  SOFTWARE  INCLUDING  ALL   IMPLIED  WARRANTIES  OF
+ * MERCHANTABILITY AND  FITNESS.  IN NO EVENT  SHALL THE AUTHOR  BE LIABLE FOR
+ * ANY  SPECIAL, DIRECT,  INDIRECT, OR  CONSEQUENTIAL DAMAGES  OR  ANY DAMAGES
+ * WHATSOEVER  RESULTING FROM  LOSS OF  USE, DATA  OR PROFITS,  WHETHER  IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR  OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *                                                  Martin Jacquet - June 2020
+ */
+#ifndef H_ARUCOTAG_SPSC
+#define H_ARUCOTAG_SPSC
+
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+
+/* --- Lock-free queue -------------------------------------------------- */
+
+/* Bounded single-producer/single-consumer queue. push() must only be called
+ * from one thread and pop() from one other thread. Both return false instead
+ * of blocking when the queue is respectively full or empty.
+ */
+template<typename T, size_t N>
+class spsc_queue {
+    static_assert(N && !(N & (N - 1)), "capacity must be a power of 2");
+
+    T buffer[N];
+    alignas(64) std::atomic<size_t> head{0};   // next element to pop
+    alignas(64) std::atomic<size_t> tail{0};   // next element to push
+
+public:
+    bool push(const T &v) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == N)
+            return false;
+        buffer[t & (N - 1)] = v;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T &v) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return false;
+        v = buffer[h & (N - 1)];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t size() const {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+
+    static constexpr size_t capacity() { return N; }
+};
+
+
+/* Bounded single-producer/single-consumer byte ring, with a capacity set at
+ * run time and rounded up to a power of 2. The producer writes whole records
+ * or nothing, and the consumer reads back contiguous spans of bytes.
+ */
+class spsc_ring {
+    std::unique_ptr<char[]> buffer;
+    size_t mask;
+    alignas(64) std::atomic<size_t> head{0};   // next byte to read
+    alignas(64) std::atomic<size_t> tail{0};   // next byte to write
+
+public:
+    explicit spsc_ring(size_t capacity) {
+        size_t n = 1;
+        while (n < capacity) n <<= 1;
+        buffer.reset(new char[n]);
+        mask = n - 1;
+    }
+
+    // Producer: append n bytes, returns false if they do not fit
+    bool write(const void *data, size_t n) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (n > mask + 1 - (t - head.load(std::memory_order_acquire)))
+            return false;
+        size_t o = t & mask, first = n < mask + 1 - o ? n : mask + 1 - o;
+        memcpy(&buffer[o], data, first);
+        memcpy(&buffer[0], (const char *)data + first, n - first);
+        tail.store(t + n, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer: longest contiguous span of readable bytes, which stays valid
+    // until consume()
+    size_t peek(const char **data) const {
+        size_t h = head.load(std::memory_order_relaxed);
+        size_t n = tail.load(std::memory_order_acquire) - h;
+        size_t o = h & mask;
+        *data = &buffer[o];
+        return n < mask + 1 - o ? n : mask + 1 - o;
+    }
+
+    // Consumer: release n bytes returned by peek()
+    void consume(size_t n) {
+        head.store(head.load(std::memory_order_relaxed) + n, std::memory_order_release);
+    }
+
+    size_t size() const {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+
+    // Total number of bytes written so far (producer), and read so far
+    // (consumer)
+    size_t produced() const { return tail.load(std::memory_order_relaxed); }
+    size_t consumed() const { return head.load(std::memory_order_relaxed); }
+
+    size_t capacity() const { return mask + 1; }
+};
+
+#endif /* H_ARUCOTAG_SPSC */
@@ -0,0 +1,369 @@
+/*
+ * Copyright (c) 2020 LAAS/CNRS
+ * All rights reserved.
+ *
+ * Redistribution  and  use  in  source  and binary  forms,  with  or  without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * THE SOFTWARE  IS PROVIDED "AS IS"  AND THE AUTHOR  DISCLAIMS ALL WARRANTIES
+ * WITH  REGARD   TO  THIS  SOFTWARE  INCLUDING  ALL   IMPLIED  WARRANTIES  OF
+ * MERCHANTABILITY AND  FITNESS.  IN NO EVENT  SHALL THE AUTHOR  BE LIABLE FOR
+ * ANY  SPECIAL, DIRECT,  INDIRECT, OR  CONSEQUENTIAL DAMAGES  OR  ANY DAMAGES
+ * WHATSOEVER  RESULTING FROM  LOSS OF  USE, DATA  OR PROFITS,  WHETHER  IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR  OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+/* Tests of the detect task, run by make check.
+ *
+ * The codels of the detect task run on the ports in memory of the stand-in
+ * runtime, as the genom server schedules them: detect_wait, then
+ * detect_poll, detect_main and detect_log for each frame. The frames are
+ * scripted: tracked tags rendered at known poses next to an untracked one, a
+ * frame without tags, a frame without data and a repeated timestamp, then
+ * frames of another camera with predictive polling. The published poses and
+ * pixels, the number of port writes and the text log are checked. The mean
+ * time per frame is reported.
+ *
+ * Exits with status 1 if any check fails.
+ */
+#include "bench_runtime.hpp"
+
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+
+static int failures = 0;
+
+#define check(cond, ...)                                                \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: ", __FILE__, __LINE__);             \
+            fprintf(stderr, __VA_ARGS__);                               \
+            fputc('\n', stderr);                                        \
+            failures++;                                                 \
+        }                                                               \
+    } while (0)
+
+static const int width = 640, height = 480;
+static const double fx = 500, cx = 320, cy = 240;
+static const double length = 0.1;       // marker length (m)
+static const int frames = 30;           // frames of the timing loop
+
+/* A tag of a scene, at pose (R, t) in camera frame */
+struct tag_truth {
+    int id;
+    Matrix3d R;
+    Vector3d t;
+};
+
+/* Facing the camera, tilted by the given angle (rad) about an axis of the
+ * tag plane at angle a */
+static tag_truth
+tag(int id, double x, double y, double z, double tilt, double a)
+{
+    tag_truth g;
+    g.id = id;
+    g.R = (AngleAxisd(M_PI, Vector3d::UnitX()) *
+           AngleAxisd(tilt, Vector3d(cos(a), sin(a), 0))).toRotationMatrix();
+    g.t = Vector3d(x, y, z);
+    return g;
+}
+
+/* Render the tags on a gray background and wrap the image in a frame */
+static void
+render(const bench_component &c, const vector<tag_truth> &tags, int32_t sec,
+       Mat &image, or_sensor_frame &f)
+{
+    const Mat K = (Mat_<double>(3,3) << fx, 0, cx, 0, fx, cy, 0, 0, 1);
+    image.create(height, width, CV_8UC1);
+    image.setTo(Scalar(128));
+    for (const tag_truth &g : tags)
+        bench_draw_tag(image, c.ids.detect->dict, g.id, length, fx*length/g.t(2), K, g.R, g.t);
+
+    memset(&f, 0, sizeof(f));
+    f.ts.sec = sec;
+    f.width = width;
+    f.height = height;
+    f.bpp = 1;
+    f.pixels._maximum = f.pixels._length = image.total();
+    f.pixels._buffer = image.data;
+}
+
+/* Events of one activation of the task on the frame port: detect_poll, then
+ * detect_main and detect_log if they are yielded to, NULL otherwise */
+struct activation {
+    genom_event poll, main, log;
+};
+
+static activation
+run(bench_component &c)
+{
+    arucotag_ids &ids = c.ids;
+    activation a = { NULL, NULL, NULL };
+    a.poll = detect_poll(c.io, ids.stopped, &ids.ports, &ids.last_ts, ids.poll_mode,
+                         &ids.poll, ids.pipe, &ids.timing, &ids.record, &ids.replay,
+                         &ids.cameras, ids.detect, c.self);
+    if (a.poll != arucotag_main) return a;
+    a.main = detect_main(c.io, ids.tag_info.s_pix, ids.calib, &ids.detect, &ids.ports,
+                         ids.out_frame, ids.pipeline, &ids.pipe, &ids.timing, ids.replay,
+                         &ids.cameras, c.self);
+    if (a.main == arucotag_log)
+        a.log = detect_log(c.io, ids.detect, ids.out_frame, &ids.log, &ids.timing, c.self);
+    return a;
+}
+
+/* Pose and pixel writes, without the stats */
+static uint64_t
+tag_writes(const bench_component &c)
+{
+    return c.io.writes - c.io.stats_writes;
+}
+
+/* The pose and pixel of a tracked tag are published for frame sec, close to
+ * the truth */
+static void
+check_tag(const bench_component &c, const tag_truth &g, int32_t sec)
+{
+    string name = std::to_string(g.id);
+    auto p = c.io.poses.find(name);
+    auto px = c.io.pixel_poses.find(name);
+    check(p != c.io.poses.end() && px != c.io.pixel_poses.end(), "tag %d: no ports", g.id);
+    if (p == c.io.poses.end() || px == c.io.pixel_poses.end()) return;
+
+    const or_pose_estimator_state &s = p->second;
+    check(s.ts.sec == sec, "tag %d: pose of frame %d, expected %d", g.id, s.ts.sec, sec);
+    check(s.pos._present && s.att._present && s.pos_cov._present && s.att_cov._present,
+          "tag %d: pose not published", g.id);
+    if (!s.pos._present || !s.att._present) return;
+
+    Vector3d position(s.pos._value.x, s.pos._value.y, s.pos._value.z);
+    double dp = (position - g.t).norm();
+    check(dp < 0.01 * g.t.norm(), "tag %d: position error %g m", g.id, dp);
+    Quaterniond q(s.att._value.qw, s.att._value.qx, s.att._value.qy, s.att._value.qz);
+    double dq = q.angularDistance(Quaterniond(g.R));
+    check(dq < 2 * M_PI/180, "tag %d: orientation error %g deg", g.id, dq * 180/M_PI);
+    check(s.pos_cov._value.cov[0] > 0 && s.pos_cov._value.cov[2] > 0 &&
+          s.pos_cov._value.cov[5] > 0, "tag %d: position variance not positive", g.id);
+
+    const or_sensor_pixel &pix = px->second;
+    double u = fx * g.t(0)/g.t(2) + cx, v = fx * g.t(1)/g.t(2) + cy;
+    check(pix.ts.sec == sec, "tag %d: pixel of frame %d, expected %d", g.id, pix.ts.sec, sec);
+    check(pix.pix._present && fabs(pix.pix._value.x - u) < 2 && fabs(pix.pix._value.y - v) < 2,
+          "tag %d: pixel (%d, %d), expected (%.1f, %.1f)", g.id,
+          (int)pix.pix._value.x, (int)pix.pix._value.y, u, v);
+}
+
+/* The pose and pixel of a tracked tag are published absent for frame sec */
+static void
+check_absent(const bench_component &c, int id, int32_t sec)
+{
+    string name = std::to_string(id);
+    auto p = c.io.poses.find(name);
+    auto px = c.io.pixel_poses.find(name);
+    check(p != c.io.poses.end() && px != c.io.pixel_poses.end(), "tag %d: no ports", id);
+    if (p == c.io.poses.end() || px == c.io.pixel_poses.end()) return;
+
+    const or_pose_estimator_state &s = p->second;
+    check(s.ts.sec == sec && px->second.ts.sec == sec,
+          "tag %d: absence of frame %d, expected %d", id, s.ts.sec, sec);
+    check(!s.pos._present && !s.att._present && !s.pos_cov._present && !s.att_cov._present &&
+          !px->second.pix._present, "tag %d: published, expected absent", id);
+}
+
+
+int
+main()
+{
+    static bench_component c;
+    c.io.intrinsics.calib.fx = c.io.intrinsics.calib.fy = fx;
+    c.io.intrinsics.calib.cx = cx;
+    c.io.intrinsics.calib.cy = cy;
+    unsigned cores = std::thread::hardware_concurrency();
+    if (!c.init(length) || !c.track(0) || !c.track(1) ||
+        !c.configure(false, std::min(2u, std::max(cores, 1u)), 0, 0))
+        errx(2, "cannot set up the component");
+
+    // Text log of the tracked tags, with the id in the third column
+    char path[] = "/tmp/arucotag-test-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) err(2, "mkstemp");
+    close(fd);
+    if (log_start(path, 1, false, 0, 0, &c.ids.log, c.self) != genom_ok)
+        errx(2, "cannot log to %s", path);
+    int logged[2] = { 0, 0 };
+
+    Mat image;
+    or_sensor_frame f;
+    activation a;
+    uint64_t w;
+
+    // Tracked tags 0 and 1, untracked tag 7
+    vector<tag_truth> scene_a = {
+        tag(0, -0.15,  0.00, 0.8, 0.3, 0.),
+        tag(1,  0.15,  0.05, 1.0, 0.4, M_PI/2),
+        tag(7,  0.00, -0.15, 0.9, 0.2, M_PI/4),
+    };
+    render(c, scene_a, 1, image, f);
+    c.io.input_frame = &f;
+    w = tag_writes(c);
+    a = run(c);
+    check(a.poll == arucotag_main, "tags: poll yields %s", a.poll);
+    check(a.main == arucotag_log, "tags: main yields %s", a.main ? a.main : "nothing");
+    check(a.log == arucotag_poll, "tags: log yields %s", a.log ? a.log : "nothing");
+    check(tag_writes(c) - w == 4, "tags: %d writes, expected 4", (int)(tag_writes(c) - w));
+    check_tag(c, scene_a[0], 1);
+    check_tag(c, scene_a[1], 1);
+    check(!c.io.poses.count("7") && !c.io.pixel_poses.count("7"), "untracked tag 7 published");
+    logged[0]++; logged[1]++;
+
+    // The same frame again is not processed, even if detect_main runs
+    w = tag_writes(c);
+    a = run(c);
+    check(a.poll == arucotag_poll, "repeated timestamp: poll yields %s", a.poll);
+    a.main = detect_main(c.io, c.ids.tag_info.s_pix, c.ids.calib, &c.ids.detect, &c.ids.ports,
+                         c.ids.out_frame, c.ids.pipeline, &c.ids.pipe, &c.ids.timing,
+                         c.ids.replay, &c.ids.cameras, c.self);
+    check(a.main == arucotag_poll, "repeated timestamp: main yields %s", a.main);
+    check(tag_writes(c) == w, "repeated timestamp: %d writes", (int)(tag_writes(c) - w));
+    check_tag(c, scene_a[0], 1);
+
+    // A frame without data is not processed
+    or_sensor_frame empty;
+    memset(&empty, 0, sizeof(empty));
+    empty.ts.sec = 2;
+    c.io.input_frame = &empty;
+    w = tag_writes(c);
+    a = run(c);
+    check(a.poll == arucotag_poll, "empty frame: poll yields %s", a.poll);
+    check(tag_writes(c) == w, "empty frame: %d writes", (int)(tag_writes(c) - w));
+
+    // Without tags, the tracked tags are published absent
+    render(c, {}, 3, image, f);
+    c.io.input_frame = &f;
+    w = tag_writes(c);
+    a = run(c);
+    check(a.poll == arucotag_main, "no tags: poll yields %s", a.poll);
+    check(a.main == arucotag_poll, "no tags: main yields %s", a.main ? a.main : "nothing");
+    check(tag_writes(c) - w == 4, "no tags: %d writes, expected 4", (int)(tag_writes(c) - w));
+    check_absent(c, 0, 3);
+    check_absent(c, 1, 3);
+
+    // One tracked tag moved, the other one absent
+    vector<tag_truth> scene_b = {
+        tag(1,  0.10,  0.10, 0.9, 0.5, M_PI),
+        tag(7, -0.10, -0.10, 0.7, 0.1, 0.),
+    };
+    render(c, scene_b, 4, image, f);
+    w = tag_writes(c);
+    a = run(c);
+    check(a.main == arucotag_log, "one tag: main yields %s", a.main ? a.main : "nothing");
+    check(tag_writes(c) - w == 4, "one tag: %d writes, expected 4", (int)(tag_writes(c) - w));
+    check_absent(c, 0, 4);
+    check_tag(c, scene_b[0], 4);
+    logged[1]++;
+
+    // Mean time per frame and allocations, reported only. The time is
+    // bounded if ARUCOTAG_TEST_FRAME_MS is set, on a machine known to be
+    // quiet: bench_scenes and bench_replay are the place for timing.
+    render(c, scene_a, 0, image, f);
+    uint64_t allocations = bench_allocations();
+    double t0 = bench_now();
+    for (int i = 0; i < frames; i++) {
+        f.ts.sec = 10 + i;
+        a = run(c);
+        check(a.log == arucotag_poll, "frame %d: not logged", 10 + i);
+    }
+    double frame = (bench_now() - t0) / frames;
+    allocations = bench_allocations() - allocations;
+    if (const char *max = getenv("ARUCOTAG_TEST_FRAME_MS"))
+        check(frame * 1e3 < atof(max), "%.1f ms per frame, expected less than %s ms",
+              frame * 1e3, max);
+    if (bench_allocations_counted)
+        printf("%.1f ms and %.1f allocations per frame\n", frame * 1e3,
+               (double)allocations / frames);
+    else
+        printf("%.1f ms per frame\n", frame * 1e3);
+    check_tag(c, scene_a[0], 10 + frames - 1);
+    check_tag(c, scene_a[1], 10 + frames - 1);
+    logged[0] += frames; logged[1] += frames;
+
+    // One line per tracked tag logged, after the header
+    if (log_stop(&c.ids.log, c.self) != genom_ok)
+        errx(2, "cannot stop logging");
+    FILE *log = fopen(path, "r");
+    if (!log) err(2, "%s", path);
+    char line[1024];
+    int lines = 0, ids[2] = { 0, 0 }, others = 0;
+    while (fgets(line, sizeof(line), log)) {
+        if (lines++ == 0) continue;
+        char id[16];
+        if (sscanf(line, "%*s %*d %15s", id) != 1)
+            others++;
+        else if (!strcmp(id, "0"))
+            ids[0]++;
+        else if (!strcmp(id, "1"))
+            ids[1]++;
+        else
+            others++;
+    }
+    fclose(log);
+    unlink(path);
+    check(lines > 0, "log: no header");
+    check(ids[0] == logged[0] && ids[1] == logged[1] && !others,
+          "log: %d, %d and %d lines for tags 0, 1 and others, expected %d, %d and 0",
+          ids[0], ids[1], others, logged[0], logged[1]);
+
+    // With another camera in predictive mode, the task does not sleep until
+    // the next frame of the frame port, one second away, and each frame of
+    // the camera is published
+    c.ids.poll_mode = 1;
+    render(c, scene_a, 100, image, f);
+    run(c);
+    f.ts.sec = 101;
+    run(c);
+    check(c.ids.poll->armed, "predictive mode: no frame predicted");
+
+    const char camera[16] = "camera";
+    check(add_camera(c.io, camera, &c.ids.cameras, c.ids.detect, c.self) == arucotag_ether,
+          "cannot add a camera");
+    arucotag_memory_ports::camera_input &input = c.io.cameras[camera];
+    input.intrinsics = c.io.intrinsics;
+    input.extrinsics = c.io.extrinsics;
+    input.has_calib = true;
+    const arucotag_camera *cam = c.ids.cameras->find(camera);
+
+    Mat camera_image;
+    or_sensor_frame camera_frame;
+    render(c, scene_a, 200, camera_image, camera_frame);
+    input.frame = &camera_frame;
+    double longest = 0;
+    for (int i = 0; i < 5; i++) {
+        camera_frame.ts.sec = 200 + i;
+        double t = bench_now();
+        for (int k = 0; cam->processed <= (uint32_t)i && k < 10000; k++) {
+            double t0 = bench_now();
+            run(c);
+            longest = std::max(longest, bench_now() - t0);
+        }
+        check(cam->processed == (uint32_t)i + 1, "camera: frame %d not published", 200 + i);
+        check_tag(c, scene_a[0], 200 + i);
+        check_tag(c, scene_a[1], 200 + i);
+        printf("camera frame %d published in %.1f ms\n", 200 + i, (bench_now() - t) * 1e3);
+    }
+    check(longest < 0.5, "camera: the task slept %.0f ms, as for the frame port", longest * 1e3);
+    remove_camera(c.io, camera, &c.ids.cameras, c.self);
+
+    c.stop();
+    if (failures)
+        fprintf(stderr, "%d checks failed\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2020 LAAS/CNRS
+ * All rights reserved.
+ *
+ * Redistribution  and  use  in  source  and binary  forms,  with  or  without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * THE SOFTWARE  IS PROVIDED "AS IS"  AND THE AUTHOR  DISCLAIMS ALL WARRANTIES
+ * WITH  REGARD   TO  THIS  SOFTWARE  INCLUDING  ALL   IMPLIED  WARRANTIES  OF
+ * MERCHANTABILITY AND  FITNESS.  IN NO EVENT  SHALL THE AUTHOR  BE LIABLE FOR
+ * ANY  SPECIAL, DIRECT,  INDIRECT, OR  CONSEQUENTIAL DAMAGES  OR  ANY DAMAGES
+ * WHATSOEVER  RESULTING FROM  LOSS OF  USE, DATA  OR PROFITS,  WHETHER  IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR  OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *                                                  Martin Jacquet - June 2020
+ */
+
+/* Test of the square tag PnP (ippe.hpp) against cv::solvePnPGeneric with
+ * SOLVEPNP_IPPE_SQUARE, run by make check.
+ *
+ * Random tags facing the camera within 60 degrees, with half a pixel of
+ * noise on the corners, are solved by both, with and without distortion.
+ * Both solutions and their reprojection errors must match opencv within
+ * the tolerances below. Without noise and distortion, the best solution
+ * must also match the pose the corners were projected from.
+ *
+ * Exits with status 1 if any check fails.
+ */
+#include "ippe.hpp"
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/core/eigen.hpp>
+
+#include <cstdio>
+#include <random>
+#include <vector>
+
+using namespace Eigen;
+using namespace cv;
+using std::vector;
+
+static const int tags = 1000;           // random tags per camera
+
+/* The corners are floats, opencv undistorts them to floats. Their rounding
+ * alone moves the rotation of small, nearly fronto-parallel tags by up to
+ * 3e-4 rad (the native solver against the true pose, on 1e5 such tags), so
+ * two implementations may differ by as much. The tolerances are a few times
+ * above, and far below the differences of a wrong solution or order.
+ */
+static const double tol_q = 1e-3;       // rotation (rad)
+static const double tol_t = 1e-3;       // translation, relative to the distance
+static const double tol_e = 1e-2;       // reprojection error (px)
+
+static Quaterniond
+cvaa2eigenquat(Vec3d r)
+{
+    AngleAxisd aa;
+    aa.angle() = norm(r);
+    cv2eigen(r/aa.angle(), aa.axis());
+
+    return (Quaterniond) aa;
+}
+
+/* Compare ippe_square with opencv on random tags seen by camera K_cv, D,
+ * with noise on the corners (px), and with the true pose without noise.
+ * Returns the number of failed tags.
+ */
+static int
+compare(const char *name, const Mat &K_cv, const Mat &D, double noise)
+{
+    // Same layout as update_calib and set_length
+    const double half = 0.05;
+    Mat corners_marker = (Mat_<double>(4,3) <<
+        -half,  half, 0,
+         half,  half, 0,
+         half, -half, 0,
+        -half, -half, 0);
+
+    ippe_camera cam;
+    cam.fx = K_cv.at<float>(0,0);
+    cam.fy = K_cv.at<float>(1,1);
+    cam.cx = K_cv.at<float>(0,2);
+    cam.cy = K_cv.at<float>(1,2);
+    for (int i = 0; i < 5; i++)
+        cam.d[i] = D.at<float>(i);
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<double> u(-1, 1);
+    vector<Point2f> corners;
+    vector<Vec3d> rotations, translations;
+    Mat1f reproj_error(2, 1);
+    double err_q = 0, err_t = 0, err_e = 0;
+    int failed = 0, swapped = 0;
+    for (int i = 0; i < tags; i++) {
+        Vector3d axis(u(rng), u(rng), 0.2*u(rng));
+        Matrix3d R = AngleAxisd(M_PI + (M_PI/3)*u(rng)*0.5, axis.normalized()).toRotationMatrix();
+        Mat R_cv, rvec;
+        eigen2cv(R, R_cv);
+        Rodrigues(R_cv, rvec);
+        Vec3d tvec(0.5*u(rng), 0.3*u(rng), 1.5 + u(rng));
+        projectPoints(corners_marker, rvec, tvec, K_cv, D, corners);
+        if (noise > 0)
+            for (Point2f &c : corners)
+                c += Point2f(noise*u(rng), noise*u(rng));
+
+        solvePnPGeneric(corners_marker, corners, K_cv, D, rotations, translations,
+                        false, SOLVEPNP_IPPE_SQUARE, noArray(), noArray(), reproj_error);
+        ippe_pose pose[2];
+        int n = ippe_square(cam, half, corners.data(), pose);
+        if (n != 2 || rotations.size() != 2) {
+            fprintf(stderr, "%s: tag %d: %d solutions, opencv %d\n", name, i, n,
+                    (int)rotations.size());
+            failed++;
+            continue;
+        }
+
+        // The order may differ when both have the same reprojection error
+        int o = 0;
+        if (cvaa2eigenquat(rotations[0]).angularDistance(pose[0].q) >
+            cvaa2eigenquat(rotations[0]).angularDistance(pose[1].q)) {
+            o = 1;
+            swapped++;
+        }
+        if (o && std::fabs(pose[0].error - pose[1].error) > tol_e) {
+            fprintf(stderr, "%s: tag %d: solutions in different order\n", name, i);
+            failed++;
+            continue;
+        }
+
+        double dq = 0, dt = 0, de = 0;
+        for (int s = 0; s < 2; s++) {
+            const ippe_pose &p = pose[s ^ o];
+            Vector3d t(translations[s][0], translations[s][1], translations[s][2]);
+            dq = std::max(dq, cvaa2eigenquat(rotations[s]).angularDistance(p.q));
+            dt = std::max(dt, (p.t - t).norm() / t.norm());
+            de = std::max(de, std::fabs(p.error - reproj_error.at<float>(s)));
+        }
+        if (dq > tol_q || dt > tol_t || de > tol_e) {
+            fprintf(stderr, "%s: tag %d: rotation %g rad, translation %g, error %g px\n",
+                    name, i, dq, dt, de);
+            failed++;
+        }
+        else if (noise == 0) {
+            Vector3d t(tvec[0], tvec[1], tvec[2]);
+            double tq = pose[0].q.angularDistance(Quaterniond(R));
+            double tt = (pose[0].t - t).norm() / t.norm();
+            if (tq > tol_q || tt > tol_t) {
+                fprintf(stderr, "%s: tag %d: rotation %g rad, translation %g from the truth\n",
+                        name, i, tq, tt);
+                failed++;
+            }
+        }
+        err_q = std::max(err_q, dq);
+        err_t = std::max(err_t, dt);
+        err_e = std::max(err_e, de);
+    }
+    printf("%s: max difference: rotation %g rad, translation %g, error %g px, "
+           "%d swapped, %d failed\n", name, err_q, err_t, err_e, swapped, failed);
+    return failed;
+}
+
+int
+main()
+{
+    Mat K_cv = (Mat_<float>(3,3) <<
+        800, 0.1, 640,
+          0, 800, 360,
+          0,   0,   1);
+    Mat D = (Mat_<float>(5,1) << -0.12, 0.08, -0.01, 0.001, -0.0005);
+
+    Mat D0 = Mat::zeros(5, 1, CV_32F);
+
+    int failed = compare("distorted", K_cv, D, 0.5);
+    failed += compare("pinhole", K_cv, D0, 0.5);
+    failed += compare("exact", K_cv, D0, 0);
+    return failed ? 1 : 0;
+}
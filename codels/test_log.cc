@@ -0,0 +1,272 @@
+/*
+ * Copyright (c) 2020 LAAS/CNRS
+ * All rights reserved.
+ *
+ * Redistribution  and  use  in  source  and binary  forms,  with  or  without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * THE SOFTWARE  IS PROVIDED "AS IS"  AND THE AUTHOR  DISCLAIMS ALL WARRANTIES
+ * WITH  REGARD   TO  THIS  SOFTWARE  INCLUDING  ALL   IMPLIED  WARRANTIES  OF
+ * MERCHANTABILITY AND  FITNESS.  IN NO EVENT  SHALL THE AUTHOR  BE LIABLE FOR
+ * ANY  SPECIAL, DIRECT,  INDIRECT, OR  CONSEQUENTIAL DAMAGES  OR  ANY DAMAGES
+ * WHATSOEVER  RESULTING FROM  LOSS OF  USE, DATA  OR PROFITS,  WHETHER  IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR  OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *                                                  Martin Jacquet - June 2020
+ */
+
+/* Test of the log writer (arucotag_log_s), run by make check.
+ *
+ * The writer thread is held by a signal while entries are queued, so that
+ * it then writes large batches: with io_uring, all the buffers are in
+ * flight and each one takes several writes, as arucotag_log.cc is built
+ * here with a small arucotag_log_uring_write_max. The log is rotated
+ * several times, and filled until entries are refused. The files must hold
+ * exactly the entries accepted, in order, each file starting with the
+ * header and within the rotation size.
+ *
+ * Exits with status 1 if any check fails.
+ */
+#include "acarucotag.h"
+
+#include "arucotag_c_types.h"
+
+#include "codels.hpp"
+
+#include <signal.h>
+#include <sys/stat.h>
+
+#include <cstdio>
+#include <cstdlib>
+
+static int failures = 0;
+
+#define check(cond, ...)                                                \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: ", __FILE__, __LINE__);             \
+            fprintf(stderr, __VA_ARGS__);                               \
+            fputc('\n', stderr);                                        \
+            failures++;                                                 \
+        }                                                               \
+    } while (0)
+
+static const size_t entry = 1000;       // bytes per entry, newline included
+
+
+/* --- Writer thread ---------------------------------------------------- */
+
+/* The writer thread waits in the handler of SIGUSR1 until resumed. It is
+ * interrupted wherever it is, and carries on as after any signal.
+ */
+static sem_t held, resumed;
+
+static void
+hold_handler(int)
+{
+    int e = errno;
+    sem_post(&held);
+    while (sem_wait(&resumed) && errno == EINTR)
+        /* empty body */;
+    errno = e;
+}
+
+static void
+hold(arucotag_log_s &log)
+{
+    pthread_kill(log.writer.native_handle(), SIGUSR1);
+    while (sem_wait(&held) && errno == EINTR)
+        /* empty body */;
+}
+
+static void
+resume()
+{
+    sem_post(&resumed);
+}
+
+
+/* --- Entries ---------------------------------------------------------- */
+
+static void
+format(size_t k, char *p)
+{
+    int n = snprintf(p, entry, "%08zu ", k);
+    memset(p + n, 'a' + k % 26, entry - n - 1);
+    p[entry - 1] = '\n';
+}
+
+static const vector<char> header(arucotag_log_header "\n",
+                                 arucotag_log_header "\n" + sizeof(arucotag_log_header));
+
+/* Start logging to path, with the header written, as log_start does */
+static void
+start(arucotag_log_s &log, const string &path, size_t capacity, size_t rotate)
+{
+    int fd = open(path.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    if (fd < 0) err(2, "%s", path.c_str());
+    if (write(fd, header.data(), header.size()) != (ssize_t)header.size())
+        err(2, "%s", path.c_str());
+    log.start(path.c_str(), fd, header, capacity, rotate);
+}
+
+/* Read the files of the rotation of path, removing them, and check that they
+ * hold the given entries. Returns the number of files, and their bytes.
+ */
+static unsigned
+verify(const char *test, const string &path, const vector<size_t> &entries, size_t rotate,
+       size_t &bytes)
+{
+    size_t next = 0;
+    char line[entry];
+    unsigned i;
+    bytes = 0;
+    for (i = 0;; i++) {
+        string name = i ? path + "." + to_string(i) : path;
+        FILE *f = fopen(name.c_str(), "r");
+        if (!f) break;
+
+        struct stat st;
+        if (fstat(fileno(f), &st)) err(2, "%s", name.c_str());
+        bytes += st.st_size;
+        check(!rotate || (size_t)st.st_size <= rotate, "%s: %s: %zu bytes, rotating at %zu",
+              test, name.c_str(), (size_t)st.st_size, rotate);
+
+        vector<char> h(header.size());
+        check(fread(h.data(), 1, h.size(), f) == h.size() && h == header,
+              "%s: %s: no header", test, name.c_str());
+
+        size_t n, lines = 0;
+        while ((n = fread(line, 1, entry, f)) > 0) {
+            lines++;
+            char expected[entry];
+            if (next < entries.size())
+                format(entries[next], expected);
+            if (n != entry || next >= entries.size() || memcmp(line, expected, entry)) {
+                check(false, "%s: %s: entry %zu is not entry %zu", test, name.c_str(),
+                      lines, next < entries.size() ? entries[next] : (size_t)-1);
+                break;
+            }
+            next++;
+        }
+        check(lines > 0, "%s: %s: no entries", test, name.c_str());
+        fclose(f);
+        unlink(name.c_str());
+    }
+    check(next == entries.size(), "%s: %zu entries, expected %zu", test, next, entries.size());
+    return i;
+}
+
+
+/* --- Tests ------------------------------------------------------------ */
+
+/* Rotation of entries queued while the writer is held, each file larger than
+ * all the io_uring buffers.
+ */
+static void
+test_rotate(const string &path)
+{
+    const size_t files = 3, rotate = 2*arucotag_log_rotate_min;
+    const size_t n = files * rotate / entry - 2*files;
+    arucotag_log_s log;
+    start(log, path, n * entry, rotate);
+    hold(log);
+
+    vector<size_t> entries;
+    char p[entry];
+    for (size_t k = 0; k < n; k++) {
+        format(k, p);
+        check(log.push(p, entry), "rotate: entry %zu refused", k);
+        entries.push_back(k);
+    }
+    resume();
+    log.stop();
+
+    check(!log.failed, "rotate: writer failed");
+    size_t bytes;
+    unsigned f = verify("rotate", path, entries, rotate, bytes);
+    check(f == files, "rotate: %u files, expected %zu", f, files);
+    check(log.written + header.size() == bytes, "rotate: %zu bytes written, %zu in files",
+          (size_t)log.written + header.size(), bytes);
+    printf("rotate: %zu entries in %zu bytes, io_uring %s\n", n, bytes,
+           log.uring ? "used" : "not used");
+}
+
+/* Entries are refused when the ring is full or when they cannot fit, and
+ * accepted again once the writer has caught up.
+ */
+static void
+test_full(const string &path)
+{
+    arucotag_log_s log;
+    start(log, path, 0, 0);
+    hold(log);
+
+    vector<size_t> entries;
+    char p[entry];
+    size_t k = 0;
+    for (; k < 2 * arucotag_log_capacity_min / entry; k++) {
+        format(k, p);
+        if (!log.push(p, entry)) break;
+        entries.push_back(k);
+    }
+    check(k < 2 * arucotag_log_capacity_min / entry, "full: no entry refused");
+    check(log.high_water + entry > log.ring->capacity(),
+          "full: %zu bytes queued out of %zu", log.high_water, log.ring->capacity());
+    for (size_t i = 0; i < 10; i++) {
+        format(++k, p);
+        check(!log.push(p, entry), "full: entry %zu accepted in a full ring", k);
+    }
+    vector<char> big(log.ring->capacity() + 1, 'x');
+    check(!log.push(big.data(), big.size()) && log.oversized, "full: oversized entry accepted");
+    resume();
+
+    // Accepted again as the writer drains the ring
+    for (size_t i = 0; i < 100; i++) {
+        format(++k, p);
+        while (!log.push(p, entry))
+            usleep(1000);
+        entries.push_back(k);
+    }
+    log.stop();
+
+    check(!log.failed, "full: writer failed");
+    size_t bytes;
+    verify("full", path, entries, 0, bytes);
+    printf("full: %zu entries accepted, %zu in the ring\n", entries.size(),
+           (size_t)(log.high_water / entry));
+}
+
+
+int
+main()
+{
+    sem_init(&held, 0, 0);
+    sem_init(&resumed, 0, 0);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = hold_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+
+    const char *tmp = getenv("TMPDIR");
+    string dir = string(tmp && *tmp ? tmp : "/tmp") + "/arucotag-test-XXXXXX";
+    if (!mkdtemp(&dir[0])) err(2, "mkdtemp");
+    string path = dir + "/log";
+
+    test_rotate(path);
+    test_full(path);
+
+    rmdir(dir.c_str());
+    if (failures)
+        fprintf(stderr, "%d checks failed\n", failures);
+    return failures ? 1 : 0;
+}